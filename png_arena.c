@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "png_arena.h"
+
+// a cache line, more than any load or store in the kernels needs
+#define PNG_ARENA_ALIGN 64
+
+// the smallest block worth a malloc, enough for zlib's state and window
+#define PNG_ARENA_BLOCK_MIN (64u << 10)
+
+struct png_arena_block {
+	struct png_arena_block *next;
+	size_t size; // usable bytes, from the first aligned address on
+	size_t used;
+};
+
+static inline __attribute__((always_inline)) uint8_t *png_arena_data(struct png_arena_block *block) {
+	uintptr_t data = (uintptr_t)(block + 1);
+	return (uint8_t *)((data + PNG_ARENA_ALIGN - 1) & ~(uintptr_t)(PNG_ARENA_ALIGN - 1));
+}
+
+void png_arena_init(struct png_arena *arena) {
+	arena->blocks = NULL;
+	arena->allocations = 0;
+}
+
+void png_arena_free(struct png_arena *arena) {
+	struct png_arena_block *block = arena->blocks;
+
+	while (block) {
+		struct png_arena_block *next = block->next;
+		free(block);
+		block = next;
+	}
+
+	arena->blocks = NULL;
+}
+
+// a new block with room for at least size bytes, at least twice the size of
+// the one before so a decode only ever needs a handful
+static struct png_arena_block *png_arena_grow(struct png_arena *arena, size_t size) {
+	size_t capacity = PNG_ARENA_BLOCK_MIN;
+	size_t overhead = sizeof(struct png_arena_block) + PNG_ARENA_ALIGN - 1;
+
+	if (arena->blocks && arena->blocks->size > capacity / 2)
+		capacity = arena->blocks->size <= SIZE_MAX / 2 ? arena->blocks->size * 2 : SIZE_MAX;
+
+	if (capacity < size)
+		capacity = size;
+
+	if (capacity > SIZE_MAX - overhead)
+		capacity = SIZE_MAX - overhead;
+
+	if (capacity < size)
+		return NULL;
+
+	struct png_arena_block *block = malloc(overhead + capacity);
+	if (!block)
+		return NULL;
+
+	block->next = arena->blocks;
+	block->size = capacity;
+	block->used = 0;
+
+	arena->blocks = block;
+	arena->allocations++;
+	return block;
+}
+
+void *png_arena_alloc(struct png_arena *arena, size_t size) {
+	if (size > SIZE_MAX - PNG_ARENA_ALIGN)
+		return NULL;
+
+	// keep the next allocation aligned too
+	size = (size + PNG_ARENA_ALIGN - 1) & ~(size_t)(PNG_ARENA_ALIGN - 1);
+	if (!size)
+		size = PNG_ARENA_ALIGN;
+
+	struct png_arena_block *block = arena->blocks;
+
+	if (!block || block->size - block->used < size) {
+		block = png_arena_grow(arena, size);
+		if (!block)
+			return NULL;
+	}
+
+	uint8_t *ptr = png_arena_data(block) + block->used;
+	block->used += size;
+	return ptr;
+}
+
+void png_arena_reset(struct png_arena *arena) {
+	struct png_arena_block *block = arena->blocks;
+	if (!block)
+		return;
+
+	if (!block->next) {
+		block->used = 0;
+		return;
+	}
+
+	size_t total = 0;
+	for (; block; block = block->next)
+		total = total + block->size < total ? SIZE_MAX : total + block->size;
+
+	// without the memory for the merged block the arena just starts over
+	png_arena_free(arena);
+	png_arena_grow(arena, total);
+}
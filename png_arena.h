@@ -0,0 +1,30 @@
+#ifndef PNG_ARENA_H
+#define PNG_ARENA_H
+
+#include <stddef.h>
+
+// a bump allocator for whatever a decode needs until it returns: scanlines,
+// zlib's state and window, and with libdeflate the inflated image data.
+// nothing is freed on its own, a reset hands it all back at once and keeps
+// the memory for the next decode
+struct png_arena_block;
+
+struct png_arena {
+	struct png_arena_block *blocks; // the newest first
+	size_t allocations; // blocks ever malloc'd, for the stats
+};
+
+void png_arena_init(struct png_arena *arena);
+
+// give all the memory back to the system, the arena stays usable
+void png_arena_free(struct png_arena *arena);
+
+// size bytes aligned for any use, including the simd kernels, or NULL
+void *png_arena_alloc(struct png_arena *arena, size_t size);
+
+// forget every allocation; when they took more than one block the blocks
+// are merged into one, so the next decode of a similar image fits without
+// allocating at all
+void png_arena_reset(struct png_arena *arena);
+
+#endif
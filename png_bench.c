@@ -0,0 +1,916 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "png_decoder.h"
+#include "png_filter.h"
+#include "png_convert.h"
+#include "png_inflate.h"
+#include "png_internal.h"
+
+#define ARR_SIZE(arr) (sizeof(arr) / (sizeof(*(arr))))
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+#if !PNG_INFLATE_STREAMING
+#define BENCH_INFLATE_LIBRARY "libdeflate"
+#elif defined(PNG_INFLATE_ZLIB_NG)
+#define BENCH_INFLATE_LIBRARY "zlib-ng"
+#else
+#define BENCH_INFLATE_LIBRARY "zlib"
+#endif
+
+// every stage is timed on its own, the decode stages run the whole decoder
+// for comparison with the sum of the parts
+enum bench_stage_id {
+	BENCH_SCAN,               // map the file and index the chunks
+	BENCH_INFLATE,            // the IDAT payloads, gathered before, in one go
+	BENCH_UNFILTER_REFERENCE, // byte at a time
+	BENCH_UNFILTER_SCALAR,    // per row, specialized for the pixel size
+	BENCH_UNFILTER_SIMD,      // whatever the cpu supports best
+	BENCH_CONVERT,            // unfiltered rows to rgba8
+	BENCH_OUTPUT,             // rgba8 rows written as PAM to /dev/null
+	BENCH_DECODE_NATIVE,
+	BENCH_DECODE_RGBA8,
+	BENCH_DECODE_THREADED,    // rgba8 with all the jobs
+	BENCH_OPEN_PLAIN,         // open, decode natively and close, per map mode
+	BENCH_OPEN_ADVISE,
+	BENCH_OPEN_POPULATE,
+	BENCH_OPEN_READ,
+
+	BENCH_STAGE_COUNT
+};
+
+static const char *bench_stage_names[] = {
+	"scan",
+	"inflate",
+	"unfilter_reference",
+	"unfilter_scalar",
+	"unfilter_simd",
+	"convert",
+	"output",
+	"decode_native",
+	"decode_rgba8",
+	"decode_threaded",
+	"open_plain",
+	"open_advise",
+	"open_populate",
+	"open_read",
+};
+
+static const char *bench_map_modes[] = {"auto", "plain", "advise", "populate", "read"};
+
+struct bench_stage {
+	int valid;
+	uint64_t ns;    // the best of all iterations
+	uint64_t bytes; // the stage produces or reads
+};
+
+struct bench_result {
+	const char *filename;
+	struct png_info info;
+	size_t file_size;
+	size_t idat_count;
+	size_t idat_size;
+	struct bench_stage stages[BENCH_STAGE_COUNT];
+};
+
+struct bench_options {
+	int iterations;
+	unsigned int threads;
+	int json;
+	enum png_map_mode map; // for every stage but the open ones
+	int cold; // drop the file from the page cache before every open
+};
+
+static uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void bench_record(struct bench_stage *stage, uint64_t start, uint64_t bytes) {
+	uint64_t ns = bench_now() - start;
+
+	if (!stage->valid || ns < stage->ns)
+		stage->ns = ns;
+
+	stage->valid = 1;
+	stage->bytes = bytes;
+}
+
+// the synthetic corpus: every color type, every filter type on its own and
+// mixed, and the same image split into differently sized IDAT chunks
+struct bench_spec {
+	const char *name;
+	uint32_t width, height;
+	uint8_t color_type;
+	uint8_t bit_depth;
+	int filter;        // the filter type for every row, or -1 to cycle through them
+	size_t chunk_size; // of the IDAT chunks, 0 for a single one
+};
+
+static const struct bench_spec bench_corpus[] = {
+	{"gray8_mixed", 1024, 1024, PNG_COLOR_GRAY, 8, -1, 0},
+	{"gray_alpha8_mixed", 1024, 1024, PNG_COLOR_GRAY_ALPHA, 8, -1, 0},
+	{"rgb8_mixed", 1024, 1024, PNG_COLOR_RGB, 8, -1, 0},
+	{"rgba8_mixed", 1024, 1024, PNG_COLOR_RGBA, 8, -1, 0},
+	{"rgba16_mixed", 1024, 1024, PNG_COLOR_RGBA, 16, -1, 0},
+	{"palette8_mixed", 1024, 1024, PNG_COLOR_PALETTE, 8, -1, 0},
+	{"palette4_mixed", 1024, 1024, PNG_COLOR_PALETTE, 4, -1, 0},
+	{"rgb8_none", 1024, 1024, PNG_COLOR_RGB, 8, PNG_FILTER_NONE, 0},
+	{"rgb8_sub", 1024, 1024, PNG_COLOR_RGB, 8, PNG_FILTER_SUB, 0},
+	{"rgb8_up", 1024, 1024, PNG_COLOR_RGB, 8, PNG_FILTER_UP, 0},
+	{"rgb8_average", 1024, 1024, PNG_COLOR_RGB, 8, PNG_FILTER_AVERAGE, 0},
+	{"rgb8_paeth", 1024, 1024, PNG_COLOR_RGB, 8, PNG_FILTER_PAETH, 0},
+	{"rgba8_chunks64k", 1024, 1024, PNG_COLOR_RGBA, 8, -1, 65536},
+	{"rgba8_chunks8k", 1024, 1024, PNG_COLOR_RGBA, 8, -1, 8192},
+	{"rgba8_small", 64, 64, PNG_COLOR_RGBA, 8, -1, 0},
+	{"rgba8_large", 4096, 2048, PNG_COLOR_RGBA, 8, -1, 65536},
+};
+
+static unsigned int bench_channels(uint8_t color_type) {
+	switch (color_type) {
+		case PNG_COLOR_GRAY_ALPHA:
+			return 2;
+		case PNG_COLOR_RGB:
+			return 3;
+		case PNG_COLOR_RGBA:
+			return 4;
+		default:
+			return 1;
+	}
+}
+
+static uint32_t bench_random(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+// smooth gradients with a little noise, which compresses about as well as
+// a photo does
+static void bench_fill_row(const struct bench_spec *spec, uint32_t y, uint8_t *row, size_t row_size, uint32_t *seed) {
+	if (spec->color_type == PNG_COLOR_PALETTE) {
+		memset(row, 0, row_size);
+
+		unsigned int per_byte = 8 / spec->bit_depth;
+		unsigned int max = (1u << spec->bit_depth) - 1;
+
+		for (uint32_t x = 0; x < spec->width; x++) {
+			unsigned int index = ((x >> 4) + (y >> 4) * 3 + (bench_random(seed) & 1)) & max;
+			unsigned int shift = (per_byte - 1 - x % per_byte) * spec->bit_depth;
+			row[x / per_byte] |= index << shift;
+		}
+
+		return;
+	}
+
+	unsigned int channels = bench_channels(spec->color_type);
+	size_t sample_size = spec->bit_depth / 8;
+
+	for (uint32_t x = 0; x < spec->width; x++) {
+		for (unsigned int c = 0; c < channels; c++) {
+			uint8_t *sample = row + ((size_t)x * channels + c) * sample_size;
+			uint32_t noise = bench_random(seed);
+
+			// alpha stays mostly opaque
+			if (c == channels - 1 && !(channels & 1))
+				sample[0] = 255 - ((x ^ y) >> 6 & 63);
+			else
+				sample[0] = (x * 255 / spec->width + y * 127 / spec->height + c * 64 + (noise & 7)) & 255;
+
+			if (sample_size == 2)
+				sample[1] = noise >> 8;
+		}
+	}
+}
+
+static void bench_filter_row(int filter, uint8_t *out, const uint8_t *row, const uint8_t *prev, size_t row_size, size_t pixel_size) {
+	for (size_t i = 0; i < row_size; i++) {
+		int a = i >= pixel_size ? row[i - pixel_size] : 0;
+		int b = prev[i];
+		int c = i >= pixel_size ? prev[i - pixel_size] : 0;
+		int predicted = 0;
+
+		switch (filter) {
+			case PNG_FILTER_SUB:
+				predicted = a;
+				break;
+			case PNG_FILTER_UP:
+				predicted = b;
+				break;
+			case PNG_FILTER_AVERAGE:
+				predicted = (a + b) / 2;
+				break;
+			case PNG_FILTER_PAETH: {
+				int p = a + b - c;
+				int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+				predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+				break;
+			}
+		}
+
+		out[i] = row[i] - predicted;
+	}
+}
+
+static int bench_deflate(const uint8_t *in, size_t in_size, uint8_t **out, size_t *out_size) {
+#if PNG_INFLATE_STREAMING
+	png_z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+
+	if (PNG_Z(deflateInit)(&stream, 6) != Z_OK)
+		return PNG_ERR_NOMEM;
+
+	// the corpus is small enough for a single call
+	size_t capacity = in_size + in_size / 8 + 1024;
+	uint8_t *data = malloc(capacity);
+
+	stream.next_in = (uint8_t *)in;
+	stream.avail_in = png_clamp_uint(in_size);
+	stream.next_out = data;
+	stream.avail_out = png_clamp_uint(capacity);
+
+	int status = data ? PNG_Z(deflate)(&stream, Z_FINISH) : Z_MEM_ERROR;
+	*out_size = stream.next_out - data;
+	PNG_Z(deflateEnd)(&stream);
+
+	if (status != Z_STREAM_END) {
+		free(data);
+		return PNG_ERR_NOMEM;
+	}
+#else
+	struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(6);
+	if (!compressor)
+		return PNG_ERR_NOMEM;
+
+	size_t capacity = libdeflate_zlib_compress_bound(compressor, in_size);
+	uint8_t *data = malloc(capacity);
+
+	*out_size = data ? libdeflate_zlib_compress(compressor, in, in_size, data, capacity) : 0;
+	libdeflate_free_compressor(compressor);
+
+	if (!*out_size) {
+		free(data);
+		return PNG_ERR_NOMEM;
+	}
+#endif
+
+	*out = data;
+	return PNG_OK;
+}
+
+static int bench_write_chunk(FILE *f, const char type[4], const uint8_t *data, size_t size) {
+	uint8_t header[8];
+	png_store_be32(header, size);
+	memcpy(header + 4, type, 4);
+
+	uint8_t crc[4];
+	png_store_be32(crc, png_crc32(png_crc32(0, type, 4), data, size));
+
+	return fwrite(header, 8, 1, f) != 1 || (size && fwrite(data, size, 1, f) != 1) || fwrite(crc, 4, 1, f) != 1;
+}
+
+static int bench_write_png(const struct bench_spec *spec, const char *filename) {
+	size_t pixel_bits = (size_t)bench_channels(spec->color_type) * spec->bit_depth;
+	size_t pixel_size = (pixel_bits + 7) / 8;
+	size_t row_size = (spec->width * pixel_bits + 7) / 8;
+	size_t raw_size = (row_size + 1) * spec->height;
+	int ret = PNG_ERR_NOMEM;
+
+	uint8_t *raw = malloc(raw_size);
+	uint8_t *rows = calloc(2, row_size);
+	uint8_t *compressed = NULL;
+	size_t compressed_size;
+
+	if (!raw || !rows)
+		goto end;
+
+	uint32_t seed = 0x9e3779b9u;
+
+	for (uint32_t y = 0; y < spec->height; y++) {
+		uint8_t *row = rows + (y & 1) * row_size;
+		const uint8_t *prev = rows + (~y & 1) * row_size;
+		uint8_t *out = raw + y * (row_size + 1);
+
+		// the first row is filtered against a row of zeroes
+		if (!y)
+			memset(rows + row_size, 0, row_size);
+
+		bench_fill_row(spec, y, row, row_size, &seed);
+
+		out[0] = spec->filter < 0 ? (int)(y % PNG_FILTER_COUNT) : spec->filter;
+		bench_filter_row(out[0], out + 1, row, prev, row_size, pixel_size);
+	}
+
+	if ((ret = bench_deflate(raw, raw_size, &compressed, &compressed_size)))
+		goto end;
+
+	FILE *f = fopen(filename, "wb");
+	if (!f) {
+		ret = PNG_ERR_IO;
+		goto end;
+	}
+
+	static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	int failed = fwrite(signature, sizeof(signature), 1, f) != 1;
+
+	uint8_t ihdr[13] = {0};
+	png_store_be32(ihdr, spec->width);
+	png_store_be32(ihdr + 4, spec->height);
+	ihdr[8] = spec->bit_depth;
+	ihdr[9] = spec->color_type;
+	failed |= bench_write_chunk(f, "IHDR", ihdr, sizeof(ihdr));
+
+	if (spec->color_type == PNG_COLOR_PALETTE) {
+		uint8_t plte[256 * 3];
+		size_t entries = (size_t)1 << spec->bit_depth;
+
+		for (size_t i = 0; i < entries; i++) {
+			plte[i * 3] = i * 255 / (entries - 1);
+			plte[i * 3 + 1] = (i * 7) & 255;
+			plte[i * 3 + 2] = 255 - plte[i * 3];
+		}
+
+		failed |= bench_write_chunk(f, "PLTE", plte, entries * 3);
+	}
+
+	size_t chunk_size = spec->chunk_size ? spec->chunk_size : compressed_size;
+
+	for (size_t offset = 0; offset < compressed_size && !failed; offset += chunk_size) {
+		size_t size = compressed_size - offset < chunk_size ? compressed_size - offset : chunk_size;
+		failed |= bench_write_chunk(f, "IDAT", compressed + offset, size);
+	}
+
+	failed |= bench_write_chunk(f, "IEND", NULL, 0);
+
+	ret = fclose(f) || failed ? PNG_ERR_IO : PNG_OK;
+
+end:
+	free(compressed);
+	free(rows);
+	free(raw);
+	return ret;
+}
+
+static int bench_inflate(struct png_inflater *inflater, const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size) {
+#if PNG_INFLATE_STREAMING
+	png_z_stream *stream = &inflater->stream;
+
+	if (!inflater->stream_ready) {
+		memset(stream, 0, sizeof(*stream));
+		if (PNG_Z(inflateInit)(stream) != Z_OK)
+			return PNG_ERR_NOMEM;
+
+		inflater->stream_ready = 1;
+	} else if (PNG_Z(inflateReset)(stream) != Z_OK) {
+		return PNG_ERR_NOMEM;
+	}
+
+	stream->next_in = (uint8_t *)in;
+	stream->next_out = out;
+
+	size_t in_left = in_size;
+	size_t out_left = out_size;
+	int status;
+
+	do {
+		stream->avail_in = png_clamp_uint(in_left);
+		stream->avail_out = png_clamp_uint(out_left);
+
+		unsigned int avail_in = stream->avail_in;
+		unsigned int avail_out = stream->avail_out;
+
+		status = PNG_Z(inflate)(stream, Z_NO_FLUSH);
+
+		in_left -= avail_in - stream->avail_in;
+		out_left -= avail_out - stream->avail_out;
+	} while (status == Z_OK && out_left && in_left);
+
+	if (out_left && !in_left && status == Z_OK)
+		return PNG_ERR_TRUNCATED;
+
+	if (out_left || (status != Z_OK && status != Z_STREAM_END))
+		return PNG_ERR_CORRUPT;
+
+	return PNG_OK;
+#else
+	if (!inflater->decompressor) {
+		inflater->decompressor = libdeflate_alloc_decompressor();
+		if (!inflater->decompressor)
+			return PNG_ERR_NOMEM;
+	}
+
+	if (libdeflate_zlib_decompress(inflater->decompressor, in, in_size, out, out_size, NULL) != LIBDEFLATE_SUCCESS)
+		return PNG_ERR_CORRUPT;
+
+	return PNG_OK;
+#endif
+}
+
+static void bench_inflater_free(struct png_inflater *inflater) {
+#if PNG_INFLATE_STREAMING
+	if (inflater->stream_ready)
+		PNG_Z(inflateEnd)(&inflater->stream);
+#else
+	libdeflate_free_decompressor(inflater->decompressor);
+#endif
+}
+
+// the concatenated IDAT payloads
+static uint8_t *bench_gather_idat(struct png_decoder *decoder, size_t *size, size_t *count) {
+	size_t n = png_decoder_chunk_count(decoder);
+	uint8_t *data = NULL;
+
+	*size = 0;
+	*count = 0;
+
+	for (size_t i = png_decoder_find_chunk(decoder, "IDAT", 0); i < n; i = png_decoder_find_chunk(decoder, "IDAT", i + 1)) {
+		struct png_chunk_info chunk;
+		png_decoder_chunk_info(decoder, i, &chunk);
+
+		uint8_t *grown = realloc(data, *size + chunk.size + 1);
+		if (!grown) {
+			free(data);
+			return NULL;
+		}
+
+		data = grown;
+		memcpy(data + *size, png_decoder_chunk_data(decoder, i), chunk.size);
+		*size += chunk.size;
+		(*count)++;
+	}
+
+	return data ? data : malloc(1);
+}
+
+static void bench_palette(struct png_decoder *decoder, const struct png_info *info, struct png_palette *palette) {
+	size_t n = png_decoder_chunk_count(decoder);
+	size_t plte = png_decoder_find_chunk(decoder, "PLTE", 0);
+	size_t trns = png_decoder_find_chunk(decoder, "tRNS", 0);
+	struct png_chunk_info chunk;
+
+	memset(palette, 0, sizeof(*palette));
+
+	if (plte < n && !png_decoder_chunk_info(decoder, plte, &chunk)) {
+		palette->plte = png_decoder_chunk_data(decoder, plte);
+		palette->plte_size = chunk.size;
+	}
+
+	if (trns < n && !png_decoder_chunk_info(decoder, trns, &chunk)) {
+		palette->trns = png_decoder_chunk_data(decoder, trns);
+		palette->trns_size = chunk.size;
+	}
+
+	png_palette_check(info, palette);
+}
+
+// unfilter rows in place, each row follows its filter type byte
+static int bench_unfilter(const struct png_unfilter_kernels *kernels, uint8_t *data, const struct png_info *info) {
+	const uint8_t *prev = NULL;
+
+	for (uint32_t y = 0; y < info->height; y++) {
+		uint8_t *row = data + y * (info->row_size + 1);
+
+		if (png_unfilter_row(kernels, row[0], row + 1, prev, info->row_size))
+			return PNG_ERR_CORRUPT;
+
+		prev = row + 1;
+	}
+
+	return PNG_OK;
+}
+
+static int bench_stage_unfilter(struct bench_stage *stage, void (*select)(struct png_unfilter_kernels *, size_t), const uint8_t *filtered, uint8_t *work, const struct png_info *info, int iterations) {
+	struct png_unfilter_kernels kernels;
+	select(&kernels, info->pixel_size);
+
+	for (int i = 0; i < iterations; i++) {
+		memcpy(work, filtered, info->data_size);
+
+		uint64_t start = bench_now();
+		int ret = bench_unfilter(&kernels, work, info);
+		if (ret)
+			return ret;
+
+		bench_record(stage, start, info->data_size);
+	}
+
+	return PNG_OK;
+}
+
+static int bench_stage_decode(struct bench_stage *stage, struct png_decoder *decoder, enum png_format format, unsigned int threads, uint8_t *buf, int iterations) {
+	int ret = png_decoder_set_format(decoder, format);
+	if (ret)
+		return ret;
+
+	size_t row_size = png_decoder_row_size(decoder);
+	png_decoder_set_threads(decoder, threads);
+
+	struct png_info info;
+	png_decoder_get_info(decoder, &info);
+
+	for (int i = 0; i < iterations; i++) {
+		uint64_t start = bench_now();
+		if ((ret = png_decoder_decode_into(decoder, buf, row_size)))
+			return ret;
+
+		bench_record(stage, start, (uint64_t)row_size * info.height);
+	}
+
+	return PNG_OK;
+}
+
+// ask the kernel to forget the file's cached pages, so opening it has to go
+// to the disk; only clean pages go and not every file system obliges
+static void bench_evict(const char *filename) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+static int bench_stage_open(struct bench_stage *stage, const char *filename, enum png_map_mode mode, const struct bench_options *opts, size_t file_size, uint8_t *buf) {
+	for (int i = 0; i < opts->iterations; i++) {
+		if (opts->cold)
+			bench_evict(filename);
+
+		struct png_decoder *decoder;
+		uint64_t start = bench_now();
+
+		int ret = png_decoder_open_with(&decoder, filename, mode);
+		if (ret)
+			return ret;
+
+		ret = png_decoder_decode_into(decoder, buf, png_decoder_row_size(decoder));
+		png_decoder_close(decoder);
+		if (ret)
+			return ret;
+
+		bench_record(stage, start, file_size);
+	}
+
+	return PNG_OK;
+}
+
+static int bench_file(const char *filename, const struct bench_options *opts, struct bench_result *result) {
+	struct bench_stage *stages = result->stages;
+	struct png_decoder *decoder = NULL;
+	int ret;
+
+	memset(result, 0, sizeof(*result));
+	result->filename = filename;
+
+	for (int i = 0; i < opts->iterations; i++) {
+		if (decoder)
+			png_decoder_close(decoder);
+
+		if (opts->cold)
+			bench_evict(filename);
+
+		uint64_t start = bench_now();
+		if ((ret = png_decoder_open_with(&decoder, filename, opts->map)))
+			return ret;
+
+		bench_record(&stages[BENCH_SCAN], start, 0);
+	}
+
+	struct png_info *info = &result->info;
+	png_decoder_get_info(decoder, info);
+
+	size_t last = png_decoder_chunk_count(decoder) - 1;
+	struct png_chunk_info chunk;
+	png_decoder_chunk_info(decoder, last, &chunk);
+	result->file_size = chunk.offset + chunk.size + 4;
+
+	stages[BENCH_SCAN].bytes = result->file_size;
+
+	struct png_inflater inflater;
+	memset(&inflater, 0, sizeof(inflater));
+
+	uint8_t *idat = bench_gather_idat(decoder, &result->idat_size, &result->idat_count);
+	uint8_t *filtered = malloc(info->data_size);
+	uint8_t *work = malloc(info->data_size);
+	uint8_t *rgba = malloc((size_t)info->width * info->height * 4);
+	uint8_t *native = malloc(info->row_size * info->height);
+
+	ret = PNG_ERR_NOMEM;
+	if (!idat || !filtered || !work || !rgba || !native)
+		goto end;
+
+	for (int i = 0; i < opts->iterations; i++) {
+		uint64_t start = bench_now();
+		if ((ret = bench_inflate(&inflater, idat, result->idat_size, filtered, info->data_size)))
+			goto end;
+
+		bench_record(&stages[BENCH_INFLATE], start, info->data_size);
+	}
+
+	// the passes of interlaced images aren't timed on their own
+	if (!info->interlace) {
+		if ((ret = bench_stage_unfilter(&stages[BENCH_UNFILTER_REFERENCE], png_unfilter_select_reference, filtered, work, info, opts->iterations)) ||
+				(ret = bench_stage_unfilter(&stages[BENCH_UNFILTER_SCALAR], png_unfilter_select_scalar, filtered, work, info, opts->iterations)) ||
+				(ret = bench_stage_unfilter(&stages[BENCH_UNFILTER_SIMD], png_unfilter_select, filtered, work, info, opts->iterations)))
+			goto end;
+
+		size_t out_row_size = (size_t)info->width * 4;
+		uint64_t out_size = (uint64_t)out_row_size * info->height;
+
+		if (png_converter_needed(info, PNG_FORMAT_RGBA8)) {
+			struct png_palette palette;
+			bench_palette(decoder, info, &palette);
+
+			struct png_converter conv;
+			png_converter_init(&conv, info, &palette, PNG_FORMAT_RGBA8, 0);
+
+			for (int i = 0; i < opts->iterations; i++) {
+				uint64_t start = bench_now();
+
+				for (uint32_t y = 0; y < info->height; y++)
+					conv.fn(&conv, rgba + y * out_row_size, work + y * (info->row_size + 1) + 1, info->width);
+
+				bench_record(&stages[BENCH_CONVERT], start, out_size);
+			}
+		} else {
+			for (uint32_t y = 0; y < info->height; y++)
+				memcpy(rgba + y * out_row_size, work + y * (info->row_size + 1) + 1, out_row_size);
+		}
+
+		for (int i = 0; i < opts->iterations; i++) {
+			FILE *out = fopen("/dev/null", "wb");
+			if (!out) {
+				ret = PNG_ERR_IO;
+				goto end;
+			}
+
+			setvbuf(out, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+			uint64_t start = bench_now();
+			int failed = fprintf(out, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", info->width, info->height) < 0;
+
+			for (uint32_t y = 0; y < info->height && !failed; y++)
+				failed = fwrite(rgba + y * out_row_size, out_row_size, 1, out) != 1;
+
+			failed |= fclose(out) != 0;
+			if (failed) {
+				ret = PNG_ERR_IO;
+				goto end;
+			}
+
+			bench_record(&stages[BENCH_OUTPUT], start, out_size);
+		}
+	}
+
+	if ((ret = bench_stage_decode(&stages[BENCH_DECODE_NATIVE], decoder, PNG_FORMAT_NATIVE, 1, native, opts->iterations)) ||
+			(ret = bench_stage_decode(&stages[BENCH_DECODE_RGBA8], decoder, PNG_FORMAT_RGBA8, 1, rgba, opts->iterations)))
+		goto end;
+
+	if (opts->threads > 1 && (ret = bench_stage_decode(&stages[BENCH_DECODE_THREADED], decoder, PNG_FORMAT_RGBA8, opts->threads, rgba, opts->iterations)))
+		goto end;
+
+	for (int i = BENCH_OPEN_PLAIN; i <= BENCH_OPEN_READ; i++) {
+		enum png_map_mode mode = PNG_MAP_PLAIN + (i - BENCH_OPEN_PLAIN);
+		if ((ret = bench_stage_open(&stages[i], filename, mode, opts, result->file_size, native)))
+			goto end;
+	}
+
+	ret = PNG_OK;
+
+end:
+	bench_inflater_free(&inflater);
+	free(native);
+	free(rgba);
+	free(work);
+	free(filtered);
+	free(idat);
+	png_decoder_close(decoder);
+	return ret;
+}
+
+static double bench_mb_s(const struct bench_stage *stage) {
+	return stage->ns ? stage->bytes * 1e3 / stage->ns : 0;
+}
+
+static double bench_ns_per_pixel(const struct bench_stage *stage, const struct png_info *info) {
+	uint64_t pixels = (uint64_t)info->width * info->height;
+	return pixels ? (double)stage->ns / pixels : 0;
+}
+
+static void bench_print_text(const struct bench_result *result) {
+	const struct png_info *info = &result->info;
+
+	printf("%s: %ux%u, color type %hhu, %hhu bits%s, %zu IDAT chunks, %zu bytes compressed\n",
+			result->filename, info->width, info->height, info->color_type, info->bit_depth,
+			info->interlace ? ", interlaced" : "", result->idat_count, result->idat_size);
+
+	for (size_t i = 0; i < BENCH_STAGE_COUNT; i++) {
+		const struct bench_stage *stage = &result->stages[i];
+		if (!stage->valid)
+			continue;
+
+		printf("  %-20s %10.3f ms %10.1f MB/s %8.2f ns/pixel\n", bench_stage_names[i],
+				stage->ns / 1e6, bench_mb_s(stage), bench_ns_per_pixel(stage, info));
+	}
+}
+
+static void bench_print_json_string(const char *str) {
+	putchar('"');
+
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+
+	putchar('"');
+}
+
+static void bench_print_json(const struct bench_result *result, int first) {
+	const struct png_info *info = &result->info;
+
+	printf("%s\n\t\t{\"file\": ", first ? "" : ",");
+	bench_print_json_string(result->filename);
+	printf(", \"width\": %u, \"height\": %u, \"color_type\": %hhu, \"bit_depth\": %hhu, \"interlace\": %hhu,"
+			" \"file_size\": %zu, \"idat_chunks\": %zu, \"idat_size\": %zu, \"data_size\": %zu, \"stages\": {",
+			info->width, info->height, info->color_type, info->bit_depth, info->interlace,
+			result->file_size, result->idat_count, result->idat_size, info->data_size);
+
+	int separator = 0;
+
+	for (size_t i = 0; i < BENCH_STAGE_COUNT; i++) {
+		const struct bench_stage *stage = &result->stages[i];
+		if (!stage->valid)
+			continue;
+
+		printf("%s\n\t\t\t\"%s\": {\"ns\": %llu, \"bytes\": %llu, \"mb_s\": %.1f, \"ns_per_pixel\": %.3f}",
+				separator ? "," : "", bench_stage_names[i], (unsigned long long)stage->ns,
+				(unsigned long long)stage->bytes, bench_mb_s(stage), bench_ns_per_pixel(stage, info));
+		separator = 1;
+	}
+
+	printf("\n\t\t}}");
+}
+
+// write the synthetic corpus into dir, the names go into files
+static int bench_generate(const char *dir, char **files) {
+	for (size_t i = 0; i < ARR_SIZE(bench_corpus); i++) {
+		const struct bench_spec *spec = &bench_corpus[i];
+
+		size_t len = strlen(dir) + strlen(spec->name) + 6;
+		files[i] = malloc(len);
+		if (!files[i])
+			return PNG_ERR_NOMEM;
+
+		snprintf(files[i], len, "%s/%s.png", dir, spec->name);
+
+		int ret = bench_write_png(spec, files[i]);
+		if (ret) {
+			if (ret == PNG_ERR_IO)
+				fprintf(stderr, "failed to write %s: %s\n", files[i], strerror(errno));
+			else
+				fprintf(stderr, "%s: %s\n", files[i], png_status_string(ret));
+			return ret;
+		}
+	}
+
+	return PNG_OK;
+}
+
+static int bench_parse_map(const char *str, enum png_map_mode *out) {
+	for (size_t i = 0; i < ARR_SIZE(bench_map_modes); i++) {
+		if (!strcmp(str, bench_map_modes[i])) {
+			*out = (enum png_map_mode)i;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void usage(const char *name) {
+	printf("usage: %s [-n iterations] [-j threads] [--json] [--map mode] [--cold] [--corpus dir] [filename...]\n", name);
+	printf("without files, the synthetic corpus is generated into a temporary directory, or into dir\n");
+	printf("--map is one of auto, plain, advise, populate or read, the open stages try them all;\n");
+	printf("--cold drops the files from the page cache before opening them\n");
+}
+
+int main(int argc, char **argv) {
+	struct bench_options opts = {5, 0, 0, PNG_MAP_AUTO, 0};
+	const char *corpus = NULL;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	// non-option arguments are gathered at the front of argv
+	char **files = argv + 1;
+	int file_count = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			opts.iterations = strtol(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			threads = strtol(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--json")) {
+			opts.json = 1;
+		} else if (!strcmp(argv[i], "--map") && i + 1 < argc) {
+			if (bench_parse_map(argv[++i], &opts.map)) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "--cold")) {
+			opts.cold = 1;
+		} else if (!strcmp(argv[i], "--corpus") && i + 1 < argc) {
+			corpus = argv[++i];
+		} else if (argv[i][0] != '-') {
+			files[file_count++] = argv[i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (opts.iterations < 1 || threads < 1 || (corpus && file_count)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	opts.threads = threads;
+
+	char tmp[] = "/tmp/png_bench.XXXXXX";
+	char *generated[ARR_SIZE(bench_corpus)] = {NULL};
+	int ret = 1;
+
+	if (!file_count) {
+		if (!corpus && !(corpus = mkdtemp(tmp))) {
+			perror("failed to create a directory for the corpus");
+			return 1;
+		}
+
+		if (bench_generate(corpus, generated))
+			goto end;
+
+		files = generated;
+		file_count = ARR_SIZE(bench_corpus);
+	}
+
+	if (opts.json) {
+		printf("{\n\t\"inflate_library\": \"%s\",\n\t\"iterations\": %d,\n\t\"threads\": %u,\n\t\"map\": \"%s\",\n\t\"cold\": %s,\n\t\"images\": [",
+				BENCH_INFLATE_LIBRARY, opts.iterations, opts.threads, bench_map_modes[opts.map], opts.cold ? "true" : "false");
+	}
+
+	int failed = 0;
+	int printed = 0;
+
+	for (int i = 0; i < file_count; i++) {
+		struct bench_result result;
+		int status = bench_file(files[i], &opts, &result);
+
+		if (status) {
+			if (status == PNG_ERR_IO)
+				fprintf(stderr, "%s: %s\n", files[i], strerror(errno));
+			else
+				fprintf(stderr, "%s: %s\n", files[i], png_status_string(status));
+			failed = 1;
+			continue;
+		}
+
+		if (opts.json)
+			bench_print_json(&result, !printed++);
+		else
+			bench_print_text(&result);
+	}
+
+	if (opts.json)
+		printf("\n\t]\n}\n");
+
+	ret = failed;
+
+end:
+	// only the temporary corpus is cleaned up
+	for (size_t i = 0; i < ARR_SIZE(generated); i++) {
+		if (generated[i] && corpus == tmp)
+			unlink(generated[i]);
+
+		free(generated[i]);
+	}
+
+	if (corpus == tmp)
+		rmdir(tmp);
+
+	return ret;
+}
@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "png_cache.h"
+
+#define PNG_CACHE_ALIGN 64
+
+// buckets to start with, there are never fewer buckets than images
+#define PNG_CACHE_BUCKETS_MIN 64
+
+struct png_cache_entry {
+	struct png_image image; // first, the images handed out are entries
+	uint64_t key;
+	size_t size;
+	unsigned int refs; // one for the cache while linked, one per caller
+
+	struct png_cache_entry *prev; // lru list, most recently used first
+	struct png_cache_entry *next;
+	struct png_cache_entry *chain; // next in the same bucket
+};
+
+struct png_cache {
+	pthread_mutex_t lock;
+	size_t budget;
+	size_t size;
+
+	struct png_cache_entry **buckets;
+	size_t bucket_count; // a power of two
+	size_t count;
+
+	struct png_cache_entry *head;
+	struct png_cache_entry *tail;
+
+	struct png_cache_stats stats;
+};
+
+// fnv-1a, the crcs it's fed are well mixed already
+static inline __attribute__((always_inline)) uint64_t png_cache_hash(uint64_t hash, const void *data, size_t size) {
+	const uint8_t *p = data;
+
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ p[i]) * 0x100000001b3ull;
+
+	return hash;
+}
+
+uint64_t png_cache_key(const struct png_chunk_index *index, enum png_format format, int round16) {
+	uint8_t output[2] = {(uint8_t)format, (uint8_t)!!round16};
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	// png_read_header has checked that IHDR comes first
+	hash = png_cache_hash(hash, index->entries[0].chunk.data, 13);
+	hash = png_cache_hash(hash, output, sizeof(output));
+
+	for (size_t i = 1; i < index->count; i++) {
+		const struct png_chunk_entry *entry = &index->entries[i];
+
+		if (!png_entry_is(entry, "IDAT") && !png_entry_is(entry, "PLTE") && !png_entry_is(entry, "tRNS"))
+			continue;
+
+		uint8_t header[12];
+		memcpy(header, entry->chunk.type, 4);
+		png_store_be32(header + 4, entry->chunk.size);
+		png_store_be32(header + 8, png_chunk_stored_crc(&entry->chunk));
+		hash = png_cache_hash(hash, header, sizeof(header));
+	}
+
+	return hash;
+}
+
+int png_cache_create(struct png_cache **out, size_t budget) {
+	struct png_cache *cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return PNG_ERR_NOMEM;
+
+	cache->buckets = calloc(PNG_CACHE_BUCKETS_MIN, sizeof(*cache->buckets));
+	if (!cache->buckets || pthread_mutex_init(&cache->lock, NULL)) {
+		free(cache->buckets);
+		free(cache);
+		return PNG_ERR_NOMEM;
+	}
+
+	cache->bucket_count = PNG_CACHE_BUCKETS_MIN;
+	cache->budget = budget;
+	*out = cache;
+	return PNG_OK;
+}
+
+struct png_image *png_cache_image_create(const struct png_info *info, enum png_format format, size_t row_size) {
+	size_t overhead = sizeof(struct png_cache_entry) + PNG_CACHE_ALIGN - 1;
+
+	if (row_size && info->height > (SIZE_MAX - overhead) / row_size)
+		return NULL;
+
+	size_t size = row_size * info->height;
+	struct png_cache_entry *entry = malloc(overhead + size);
+	if (!entry)
+		return NULL;
+
+	uintptr_t data = ((uintptr_t)(entry + 1) + PNG_CACHE_ALIGN - 1) & ~(uintptr_t)(PNG_CACHE_ALIGN - 1);
+
+	memset(entry, 0, sizeof(*entry));
+	entry->image = (struct png_image){*info, format, row_size, (const uint8_t *)data};
+	entry->size = overhead + size;
+	entry->refs = 1;
+	return &entry->image;
+}
+
+void png_image_release(const struct png_image *image) {
+	struct png_cache_entry *entry = (struct png_cache_entry *)image;
+
+	if (entry && __atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(entry);
+}
+
+static inline __attribute__((always_inline)) struct png_cache_entry **png_cache_bucket(struct png_cache *cache, uint64_t key) {
+	return &cache->buckets[(key ^ key >> 32) & (cache->bucket_count - 1)];
+}
+
+static void png_cache_lru_unlink(struct png_cache *cache, struct png_cache_entry *entry) {
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache->head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache->tail = entry->prev;
+
+	entry->prev = entry->next = NULL;
+}
+
+static void png_cache_lru_push(struct png_cache *cache, struct png_cache_entry *entry) {
+	entry->next = cache->head;
+
+	if (cache->head)
+		cache->head->prev = entry;
+	else
+		cache->tail = entry;
+
+	cache->head = entry;
+}
+
+// take an image out of the cache, it lives on while callers hold it
+static void png_cache_remove(struct png_cache *cache, struct png_cache_entry *entry) {
+	struct png_cache_entry **link = png_cache_bucket(cache, entry->key);
+
+	while (*link != entry)
+		link = &(*link)->chain;
+
+	*link = entry->chain;
+	png_cache_lru_unlink(cache, entry);
+
+	cache->size -= entry->size;
+	cache->count--;
+	png_image_release(&entry->image);
+}
+
+// double the buckets once there are more images than buckets; when that
+// fails the chains just get longer
+static void png_cache_grow(struct png_cache *cache) {
+	size_t count = cache->bucket_count * 2;
+	struct png_cache_entry **buckets = calloc(count, sizeof(*buckets));
+	if (!buckets)
+		return;
+
+	struct png_cache_entry **old = cache->buckets;
+	size_t old_count = cache->bucket_count;
+
+	cache->buckets = buckets;
+	cache->bucket_count = count;
+
+	for (size_t i = 0; i < old_count; i++) {
+		struct png_cache_entry *entry = old[i];
+
+		while (entry) {
+			struct png_cache_entry *chain = entry->chain;
+			struct png_cache_entry **bucket = png_cache_bucket(cache, entry->key);
+
+			entry->chain = *bucket;
+			*bucket = entry;
+			entry = chain;
+		}
+	}
+
+	free(old);
+}
+
+// with the lock held
+static struct png_cache_entry *png_cache_lookup(struct png_cache *cache, uint64_t key) {
+	struct png_cache_entry *entry = *png_cache_bucket(cache, key);
+
+	while (entry && entry->key != key)
+		entry = entry->chain;
+
+	if (!entry)
+		return NULL;
+
+	png_cache_lru_unlink(cache, entry);
+	png_cache_lru_push(cache, entry);
+	__atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+	return entry;
+}
+
+const struct png_image *png_cache_find(struct png_cache *cache, uint64_t key) {
+	pthread_mutex_lock(&cache->lock);
+
+	struct png_cache_entry *entry = png_cache_lookup(cache, key);
+	if (entry)
+		cache->stats.hits++;
+	else
+		cache->stats.misses++;
+
+	pthread_mutex_unlock(&cache->lock);
+	return entry ? &entry->image : NULL;
+}
+
+const struct png_image *png_cache_insert(struct png_cache *cache, uint64_t key, struct png_image *image) {
+	struct png_cache_entry *entry = (struct png_cache_entry *)image;
+
+	if (entry->size > cache->budget)
+		return image;
+
+	pthread_mutex_lock(&cache->lock);
+
+	// decoded at the same time somewhere else
+	struct png_cache_entry *first = png_cache_lookup(cache, key);
+	if (first) {
+		pthread_mutex_unlock(&cache->lock);
+		png_image_release(image);
+		return &first->image;
+	}
+
+	// the oldest images make room, those still held are freed on release
+	while (cache->size > cache->budget - entry->size) {
+		png_cache_remove(cache, cache->tail);
+		cache->stats.evictions++;
+	}
+
+	if (cache->count >= cache->bucket_count)
+		png_cache_grow(cache);
+
+	struct png_cache_entry **bucket = png_cache_bucket(cache, key);
+
+	entry->key = key;
+	entry->chain = *bucket;
+	*bucket = entry;
+	png_cache_lru_push(cache, entry);
+
+	entry->refs++;
+	cache->size += entry->size;
+	cache->count++;
+
+	pthread_mutex_unlock(&cache->lock);
+	return image;
+}
+
+void png_cache_clear(struct png_cache *cache) {
+	pthread_mutex_lock(&cache->lock);
+
+	while (cache->tail)
+		png_cache_remove(cache, cache->tail);
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void png_cache_get_stats(struct png_cache *cache, struct png_cache_stats *out) {
+	pthread_mutex_lock(&cache->lock);
+
+	*out = cache->stats;
+	out->images = cache->count;
+	out->size = cache->size;
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void png_cache_destroy(struct png_cache *cache) {
+	if (!cache)
+		return;
+
+	png_cache_clear(cache);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->buckets);
+	free(cache);
+}
@@ -0,0 +1,27 @@
+#ifndef PNG_CACHE_H
+#define PNG_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "png_decoder.h"
+#include "png_internal.h"
+
+// what a decode depends on: IHDR, the size and stored crc of PLTE, tRNS and
+// every IDAT, and how rows are output; it only reads the chunk index and
+// never inflates anything
+uint64_t png_cache_key(const struct png_chunk_index *index, enum png_format format, int round16);
+
+// the image cached under key with a reference for the caller, or NULL
+const struct png_image *png_cache_find(struct png_cache *cache, uint64_t key);
+
+// an image of height rows of row_size bytes to decode into, with the one
+// reference the caller holds
+struct png_image *png_cache_image_create(const struct png_info *info, enum png_format format, size_t row_size);
+
+// put a decoded image in the cache and hand it back, or the one another
+// thread put there first in its place, in which case image is released;
+// images bigger than the budget are handed back without being cached
+const struct png_image *png_cache_insert(struct png_cache *cache, uint64_t key, struct png_image *image);
+
+#endif
@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include "png_checkpoint.h"
+#include "png_filter.h"
+
+// the sidecar file: this magic, a header and then every checkpoint with its
+// data, all numbers big endian
+static const uint8_t png_checkpoint_magic[8] = {0x89, 'P', 'N', 'G', 'C', 'K', 'P', '\n'};
+
+#define PNG_CHECKPOINT_HEADER_SIZE (8 + 4 + 4 + 8 + 4 + 8)
+#define PNG_CHECKPOINT_ENTRY_SIZE (4 + 4 + 4 + 1 + 1 + 4 + 4)
+
+static void png_checkpoint_free_points(struct png_checkpoints *cp) {
+	for (size_t i = 0; i < cp->count; i++)
+		free(cp->points[i].data);
+
+	free(cp->points);
+}
+
+void png_checkpoints_free(struct png_checkpoints *cp) {
+	if (!cp)
+		return;
+
+	png_checkpoint_free_points(cp);
+	free(cp);
+}
+
+uint32_t png_checkpoints_fingerprint(const struct png_chunk_index *index) {
+	uint32_t crc = 0;
+
+	// the sizes and crcs of all chunks, without reading any payload
+	for (size_t i = 0; i < index->count; i++) {
+		const struct png_chunk *c = &index->entries[i].chunk;
+		uint8_t entry[12];
+
+		memcpy(entry, c->type, 4);
+		png_store_be32(entry + 4, c->size);
+		png_store_be32(entry + 8, png_chunk_stored_crc(c));
+		crc = png_crc32(crc, entry, sizeof(entry));
+	}
+
+	return crc;
+}
+
+int png_checkpoints_match(const struct png_checkpoints *cp, const struct png_chunk_index *index, const struct png_info *info) {
+	if (cp->width != info->width || cp->height != info->height || cp->row_size != info->row_size)
+		return 0;
+
+	if (cp->fingerprint != png_checkpoints_fingerprint(index))
+		return 0;
+
+	for (size_t i = 0; i < cp->count; i++) {
+		const struct png_checkpoint *point = &cp->points[i];
+
+		if (point->chunk >= index->count || !png_entry_is(&index->entries[point->chunk], "IDAT"))
+			return 0;
+
+		if (point->offset > index->entries[point->chunk].chunk.size)
+			return 0;
+	}
+
+	return 1;
+}
+
+const struct png_checkpoint *png_checkpoints_find(const struct png_checkpoints *cp, uint32_t row) {
+	size_t lo = 0;
+	size_t hi = cp->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (cp->points[mid].row <= row)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo ? &cp->points[lo - 1] : NULL;
+}
+
+#if PNG_INFLATE_STREAMING
+
+struct png_checkpoint_builder {
+	struct png_checkpoints *cp;
+	size_t capacity;
+	size_t row_size;
+};
+
+static int png_checkpoint_add(struct png_checkpoint_builder *builder, png_z_stream *stream, const struct png_chunk *c, uint32_t chunk, uint32_t row, const uint8_t *prev, const uint8_t *line, size_t partial) {
+	struct png_checkpoints *cp = builder->cp;
+
+	if (cp->count == builder->capacity) {
+		size_t capacity = builder->capacity ? builder->capacity * 2 : 16;
+
+		struct png_checkpoint *points = realloc(cp->points, capacity * sizeof(*points));
+		if (!points)
+			return PNG_ERR_NOMEM;
+
+		cp->points = points;
+		builder->capacity = capacity;
+	}
+
+	uint8_t *data = malloc(PNG_CHECKPOINT_WINDOW + builder->row_size + partial);
+	if (!data)
+		return PNG_ERR_NOMEM;
+
+	struct png_checkpoint *point = &cp->points[cp->count];
+	unsigned int window_size = 0;
+
+	if (PNG_Z(inflateGetDictionary)(stream, data, &window_size) != Z_OK) {
+		free(data);
+		return PNG_ERR_UNSUPPORTED;
+	}
+
+	memcpy(data + window_size, prev, builder->row_size);
+	memcpy(data + window_size + builder->row_size, line, partial);
+
+	*point = (struct png_checkpoint){
+		.row = row,
+		.chunk = chunk,
+		.offset = stream->next_in - (const uint8_t *)c->data,
+		.bits = stream->data_type & 7,
+		.partial = partial,
+		.window_size = window_size,
+		.data = data,
+	};
+
+	// the unused bits are the top ones of the byte inflate took last
+	if (point->bits)
+		point->prime = stream->next_in[-1] >> (8 - point->bits);
+
+	cp->count++;
+	return PNG_OK;
+}
+
+int png_checkpoints_build(struct png_chunk_index *index, const struct png_info *info, int check_crc, uint32_t rows, struct png_checkpoints **out) {
+	if (!rows)
+		return PNG_ERR_ARGUMENT;
+
+	// passes don't go from top to bottom, a checkpoint can't skip ahead
+	if (info->interlace || index->count > UINT32_MAX)
+		return PNG_ERR_UNSUPPORTED;
+
+	size_t row_size = info->row_size;
+	size_t line_size = row_size + 1;
+
+	if (row_size > (SIZE_MAX - PNG_CHECKPOINT_WINDOW) / 2)
+		return PNG_ERR_NOMEM;
+
+	struct png_checkpoints *cp = calloc(1, sizeof(*cp));
+	uint8_t *lines = malloc(line_size * 2);
+
+	if (!cp || !lines) {
+		free(cp);
+		free(lines);
+		return PNG_ERR_NOMEM;
+	}
+
+	*cp = (struct png_checkpoints){info->width, info->height, row_size, png_checkpoints_fingerprint(index), NULL, 0};
+
+	struct png_checkpoint_builder builder = {cp, 0, row_size};
+	struct png_unfilter_kernels kernels;
+	png_unfilter_select(&kernels, info->pixel_size);
+
+	png_z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+
+	int ret = PNG_ERR_NOMEM;
+	if (PNG_Z(inflateInit)(&stream) != Z_OK)
+		goto fail;
+
+	uint32_t row = 0;
+	uint64_t next = rows;
+	size_t filled = 0;
+	uint8_t extra;
+	int status = Z_OK;
+
+	ret = PNG_OK;
+
+	for (size_t i = 0; i < index->count && status != Z_STREAM_END && !ret; i++) {
+		struct png_chunk_entry *entry = &index->entries[i];
+		if (!png_entry_is(entry, "IDAT"))
+			continue;
+
+		if (check_crc && !png_entry_crc_ok(entry)) {
+			ret = PNG_ERR_CRC;
+			break;
+		}
+
+		stream.next_in = entry->chunk.data;
+		stream.avail_in = entry->chunk.size;
+
+		// go on while there's input, or inflate may have more output for a
+		// full line, until the stream ends
+		stream.avail_out = 0;
+
+		while ((stream.avail_in || !stream.avail_out) && status != Z_STREAM_END) {
+			uint8_t *line = lines + (row & 1) * line_size;
+
+			// only the end of the stream may follow the last row
+			if (row == info->height) {
+				stream.next_out = &extra;
+				stream.avail_out = 1;
+			} else {
+				stream.next_out = line + filled;
+				stream.avail_out = line_size - filled;
+			}
+
+			// return at every block boundary to see if it's a good spot
+			status = PNG_Z(inflate)(&stream, Z_BLOCK);
+
+			if (status == Z_MEM_ERROR) {
+				ret = PNG_ERR_NOMEM;
+				break;
+			}
+
+			if ((status != Z_OK && status != Z_BUF_ERROR && status != Z_STREAM_END) || (row == info->height && !stream.avail_out)) {
+				ret = PNG_ERR_CORRUPT;
+				break;
+			}
+
+			if (row == info->height)
+				continue;
+
+			filled = stream.next_out - line;
+
+			if (filled == line_size) {
+				const uint8_t *prev = row ? lines + ((row - 1) & 1) * line_size + 1 : NULL;
+
+				if (png_unfilter_row(&kernels, line[0], line + 1, prev, row_size)) {
+					ret = PNG_ERR_CORRUPT;
+					break;
+				}
+
+				row++;
+				filled = 0;
+			}
+
+			// right after a block that isn't the last one
+			if ((stream.data_type & 128) && !(stream.data_type & 64) && row >= next && row < info->height) {
+				const uint8_t *prev = lines + ((row - 1) & 1) * line_size + 1;
+
+				ret = png_checkpoint_add(&builder, &stream, &entry->chunk, i, row, prev, lines + (row & 1) * line_size, filled);
+				if (ret)
+					break;
+
+				next = (row / rows + 1) * (uint64_t)rows;
+			}
+		}
+	}
+
+	if (!ret && (status != Z_STREAM_END || row != info->height))
+		ret = index->complete ? PNG_ERR_CORRUPT : PNG_ERR_TRUNCATED;
+
+	PNG_Z(inflateEnd)(&stream);
+
+	if (ret)
+		goto fail;
+
+	free(lines);
+	*out = cp;
+	return PNG_OK;
+
+fail:
+	free(lines);
+	png_checkpoints_free(cp);
+	return ret;
+}
+
+#else
+
+int png_checkpoints_build(struct png_chunk_index *index, const struct png_info *info, int check_crc, uint32_t rows, struct png_checkpoints **out) {
+	(void)index;
+	(void)info;
+	(void)check_crc;
+	(void)rows;
+	(void)out;
+
+	// libdeflate can't start in the middle of a stream
+	return PNG_ERR_UNSUPPORTED;
+}
+
+#endif
+
+static int png_checkpoint_write(FILE *f, const void *data, size_t size) {
+	return size && fwrite(data, size, 1, f) != 1;
+}
+
+int png_checkpoints_save(const struct png_checkpoints *cp, const char *filename) {
+	FILE *f = fopen(filename, "wb");
+	if (!f)
+		return PNG_ERR_IO;
+
+	uint8_t header[PNG_CHECKPOINT_HEADER_SIZE];
+	memcpy(header, png_checkpoint_magic, 8);
+	png_store_be32(header + 8, cp->width);
+	png_store_be32(header + 12, cp->height);
+	png_store_be64(header + 16, cp->row_size);
+	png_store_be32(header + 24, cp->fingerprint);
+	png_store_be64(header + 28, cp->count);
+
+	int failed = png_checkpoint_write(f, header, sizeof(header));
+
+	for (size_t i = 0; i < cp->count && !failed; i++) {
+		const struct png_checkpoint *point = &cp->points[i];
+		uint8_t entry[PNG_CHECKPOINT_ENTRY_SIZE];
+
+		png_store_be32(entry, point->row);
+		png_store_be32(entry + 4, point->chunk);
+		png_store_be32(entry + 8, point->offset);
+		entry[12] = point->bits;
+		entry[13] = point->prime;
+		png_store_be32(entry + 14, point->partial);
+		png_store_be32(entry + 18, point->window_size);
+
+		failed = png_checkpoint_write(f, entry, sizeof(entry)) ||
+			png_checkpoint_write(f, point->data, point->window_size + cp->row_size + point->partial);
+	}
+
+	int err = errno;
+
+	if (fclose(f) || failed) {
+		if (failed)
+			errno = err;
+		return PNG_ERR_IO;
+	}
+
+	return PNG_OK;
+}
+
+// a short read is a broken file rather than an i/o error
+static int png_checkpoint_read(FILE *f, void *data, size_t size) {
+	if (!size || fread(data, size, 1, f) == 1)
+		return PNG_OK;
+
+	return ferror(f) ? PNG_ERR_IO : PNG_ERR_CORRUPT;
+}
+
+static int png_checkpoint_load_points(FILE *f, struct png_checkpoints *cp, size_t count) {
+	// don't trust the count with a huge allocation before reading anything
+	for (size_t i = 0; i < count; i++) {
+		uint8_t entry[PNG_CHECKPOINT_ENTRY_SIZE];
+		int ret = png_checkpoint_read(f, entry, sizeof(entry));
+		if (ret)
+			return ret;
+
+		struct png_checkpoint point = {
+			.row = png_load_be32(entry),
+			.chunk = png_load_be32(entry + 4),
+			.offset = png_load_be32(entry + 8),
+			.bits = entry[12],
+			.prime = entry[13],
+			.partial = png_load_be32(entry + 14),
+			.window_size = png_load_be32(entry + 18),
+		};
+
+		uint32_t prev_row = cp->count ? cp->points[cp->count - 1].row : 0;
+
+		if (point.bits > 7 || point.window_size > PNG_CHECKPOINT_WINDOW || point.partial > cp->row_size)
+			return PNG_ERR_CORRUPT;
+
+		if (point.row <= prev_row || point.row >= cp->height)
+			return PNG_ERR_CORRUPT;
+
+		if ((cp->count & (cp->count - 1)) == 0) {
+			size_t capacity = cp->count ? cp->count * 2 : 16;
+
+			struct png_checkpoint *points = realloc(cp->points, capacity * sizeof(*points));
+			if (!points)
+				return PNG_ERR_NOMEM;
+
+			cp->points = points;
+		}
+
+		size_t size = point.window_size + cp->row_size + point.partial;
+		point.data = malloc(size);
+		if (!point.data)
+			return PNG_ERR_NOMEM;
+
+		cp->points[cp->count++] = point;
+
+		if ((ret = png_checkpoint_read(f, point.data, size)))
+			return ret;
+	}
+
+	return PNG_OK;
+}
+
+int png_checkpoints_load(struct png_checkpoints **out, const char *filename) {
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return PNG_ERR_IO;
+
+	struct png_checkpoints *cp = calloc(1, sizeof(*cp));
+	uint8_t header[PNG_CHECKPOINT_HEADER_SIZE];
+
+	int ret = cp ? png_checkpoint_read(f, header, sizeof(header)) : PNG_ERR_NOMEM;
+
+	if (!ret && memcmp(header, png_checkpoint_magic, 8))
+		ret = PNG_ERR_SIGNATURE;
+
+	if (!ret) {
+		cp->width = png_load_be32(header + 8);
+		cp->height = png_load_be32(header + 12);
+		cp->row_size = png_load_be64(header + 16);
+		cp->fingerprint = png_load_be32(header + 24);
+
+		// rows have to fit next to a window in memory
+		if (cp->row_size > (SIZE_MAX - PNG_CHECKPOINT_WINDOW) / 2)
+			ret = PNG_ERR_CORRUPT;
+		else
+			ret = png_checkpoint_load_points(f, cp, png_load_be64(header + 28));
+	}
+
+	int err = errno;
+	fclose(f);
+
+	if (ret) {
+		png_checkpoints_free(cp);
+		errno = err;
+		return ret;
+	}
+
+	*out = cp;
+	return PNG_OK;
+}
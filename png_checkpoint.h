@@ -0,0 +1,66 @@
+#ifndef PNG_CHECKPOINT_H
+#define PNG_CHECKPOINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "png_decoder.h"
+#include "png_internal.h"
+
+// deflate keeps back references within the last 32 KiB of output
+#define PNG_CHECKPOINT_WINDOW 32768
+
+// a point between two deflate blocks where raw inflate can start over with
+// the window as its dictionary. it usually falls in the middle of a row, the
+// filtered bytes of that row inflated so far are kept along with the
+// unfiltered row above it
+struct png_checkpoint {
+	uint32_t row;    // the row in progress, never the first one
+	uint32_t chunk;  // entry in the chunk index the next input byte is in
+	uint32_t offset; // bytes into the chunk's payload
+	uint8_t bits;    // bits of the byte before offset that are still unused
+	uint8_t prime;   // and their value, for inflatePrime
+	uint32_t partial;     // bytes of row inflated so far, filter byte included
+	uint32_t window_size;
+
+	// the window, then the unfiltered row above, then the partial row
+	uint8_t *data;
+};
+
+struct png_checkpoints {
+	uint32_t width;
+	uint32_t height;
+	uint64_t row_size;
+	uint32_t fingerprint; // of the chunk layout, to tell files apart
+
+	struct png_checkpoint *points; // by row
+	size_t count;
+};
+
+static inline __attribute__((always_inline)) const uint8_t *png_checkpoint_window(const struct png_checkpoint *cp) {
+	return cp->data;
+}
+
+static inline __attribute__((always_inline)) const uint8_t *png_checkpoint_prev(const struct png_checkpoint *cp) {
+	return cp->data + cp->window_size;
+}
+
+static inline __attribute__((always_inline)) const uint8_t *png_checkpoint_line(const struct png_checkpoint *cp, size_t row_size) {
+	return cp->data + cp->window_size + row_size;
+}
+
+// inflate and unfilter the image once, leaving a checkpoint at the first
+// block boundary after every rows rows
+int png_checkpoints_build(struct png_chunk_index *index, const struct png_info *info, int check_crc, uint32_t rows, struct png_checkpoints **out);
+
+// a crc over the type, size and crc of every chunk, which only reads the
+// chunk headers
+uint32_t png_checkpoints_fingerprint(const struct png_chunk_index *index);
+
+// whether cp was built for the file the index and header are from
+int png_checkpoints_match(const struct png_checkpoints *cp, const struct png_chunk_index *index, const struct png_info *info);
+
+// the last checkpoint at or above row, NULL when there is none
+const struct png_checkpoint *png_checkpoints_find(const struct png_checkpoints *cp, uint32_t row);
+
+#endif
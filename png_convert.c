@@ -0,0 +1,555 @@
+#include <string.h>
+
+#include "png_convert.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define PNG_CONVERT_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PNG_CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+// a big endian 16-bit sample reduced to 8 bits, either the high byte or
+// v / 257 rounded to nearest, which never needs more than 16 bits when the
+// bias saturates: (v + 128 - ((v + 128) >> 8)) >> 8
+static inline __attribute__((always_inline)) uint8_t png_sample8(const uint8_t *sample, int round) {
+	unsigned int v = (sample[0] << 8) | sample[1];
+	unsigned int x = v + 128 > 0xffff ? 0xffff : v + 128;
+
+	return round ? (x - (x >> 8)) >> 8 : sample[0];
+}
+
+#if defined(PNG_CONVERT_X86)
+
+// sixteen samples at a time, the high bytes are the even ones and come out
+// of a mask and an unsigned saturating pack
+static void png_reduce16(uint8_t *restrict out, const uint8_t *restrict in, size_t samples, int round) {
+	const __m128i low = _mm_set1_epi16(0x00ff);
+	const __m128i bias = _mm_set1_epi16(128);
+	size_t i = 0;
+
+	for (; i + 16 <= samples; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(in + i * 2));
+		__m128i b = _mm_loadu_si128((const __m128i *)(in + i * 2 + 16));
+
+		if (round) {
+			// byte swap into native values and divide by 257
+			a = _mm_adds_epu16(_mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8)), bias);
+			b = _mm_adds_epu16(_mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8)), bias);
+			a = _mm_srli_epi16(_mm_sub_epi16(a, _mm_srli_epi16(a, 8)), 8);
+			b = _mm_srli_epi16(_mm_sub_epi16(b, _mm_srli_epi16(b, 8)), 8);
+		} else {
+			a = _mm_and_si128(a, low);
+			b = _mm_and_si128(b, low);
+		}
+
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(a, b));
+	}
+
+	for (; i < samples; i++)
+		out[i] = png_sample8(in + i * 2, round);
+}
+
+#elif defined(PNG_CONVERT_NEON)
+
+// a deinterleaving load splits sixteen samples into high and low bytes
+static void png_reduce16(uint8_t *restrict out, const uint8_t *restrict in, size_t samples, int round) {
+	const uint16x8_t bias = vdupq_n_u16(128);
+	size_t i = 0;
+
+	for (; i + 16 <= samples; i += 16) {
+		uint8x16x2_t v = vld2q_u8(in + i * 2);
+
+		if (round) {
+			uint8x16x2_t z = vzipq_u8(v.val[1], v.val[0]);
+			uint16x8_t lo = vqaddq_u16(vreinterpretq_u16_u8(z.val[0]), bias);
+			uint16x8_t hi = vqaddq_u16(vreinterpretq_u16_u8(z.val[1]), bias);
+			lo = vsubq_u16(lo, vshrq_n_u16(lo, 8));
+			hi = vsubq_u16(hi, vshrq_n_u16(hi, 8));
+			vst1q_u8(out + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+		} else {
+			vst1q_u8(out + i, v.val[0]);
+		}
+	}
+
+	for (; i < samples; i++)
+		out[i] = png_sample8(in + i * 2, round);
+}
+
+#else
+
+static void png_reduce16(uint8_t *restrict out, const uint8_t *restrict in, size_t samples, int round) {
+	for (size_t i = 0; i < samples; i++)
+		out[i] = png_sample8(in + i * 2, round);
+}
+
+#endif
+
+// n is the output pixel size, 3 for rgb8 and 4 for rgba8; the alpha byte
+// of rgba8 is simply dropped by the rgb8 variants
+#define PNG_CONVERTERS(n) \
+	/* sub-byte samples, every input byte expands to several lut entries */ \
+	static void png_convert_packed##n(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) { \
+		size_t per_byte = 8 / conv->bit_depth; \
+		for (; width >= per_byte; width -= per_byte, row++) \
+			for (size_t i = 0; i < per_byte; i++, out += n) \
+				memcpy(out, conv->lut[conv->unpack[*row][i]], n); \
+		for (size_t i = 0; i < width; i++, out += n) \
+			memcpy(out, conv->lut[conv->unpack[*row][i]], n); \
+	} \
+	\
+	static void png_convert_lut##n(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) { \
+		for (size_t x = 0; x < width; x++, out += n) \
+			memcpy(out, conv->lut[row[x]], n); \
+	} \
+	\
+	static void png_convert_gray16_##n(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) { \
+		for (size_t x = 0; x < width; x++, out += n, row += 2) { \
+			out[0] = out[1] = out[2] = png_sample8(row, conv->round16); \
+			if (n == 4) \
+				out[n - 1] = conv->has_key && !memcmp(row, conv->key, 2) ? 0 : 255; \
+		} \
+	} \
+	\
+	static void png_convert_gray_alpha8_##n(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) { \
+		(void)conv; \
+		for (size_t x = 0; x < width; x++, out += n, row += 2) { \
+			out[0] = out[1] = out[2] = row[0]; \
+			if (n == 4) \
+				out[n - 1] = row[1]; \
+		} \
+	} \
+	\
+	static void png_convert_gray_alpha16_##n(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) { \
+		for (size_t x = 0; x < width; x++, out += n, row += 4) { \
+			out[0] = out[1] = out[2] = png_sample8(row, conv->round16); \
+			if (n == 4) \
+				out[n - 1] = png_sample8(row + 2, conv->round16); \
+		} \
+	}
+
+PNG_CONVERTERS(3)
+PNG_CONVERTERS(4)
+
+static void png_convert_rgb8_4(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) {
+	for (size_t x = 0; x < width; x++, out += 4, row += 3) {
+		memcpy(out, row, 3);
+		out[3] = conv->has_key && row[0] == conv->key[1] && row[1] == conv->key[3] && row[2] == conv->key[5] ? 0 : 255;
+	}
+}
+
+static void png_convert_rgb16_4(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) {
+	for (size_t x = 0; x < width; x++, out += 4, row += 6) {
+		out[0] = png_sample8(row, conv->round16);
+		out[1] = png_sample8(row + 2, conv->round16);
+		out[2] = png_sample8(row + 4, conv->round16);
+		out[3] = conv->has_key && !memcmp(row, conv->key, 6) ? 0 : 255;
+	}
+}
+
+static void png_convert_rgba16_3(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) {
+	for (size_t x = 0; x < width; x++, out += 3, row += 8) {
+		out[0] = png_sample8(row, conv->round16);
+		out[1] = png_sample8(row + 2, conv->round16);
+		out[2] = png_sample8(row + 4, conv->round16);
+	}
+}
+
+// every 16-bit sample to 8 bits, channels unchanged
+static void png_convert_reduce16(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) {
+	png_reduce16(out, row, width * conv->channels, conv->round16);
+}
+
+static void png_convert_rgba8_3(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) {
+	(void)conv;
+	for (size_t x = 0; x < width; x++, out += 3, row += 4)
+		memcpy(out, row, 3);
+}
+
+// rgb8 to rgb8 and rgba8 to rgba8
+static void png_convert_copy3(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) {
+	(void)conv;
+	memcpy(out, row, width * 3);
+}
+
+static void png_convert_copy4(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) {
+	(void)conv;
+	memcpy(out, row, width * 4);
+}
+
+// c * a / 255 rounded to nearest, exact for every 8-bit pair and without
+// a division: t = c * a + 128, (t + (t >> 8)) >> 8
+static inline __attribute__((always_inline)) uint8_t png_premultiply8(unsigned int c, unsigned int a) {
+	unsigned int t = c * a + 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+#if defined(PNG_CONVERT_X86)
+
+// bytes 0 and 2 of every pixel trade places, the others stay
+static inline __attribute__((always_inline)) __m128i png_swap_rb_sse2(__m128i v) {
+	const __m128i keep = _mm_set1_epi32((int)0xff00ff00);
+	const __m128i low = _mm_set1_epi32(0x000000ff);
+
+	__m128i r = _mm_slli_epi32(_mm_and_si128(v, low), 16);
+	__m128i b = _mm_and_si128(_mm_srli_epi32(v, 16), low);
+	return _mm_or_si128(_mm_and_si128(v, keep), _mm_or_si128(r, b));
+}
+
+// two pixels widened to 16 bits; alpha is multiplied by 255 and comes out
+// as it went in
+static inline __attribute__((always_inline)) __m128i png_premultiply_sse2(__m128i v) {
+	const __m128i opaque = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+	const __m128i bias = _mm_set1_epi16(128);
+
+	__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(v, _mm_or_si128(a, opaque)), bias);
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+#endif
+
+// four pixels at a time on x86, sixteen with neon, the rest one by one
+static inline __attribute__((always_inline)) void png_finish(uint8_t *out, const uint8_t *in, size_t width, int premultiply, int bgra) {
+	size_t x = 0;
+
+#if defined(PNG_CONVERT_X86)
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; x + 4 <= width; x += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + x * 4));
+
+		if (premultiply) {
+			__m128i lo = png_premultiply_sse2(_mm_unpacklo_epi8(v, zero));
+			__m128i hi = png_premultiply_sse2(_mm_unpackhi_epi8(v, zero));
+			v = _mm_packus_epi16(lo, hi);
+		}
+
+		if (bgra)
+			v = png_swap_rb_sse2(v);
+
+		_mm_storeu_si128((__m128i *)(out + x * 4), v);
+	}
+#elif defined(PNG_CONVERT_NEON)
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x4_t v = vld4q_u8(in + x * 4);
+
+		if (premultiply) {
+			for (int c = 0; c < 3; c++) {
+				uint16x8_t lo = vmull_u8(vget_low_u8(v.val[c]), vget_low_u8(v.val[3]));
+				uint16x8_t hi = vmull_u8(vget_high_u8(v.val[c]), vget_high_u8(v.val[3]));
+				v.val[c] = vcombine_u8(vraddhn_u16(lo, vrshrq_n_u16(lo, 8)), vraddhn_u16(hi, vrshrq_n_u16(hi, 8)));
+			}
+		}
+
+		if (bgra) {
+			uint8x16_t r = v.val[0];
+			v.val[0] = v.val[2];
+			v.val[2] = r;
+		}
+
+		vst4q_u8(out + x * 4, v);
+	}
+#endif
+
+	for (; x < width; x++) {
+		uint8_t r = in[x * 4], g = in[x * 4 + 1], b = in[x * 4 + 2], a = in[x * 4 + 3];
+
+		if (premultiply) {
+			r = png_premultiply8(r, a);
+			g = png_premultiply8(g, a);
+			b = png_premultiply8(b, a);
+		}
+
+		out[x * 4] = bgra ? b : r;
+		out[x * 4 + 1] = g;
+		out[x * 4 + 2] = bgra ? r : b;
+		out[x * 4 + 3] = a;
+	}
+}
+
+static void png_finish_bgra(uint8_t *out, const uint8_t *in, size_t width) {
+	png_finish(out, in, width, 0, 1);
+}
+
+static void png_finish_premultiplied(uint8_t *out, const uint8_t *in, size_t width) {
+	png_finish(out, in, width, 1, 0);
+}
+
+static void png_finish_bgra_premultiplied(uint8_t *out, const uint8_t *in, size_t width) {
+	png_finish(out, in, width, 1, 1);
+}
+
+static void png_convert_finish(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) {
+	conv->expand(conv, out, row, width);
+	conv->finish(out, out, width);
+}
+
+// rgba8 rows need nothing but the finishing
+static void png_convert_finish_rgba8(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) {
+	conv->finish(out, row, width);
+}
+
+#if defined(PNG_CONVERT_X86)
+
+#define PNG_CONVERT_RGB8_SIMD 1
+
+// four pixels from sixteen bytes of which twelve are used, so the loop
+// stops while there are still two pixels beyond the last load
+__attribute__((target("ssse3")))
+static inline __attribute__((always_inline)) void png_rgb8_rgba(uint8_t *restrict out, const uint8_t *restrict row, size_t width, int bgra) {
+	const int r = bgra ? 2 : 0;
+	const int b = bgra ? 0 : 2;
+	const __m128i shuffle = _mm_setr_epi8(r, 1, b, -1, r + 3, 4, b + 3, -1, r + 6, 7, b + 6, -1, r + 9, 10, b + 9, -1);
+	const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+	size_t x = 0;
+
+	for (; x + 6 <= width; x += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(row + x * 3));
+		_mm_storeu_si128((__m128i *)(out + x * 4), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+	}
+
+	for (; x < width; x++) {
+		out[x * 4] = row[x * 3 + r];
+		out[x * 4 + 1] = row[x * 3 + 1];
+		out[x * 4 + 2] = row[x * 3 + b];
+		out[x * 4 + 3] = 255;
+	}
+}
+
+__attribute__((target("ssse3")))
+static void png_convert_rgb8_rgba_simd(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) {
+	(void)conv;
+	png_rgb8_rgba(out, row, width, 0);
+}
+
+__attribute__((target("ssse3")))
+static void png_convert_rgb8_bgra_simd(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) {
+	(void)conv;
+	png_rgb8_rgba(out, row, width, 1);
+}
+
+static int png_rgb8_simd_supported(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+
+#elif defined(PNG_CONVERT_NEON)
+
+#define PNG_CONVERT_RGB8_SIMD 1
+
+// a deinterleaving load and an interleaving store with alpha added
+static inline __attribute__((always_inline)) void png_rgb8_rgba(uint8_t *restrict out, const uint8_t *restrict row, size_t width, int bgra) {
+	const int r = bgra ? 2 : 0;
+	const int b = bgra ? 0 : 2;
+	size_t x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x3_t v = vld3q_u8(row + x * 3);
+		uint8x16x4_t o;
+
+		o.val[0] = v.val[r];
+		o.val[1] = v.val[1];
+		o.val[2] = v.val[b];
+		o.val[3] = vdupq_n_u8(255);
+		vst4q_u8(out + x * 4, o);
+	}
+
+	for (; x < width; x++) {
+		out[x * 4] = row[x * 3 + r];
+		out[x * 4 + 1] = row[x * 3 + 1];
+		out[x * 4 + 2] = row[x * 3 + b];
+		out[x * 4 + 3] = 255;
+	}
+}
+
+static void png_convert_rgb8_rgba_simd(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) {
+	(void)conv;
+	png_rgb8_rgba(out, row, width, 0);
+}
+
+static void png_convert_rgb8_bgra_simd(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width) {
+	(void)conv;
+	png_rgb8_rgba(out, row, width, 1);
+}
+
+static int png_rgb8_simd_supported(void) {
+	return 1;
+}
+
+#endif
+
+static size_t png_trns_size(uint8_t color_type, size_t plte_size) {
+	switch (color_type) {
+		case PNG_COLOR_GRAY: return 2;
+		case PNG_COLOR_RGB: return 6;
+		case PNG_COLOR_PALETTE: return plte_size / 3;
+		default: return 0;
+	}
+}
+
+int png_palette_check(const struct png_info *info, struct png_palette *palette) {
+	if (palette->plte) {
+		size_t entries = palette->plte_size / 3;
+
+		if (palette->plte_size % 3 || !entries || entries > 256)
+			return PNG_ERR_CORRUPT;
+
+		// entries no index can reach are as good as absent
+		if (info->color_type == PNG_COLOR_PALETTE && entries > (1u << info->bit_depth))
+			palette->plte_size = (1u << info->bit_depth) * 3;
+
+		// a suggested palette for truecolor images, of no use here
+		if (info->color_type != PNG_COLOR_PALETTE) {
+			palette->plte = NULL;
+			palette->plte_size = 0;
+		}
+	} else if (info->color_type == PNG_COLOR_PALETTE) {
+		return PNG_ERR_CORRUPT;
+	}
+
+	if (palette->trns) {
+		size_t limit = png_trns_size(info->color_type, palette->plte_size);
+		int valid = info->color_type == PNG_COLOR_PALETTE ? palette->trns_size <= limit : palette->trns_size == limit;
+
+		if (!limit || !valid) {
+			palette->trns = NULL;
+			palette->trns_size = 0;
+		}
+	}
+
+	return PNG_OK;
+}
+
+int png_palette_has_alpha(const struct png_info *info, const struct png_palette *palette) {
+	return (info->color_type & 4) || palette->trns;
+}
+
+static void png_converter_tables(struct png_converter *conv, const struct png_info *info, const struct png_palette *palette) {
+	unsigned int depth = info->bit_depth;
+	unsigned int levels = 1u << depth;
+
+	memset(conv->lut, 0, sizeof(conv->lut));
+
+	for (unsigned int v = 0; v < levels; v++) {
+		uint8_t *entry = conv->lut[v];
+		entry[3] = 255;
+
+		if (info->color_type == PNG_COLOR_PALETTE) {
+			// out of range indices come out opaque black
+			if (v < palette->plte_size / 3)
+				memcpy(entry, palette->plte + v * 3, 3);
+
+			if (v < palette->trns_size)
+				entry[3] = palette->trns[v];
+		} else {
+			entry[0] = entry[1] = entry[2] = v * 255 / (levels - 1);
+
+			if (conv->has_key && v == (unsigned int)((conv->key[0] << 8) | conv->key[1]))
+				entry[3] = 0;
+		}
+	}
+
+	if (depth >= 8)
+		return;
+
+	unsigned int mask = levels - 1;
+
+	for (unsigned int b = 0; b < 256; b++)
+		for (unsigned int i = 0; i < 8 / depth; i++)
+			conv->unpack[b][i] = (b >> (8 - depth * (i + 1))) & mask;
+}
+
+int png_converter_needed(const struct png_info *info, enum png_format format) {
+	if (format == PNG_FORMAT_NATIVE8)
+		return info->bit_depth == 16;
+
+	return format != PNG_FORMAT_NATIVE;
+}
+
+void png_converter_init(struct png_converter *conv, const struct png_info *info, const struct png_palette *palette, enum png_format format, int round16) {
+	static const uint8_t channels[7] = {1, 0, 3, 1, 2, 0, 4};
+	int rgba = format != PNG_FORMAT_RGB8;
+	int bgra = format == PNG_FORMAT_BGRA8 || format == PNG_FORMAT_BGRA8_PREMULTIPLIED;
+	int premultiply = format == PNG_FORMAT_RGBA8_PREMULTIPLIED || format == PNG_FORMAT_BGRA8_PREMULTIPLIED;
+
+	conv->pixel_size = rgba ? 4 : 3;
+	conv->bit_depth = info->bit_depth;
+	conv->channels = channels[info->color_type];
+	conv->round16 = round16;
+	conv->has_key = palette->trns && info->color_type != PNG_COLOR_PALETTE;
+
+	// the file's own layout with every sample cut down to a byte
+	if (format == PNG_FORMAT_NATIVE8) {
+		conv->pixel_size = conv->channels;
+		conv->fn = png_convert_reduce16;
+		return;
+	}
+
+	if (conv->has_key)
+		memcpy(conv->key, palette->trns, palette->trns_size);
+
+	switch (info->color_type) {
+		case PNG_COLOR_GRAY:
+		case PNG_COLOR_PALETTE:
+			if (info->bit_depth == 16) {
+				conv->fn = rgba ? png_convert_gray16_4 : png_convert_gray16_3;
+				break;
+			}
+
+			png_converter_tables(conv, info, palette);
+
+			if (info->bit_depth == 8)
+				conv->fn = rgba ? png_convert_lut4 : png_convert_lut3;
+			else
+				conv->fn = rgba ? png_convert_packed4 : png_convert_packed3;
+			break;
+		case PNG_COLOR_GRAY_ALPHA:
+			if (info->bit_depth == 16)
+				conv->fn = rgba ? png_convert_gray_alpha16_4 : png_convert_gray_alpha16_3;
+			else
+				conv->fn = rgba ? png_convert_gray_alpha8_4 : png_convert_gray_alpha8_3;
+			break;
+		case PNG_COLOR_RGB:
+			if (info->bit_depth == 16)
+				conv->fn = rgba ? png_convert_rgb16_4 : png_convert_reduce16;
+			else
+				conv->fn = rgba ? png_convert_rgb8_4 : png_convert_copy3;
+			break;
+		case PNG_COLOR_RGBA:
+			if (info->bit_depth == 16)
+				conv->fn = rgba ? png_convert_reduce16 : png_convert_rgba16_3;
+			else
+				conv->fn = rgba ? png_convert_copy4 : png_convert_rgba8_3;
+			break;
+	}
+
+	// premultiplying opaque pixels changes nothing
+	premultiply = premultiply && png_palette_has_alpha(info, palette);
+
+#ifdef PNG_CONVERT_RGB8_SIMD
+	// opaque rgb gets its alpha and its order in the same shuffle
+	if (conv->fn == png_convert_rgb8_4 && !conv->has_key && png_rgb8_simd_supported()) {
+		conv->fn = bgra ? png_convert_rgb8_bgra_simd : png_convert_rgb8_rgba_simd;
+		return;
+	}
+#endif
+
+	if (!bgra && !premultiply)
+		return;
+
+	if (premultiply)
+		conv->finish = bgra ? png_finish_bgra_premultiplied : png_finish_premultiplied;
+	else
+		conv->finish = png_finish_bgra;
+
+	// table lookups finish the table once instead of every pixel
+	if (conv->fn == png_convert_lut4 || conv->fn == png_convert_packed4) {
+		conv->finish(conv->lut[0], conv->lut[0], 256);
+		return;
+	}
+
+	conv->expand = conv->fn;
+	conv->fn = conv->fn == png_convert_copy4 ? png_convert_finish_rgba8 : png_convert_finish;
+}
@@ -0,0 +1,63 @@
+#ifndef PNG_CONVERT_H
+#define PNG_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "png_decoder.h"
+
+struct png_converter;
+
+// converts width unfiltered pixels of row into out, in one pass
+typedef void (*png_convert_fn)(const struct png_converter *conv, uint8_t *restrict out, const uint8_t *restrict row, size_t width);
+
+// swizzles or premultiplies width rgba8 pixels, in may be out
+typedef void (*png_finish_fn)(uint8_t *out, const uint8_t *in, size_t width);
+
+struct png_converter {
+	png_convert_fn fn;
+
+	// formats made from rgba8 run the rgba8 converter into the output row and
+	// finish it there while it's still in cache, or finish rgba8 rows directly
+	png_convert_fn expand;
+	png_finish_fn finish;
+
+	size_t pixel_size; // bytes per output pixel
+	unsigned int bit_depth;
+	unsigned int channels;
+	int round16; // round 16-bit samples to nearest instead of keeping the high byte
+
+	// rgba for every sample value of single channel images up to 8 bits,
+	// palette entries or scaled gray levels with tRNS applied
+	uint8_t lut[256][4];
+
+	// the sample values packed into every byte value, for 1, 2 and 4 bits
+	uint8_t unpack[256][8];
+
+	// colour key from tRNS for 16-bit gray and truecolor, big endian
+	int has_key;
+	uint8_t key[6];
+};
+
+// the PLTE and tRNS payloads of an image, NULL when it has none
+struct png_palette {
+	const uint8_t *plte;
+	size_t plte_size;
+	const uint8_t *trns;
+	size_t trns_size;
+};
+
+// check the PLTE and tRNS chunks against the header; a palette image needs
+// a palette, tRNS of the wrong size or on types with alpha is dropped
+int png_palette_check(const struct png_info *info, struct png_palette *palette);
+
+// whether pixels can be anything but opaque, from alpha or from tRNS
+int png_palette_has_alpha(const struct png_info *info, const struct png_palette *palette);
+
+// whether rows in format differ from the rows stored in the file
+int png_converter_needed(const struct png_info *info, enum png_format format);
+
+// set up the tables for converting rows to format, if that's needed
+void png_converter_init(struct png_converter *conv, const struct png_info *info, const struct png_palette *palette, enum png_format format, int round16);
+
+#endif
@@ -0,0 +1,1993 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // MAP_POPULATE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "png_decoder.h"
+#include "png_filter.h"
+#include "png_convert.h"
+#include "png_internal.h"
+#include "png_metadata.h"
+#include "png_checkpoint.h"
+#include "png_arena.h"
+#include "png_scale.h"
+#include "png_cache.h"
+
+// where the bytes of the file are: mapped, read into a buffer of our own
+// from a pipe or socket, or in memory the caller owns
+enum png_file_source {
+	PNG_FILE_MAPPED,
+	PNG_FILE_READ,
+	PNG_FILE_BORROWED,
+};
+
+struct mapped_file {
+	size_t size;
+	uint8_t *ptr;
+	enum png_file_source source;
+};
+
+// the first read buffer for streams of unknown size, doubled as needed
+#define PNG_READ_BUFFER_MIN (64 * 1024)
+
+// files up to this size are read by PNG_MAP_AUTO, setting up and tearing
+// down a mapping and faulting its pages in costs more than the copy
+#define PNG_MAP_READ_MAX (64 * 1024)
+
+// read everything up to the end of the stream
+static int read_fd(int fd, struct mapped_file *out) {
+	uint8_t *data = NULL;
+	size_t size = 0;
+	size_t capacity = 0;
+
+	for (;;) {
+		if (size == capacity) {
+			size_t grown = capacity ? capacity * 2 : PNG_READ_BUFFER_MIN;
+			uint8_t *ptr = grown > capacity ? realloc(data, grown) : NULL;
+
+			if (!ptr) {
+				free(data);
+				return PNG_ERR_NOMEM;
+			}
+
+			data = ptr;
+			capacity = grown;
+		}
+
+		ssize_t n = read(fd, data + size, capacity - size);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			int err = errno;
+			free(data);
+			errno = err;
+			return PNG_ERR_IO;
+		}
+
+		if (!n)
+			break;
+
+		size += n;
+	}
+
+	out->size = size;
+	out->ptr = data;
+	out->source = PNG_FILE_READ;
+	return PNG_OK;
+}
+
+// read a regular file of size bytes from its start, a file that got shorter
+// since is simply cut off
+static int pread_fd(int fd, size_t size, struct mapped_file *out) {
+	uint8_t *data = malloc(size ? size : 1);
+	if (!data)
+		return PNG_ERR_NOMEM;
+
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t n = pread(fd, data + done, size - done, done);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			int err = errno;
+			free(data);
+			errno = err;
+			return PNG_ERR_IO;
+		}
+
+		if (!n)
+			break;
+
+		done += n;
+	}
+
+	out->size = done;
+	out->ptr = data;
+	out->source = PNG_FILE_READ;
+	return PNG_OK;
+}
+
+// map regular files from their start, read anything else from where it is
+static int map_fd(int fd, enum png_map_mode mode, struct mapped_file *out) {
+	struct stat st;
+	if (fstat(fd, &st))
+		return PNG_ERR_IO;
+
+	if (!S_ISREG(st.st_mode))
+		return read_fd(fd, out);
+
+	if ((uint64_t)st.st_size > SIZE_MAX)
+		return PNG_ERR_NOMEM;
+
+	size_t size = st.st_size;
+
+	if (mode == PNG_MAP_READ || (mode == PNG_MAP_AUTO && size <= PNG_MAP_READ_MAX))
+		return pread_fd(fd, size, out);
+
+	// mmap refuses empty mappings, let the signature check reject the file
+	void *ptr = NULL;
+
+	if (size) {
+		int flags = MAP_PRIVATE;
+		int advise = mode != PNG_MAP_PLAIN;
+
+#ifdef MAP_POPULATE
+		if (mode == PNG_MAP_POPULATE) {
+			flags |= MAP_POPULATE;
+			advise = 0;
+		}
+#endif
+
+		ptr = mmap(NULL, size, PROT_READ, flags, fd, 0);
+		if (ptr == MAP_FAILED)
+			return PNG_ERR_IO;
+
+		// the chunk scan hops through all of the file and the image data
+		// is read front to back right after, start reading ahead at once;
+		// these are only hints, failing them changes nothing
+		if (advise) {
+			posix_madvise(ptr, size, POSIX_MADV_SEQUENTIAL);
+			posix_madvise(ptr, size, POSIX_MADV_WILLNEED);
+		}
+	}
+
+	out->size = size;
+	out->ptr = ptr;
+	out->source = PNG_FILE_MAPPED;
+	return PNG_OK;
+}
+
+static void unmap_file(struct mapped_file *file) {
+	if (!file->ptr)
+		return;
+
+	if (file->source == PNG_FILE_MAPPED)
+		munmap(file->ptr, file->size);
+	else if (file->source == PNG_FILE_READ)
+		free(file->ptr);
+}
+
+static int map_file(const char *filename, enum png_map_mode mode, struct mapped_file *out) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return PNG_ERR_IO;
+
+	int ret = map_fd(fd, mode, out);
+	int err = errno;
+
+	if (close(fd) && !ret) {
+		err = errno;
+		unmap_file(out);
+		ret = PNG_ERR_IO;
+	}
+
+	errno = err;
+	return ret;
+}
+
+// everything a decode needs besides the file itself; kept around between
+// images so the inflate state and the scanline buffers can be reused
+struct png_workspace {
+	struct png_inflater inflater;
+
+	// everything else a decode needs, zlib's memory included
+	struct png_arena arena;
+};
+
+static void png_workspace_init(struct png_workspace *ws) {
+	memset(ws, 0, sizeof(*ws));
+	png_arena_init(&ws->arena);
+}
+
+static void png_workspace_fini(struct png_workspace *ws) {
+#if PNG_INFLATE_STREAMING
+	if (ws->inflater.stream_ready)
+		PNG_Z(inflateEnd)(&ws->inflater.stream);
+#else
+	if (ws->inflater.decompressor)
+		libdeflate_free_decompressor(ws->inflater.decompressor);
+#endif
+
+	png_arena_free(&ws->arena);
+}
+
+// hand back everything the last decode took at once, the stream included
+static void png_workspace_reset(struct png_workspace *ws) {
+#if PNG_INFLATE_STREAMING
+	ws->inflater.stream_ready = 0;
+#endif
+
+	png_arena_reset(&ws->arena);
+}
+
+static uint8_t *png_workspace_lines(struct png_workspace *ws, size_t size) {
+	return png_arena_alloc(&ws->arena, size);
+}
+
+#if PNG_INFLATE_STREAMING
+
+// zlib's state and window come from the arena and go with it
+static void *png_zalloc(void *opaque, unsigned int items, unsigned int size) {
+	return png_arena_alloc(opaque, (size_t)items * size);
+}
+
+static void png_zfree(void *opaque, void *ptr) {
+	(void)opaque;
+	(void)ptr;
+}
+
+#endif
+
+int png_workspace_create(struct png_workspace **out) {
+	struct png_workspace *ws = malloc(sizeof(*ws));
+	if (!ws)
+		return PNG_ERR_NOMEM;
+
+	png_workspace_init(ws);
+
+	*out = ws;
+	return PNG_OK;
+}
+
+void png_workspace_destroy(struct png_workspace *ws) {
+	if (!ws)
+		return;
+
+	png_workspace_fini(ws);
+	free(ws);
+}
+
+void png_workspace_release(struct png_workspace *ws) {
+	png_workspace_fini(ws);
+	png_workspace_init(ws);
+}
+
+struct png_idat_stream {
+	// position in the chunk index, only IDAT chunks are consumed
+	struct png_chunk_index *index;
+	size_t next_chunk;
+	struct png_chunk_entry *entry;
+#if PNG_INFLATE_STREAMING
+	png_z_stream *stream;
+	int status;
+#endif
+
+	// running crc of the current IDAT chunk and the one it has to end up as
+	int check_crc;
+	uint32_t crc;
+	uint32_t expected_crc;
+
+	// set when the image data has already been inflated, in parallel or in
+	// one go, and always with libdeflate
+	const struct png_inflated *inflated;
+	size_t segment;
+	size_t segment_offset;
+
+	// for the stats
+	size_t chunks;
+	size_t compressed;
+	size_t decompressed;
+};
+
+static int png_idat_open(struct png_idat_stream *idat, struct png_chunk_index *index, struct png_workspace *ws, int check_crc, int check_adler, const struct png_inflated *inflated) {
+	idat->index = index;
+	idat->next_chunk = 0;
+	idat->entry = NULL;
+
+	idat->check_crc = check_crc;
+	idat->crc = 0;
+	idat->expected_crc = 0;
+
+	idat->inflated = inflated;
+	idat->segment = 0;
+	idat->segment_offset = 0;
+
+	idat->chunks = 0;
+	idat->compressed = 0;
+	idat->decompressed = 0;
+
+	if (inflated)
+		return PNG_OK;
+
+#if PNG_INFLATE_STREAMING
+	struct png_inflater *inflater = &ws->inflater;
+	idat->stream = &inflater->stream;
+	idat->status = Z_OK;
+
+	if (inflater->stream_ready) {
+		// a resumed decode leaves the stream raw, go back to zlib's framing
+		if (PNG_Z(inflateReset2)(&inflater->stream, MAX_WBITS) != Z_OK)
+			return PNG_ERR_NOMEM;
+	} else {
+		memset(&inflater->stream, 0, sizeof(inflater->stream));
+		inflater->stream.zalloc = png_zalloc;
+		inflater->stream.zfree = png_zfree;
+		inflater->stream.opaque = &ws->arena;
+
+		if (PNG_Z(inflateInit)(&inflater->stream) != Z_OK)
+			return PNG_ERR_NOMEM;
+
+		inflater->stream_ready = 1;
+	}
+
+	// without the check inflate doesn't even compute the adler-32
+	PNG_Z(inflateValidate)(&inflater->stream, check_adler);
+	return PNG_OK;
+#else
+	(void)ws;
+	(void)check_adler;
+	return PNG_ERR_UNSUPPORTED;
+#endif
+}
+
+#if PNG_INFLATE_STREAMING
+
+// start raw inflate at a checkpoint instead of the beginning of the data. the
+// chunk it starts in has been read partly and its crc can't be checked, nor
+// can the adler-32 at the end
+static int png_idat_resume(struct png_idat_stream *idat, struct png_chunk_index *index, struct png_workspace *ws, int check_crc, const struct png_checkpoint *cp) {
+	int ret = png_idat_open(idat, index, ws, check_crc, 0, NULL);
+	if (ret)
+		return ret;
+
+	png_z_stream *stream = idat->stream;
+
+	if (PNG_Z(inflateReset2)(stream, -MAX_WBITS) != Z_OK)
+		return PNG_ERR_NOMEM;
+
+	if (cp->bits && PNG_Z(inflatePrime)(stream, cp->bits, cp->prime) != Z_OK)
+		return PNG_ERR_CORRUPT;
+
+	if (PNG_Z(inflateSetDictionary)(stream, png_checkpoint_window(cp), cp->window_size) != Z_OK)
+		return PNG_ERR_CORRUPT;
+
+	const struct png_chunk *c = &index->entries[cp->chunk].chunk;
+	stream->next_in = (uint8_t *)c->data + cp->offset;
+	stream->avail_in = c->size - cp->offset;
+	idat->next_chunk = cp->chunk + 1;
+	idat->chunks = 1;
+	return PNG_OK;
+}
+
+#endif
+
+static int png_copy_inflated(struct png_idat_stream *idat, uint8_t *out, size_t out_left) {
+	const struct png_inflated *inflated = idat->inflated;
+
+	while (out_left) {
+		if (idat->segment >= inflated->count)
+			return PNG_ERR_TRUNCATED;
+
+		const struct png_segment *segment = &inflated->segments[idat->segment];
+		size_t size = segment->size - idat->segment_offset;
+		if (size > out_left)
+			size = out_left;
+
+		memcpy(out, segment->data + idat->segment_offset, size);
+		out += size;
+		out_left -= size;
+
+		idat->segment_offset += size;
+		if (idat->segment_offset == segment->size) {
+			idat->segment++;
+			idat->segment_offset = 0;
+		}
+	}
+
+	return PNG_OK;
+}
+
+#if PNG_INFLATE_STREAMING
+
+static int png_idat_error(int status) {
+	if (status == Z_MEM_ERROR)
+		return PNG_ERR_NOMEM;
+
+	// Z_DATA_ERROR, Z_NEED_DICT, or Z_STREAM_END before the image is complete
+	return PNG_ERR_CORRUPT;
+}
+
+// fold the input inflate has just consumed into the chunk's crc, while it
+// is still in cache
+static inline __attribute__((always_inline)) void png_idat_consumed(struct png_idat_stream *idat, const uint8_t *from) {
+	if (idat->check_crc)
+		idat->crc = png_crc32(idat->crc, from, idat->stream->next_in - from);
+
+	if (PNG_STATS)
+		idat->compressed += idat->stream->next_in - from;
+}
+
+// the current chunk has been consumed completely
+static int png_idat_check_crc(const struct png_idat_stream *idat) {
+	if (!idat->check_crc || !idat->entry)
+		return PNG_OK;
+
+	idat->entry->crc = idat->crc == idat->expected_crc ? PNG_CRC_OK : PNG_CRC_BAD;
+	return idat->entry->crc == PNG_CRC_OK ? PNG_OK : PNG_ERR_CRC;
+}
+
+// point the inflate input at the next IDAT payload
+static int png_idat_refill(struct png_idat_stream *idat) {
+	struct png_chunk_index *index = idat->index;
+	int ret;
+
+	if ((ret = png_idat_check_crc(idat)))
+		return ret;
+
+	do {
+		if (idat->next_chunk >= index->count)
+			return index->complete ? PNG_ERR_CORRUPT : PNG_ERR_TRUNCATED;
+
+		idat->entry = &index->entries[idat->next_chunk++];
+	} while (!png_entry_is(idat->entry, "IDAT"));
+
+	// feed the IDAT payloads straight from the mapping, the decompressed
+	// stream is just the concatenation of all of them
+	const struct png_chunk *c = &idat->entry->chunk;
+	idat->stream->next_in = c->data;
+	idat->stream->avail_in = c->size;
+	idat->chunks++;
+
+	if (idat->check_crc) {
+		idat->crc = png_crc32(0, png_chunk_type(c), 4);
+		idat->expected_crc = png_chunk_stored_crc(c);
+	}
+
+	return PNG_OK;
+}
+
+static int png_inflate_idat(struct png_idat_stream *idat, uint8_t *out, size_t out_left) {
+	png_z_stream *stream = idat->stream;
+	int ret;
+
+	while (out_left) {
+		if (idat->status != Z_OK)
+			return png_idat_error(idat->status);
+
+		if (!stream->avail_in && (ret = png_idat_refill(idat)))
+			return ret;
+
+		// avail_out is only an unsigned int, hand out huge buffers piecewise
+		const uint8_t *in = stream->next_in;
+		stream->next_out = out;
+		stream->avail_out = png_clamp_uint(out_left);
+
+		idat->status = PNG_Z(inflate)(stream, Z_NO_FLUSH);
+		png_idat_consumed(idat, in);
+
+		size_t produced = stream->next_out - out;
+		out += produced;
+		out_left -= produced;
+
+		if (idat->status == Z_BUF_ERROR)
+			idat->status = Z_OK;
+	}
+
+	return PNG_OK;
+}
+
+static int png_inflate_finish(struct png_idat_stream *idat) {
+	png_z_stream *stream = idat->stream;
+	uint8_t extra;
+	int ret;
+
+	while (idat->status == Z_OK) {
+		if (!stream->avail_in && (ret = png_idat_refill(idat)))
+			return ret;
+
+		const uint8_t *in = stream->next_in;
+		stream->next_out = &extra;
+		stream->avail_out = 1;
+
+		idat->status = PNG_Z(inflate)(stream, Z_NO_FLUSH);
+		png_idat_consumed(idat, in);
+
+		// more image data than the image has room for
+		if (!stream->avail_out)
+			return PNG_ERR_CORRUPT;
+
+		if (idat->status == Z_BUF_ERROR)
+			idat->status = Z_OK;
+	}
+
+	if (idat->status != Z_STREAM_END)
+		return png_idat_error(idat->status);
+
+	// whatever follows the end of the stream in its chunk still counts
+	if (idat->check_crc) {
+		idat->crc = png_crc32(idat->crc, stream->next_in, stream->avail_in);
+		stream->avail_in = 0;
+	}
+
+	return png_idat_check_crc(idat);
+}
+
+#endif
+
+// inflate exactly buf_size more bytes of the image data into out_data
+static int png_decompress_idat(struct png_idat_stream *idat, void *out_data, size_t buf_size) {
+	if (PNG_STATS)
+		idat->decompressed += buf_size;
+
+	if (idat->inflated)
+		return png_copy_inflated(idat, out_data, buf_size);
+
+#if PNG_INFLATE_STREAMING
+	return png_inflate_idat(idat, out_data, buf_size);
+#else
+	return PNG_ERR_UNSUPPORTED;
+#endif
+}
+
+// check that the image data ends where the image does
+static int png_idat_finish(struct png_idat_stream *idat) {
+	// inflating up front has already checked the size and the checksum
+	if (idat->inflated)
+		return PNG_OK;
+
+#if PNG_INFLATE_STREAMING
+	return png_inflate_finish(idat);
+#else
+	return PNG_ERR_UNSUPPORTED;
+#endif
+}
+
+static int png_check(struct png_state *state) {
+	if (state->size < 8)
+		return 1;
+
+	state->index += 8;
+
+	return memcmp(offset_of(state->ptr, state->index - 8), "\x89PNG\r\n\x1A\n", 8);
+}
+
+struct png_decoder {
+	struct mapped_file file;
+	struct png_chunk_index index;
+	struct png_metadata metadata;
+	struct png_info info;
+	struct png_decode_stats *stats;
+	struct png_workspace *workspace;
+	unsigned int threads;
+
+	struct png_palette palette; // points into the mapping
+	enum png_format format;
+	int round16;
+	int check_crc;
+	int check_adler;
+
+	const struct png_checkpoints *checkpoints; // owned by the caller
+};
+
+const char *png_status_string(int status) {
+	switch (status) {
+		case PNG_OK: return "success";
+		case PNG_ERR_IO: return "i/o error";
+		case PNG_ERR_NOMEM: return "out of memory";
+		case PNG_ERR_SIGNATURE: return "not a png file";
+		case PNG_ERR_HEADER: return "invalid image header";
+		case PNG_ERR_UNSUPPORTED: return "unsupported image format";
+		case PNG_ERR_TRUNCATED: return "truncated image data";
+		case PNG_ERR_CORRUPT: return "corrupt image data";
+		case PNG_ERR_CALLBACK: return "aborted by callback";
+		case PNG_ERR_ARGUMENT: return "invalid argument";
+		case PNG_ERR_CRC: return "crc mismatch";
+		default: return "unknown error";
+	}
+}
+
+// number of samples per pixel, 0 if the bit depth is invalid for the color type
+static int png_channels(uint8_t color_type, uint8_t bit_depth) {
+	switch (color_type) {
+		case PNG_COLOR_GRAY:
+			return (bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8 || bit_depth == 16) ? 1 : 0;
+		case PNG_COLOR_PALETTE:
+			return (bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8) ? 1 : 0;
+		case PNG_COLOR_GRAY_ALPHA:
+			return (bit_depth == 8 || bit_depth == 16) ? 2 : 0;
+		case PNG_COLOR_RGB:
+			return (bit_depth == 8 || bit_depth == 16) ? 3 : 0;
+		case PNG_COLOR_RGBA:
+			return (bit_depth == 8 || bit_depth == 16) ? 4 : 0;
+		default:
+			return 0;
+	}
+}
+
+// x, y, dx, dy of the seven Adam7 passes
+static const uint8_t png_adam7[PNG_ADAM7_PASSES][4] = {
+	{0, 0, 8, 8},
+	{4, 0, 8, 8},
+	{0, 4, 4, 8},
+	{2, 0, 4, 4},
+	{0, 2, 2, 4},
+	{1, 0, 2, 2},
+	{0, 1, 1, 2},
+};
+
+void png_get_pass(const struct png_info *info, unsigned int index, struct png_pass *out) {
+	if (!info->interlace) {
+		*out = (struct png_pass){0, 0, 0, 1, 1, info->width, info->height};
+		return;
+	}
+
+	const uint8_t *p = png_adam7[index];
+	*out = (struct png_pass){index, p[0], p[1], p[2], p[3], 0, 0};
+
+	if (info->width > p[0])
+		out->width = (info->width - p[0] + p[2] - 1) / p[2];
+
+	if (info->height > p[1])
+		out->height = (info->height - p[1] + p[3] - 1) / p[3];
+}
+
+size_t png_pixel_bits(const struct png_info *info) {
+	return png_channels(info->color_type, info->bit_depth) * info->bit_depth;
+}
+
+size_t png_pass_row_size(const struct png_pass *pass, size_t pixel_bits) {
+	return ((uint64_t)pass->width * pixel_bits + 7) / 8;
+}
+
+// the total inflated size, every pass row has its own filter type byte
+static int png_data_size(const struct png_info *info, size_t pixel_bits, size_t *out) {
+	unsigned int passes = info->interlace ? PNG_ADAM7_PASSES : 1;
+	size_t size = 0;
+
+	for (unsigned int i = 0; i < passes; i++) {
+		struct png_pass pass;
+		png_get_pass(info, i, &pass);
+
+		if (!pass.width || !pass.height)
+			continue;
+
+		size_t line_size = png_pass_row_size(&pass, pixel_bits) + 1;
+		if (pass.height > (SIZE_MAX - size) / line_size)
+			return PNG_ERR_UNSUPPORTED;
+
+		size += line_size * pass.height;
+	}
+
+	*out = size;
+	return PNG_OK;
+}
+
+int png_read_header(struct png_state *state, struct png_info *info) {
+	if (png_check(state))
+		return PNG_ERR_SIGNATURE;
+
+	struct png_chunk c;
+	if (png_fetch_next_chunk(state, &c))
+		return PNG_ERR_HEADER;
+
+	if (strncmp("IHDR", c.type, 4) || c.size != 13)
+		return PNG_ERR_HEADER;
+
+	if (!png_chunk_crc_ok(&c))
+		return PNG_ERR_CRC;
+
+	// the payload is at any alignment
+	const uint8_t *ihdr = c.data;
+
+	info->width = png_load_be32(ihdr);
+	info->height = png_load_be32(ihdr + 4);
+	info->bit_depth = ihdr[8];
+	info->color_type = ihdr[9];
+	info->compression = ihdr[10];
+	info->filter = ihdr[11];
+	info->interlace = ihdr[12];
+
+	if (!info->width || !info->height || info->width > INT32_MAX || info->height > INT32_MAX)
+		return PNG_ERR_HEADER;
+
+	int channels = png_channels(info->color_type, info->bit_depth);
+	if (!channels)
+		return PNG_ERR_HEADER;
+
+	if (info->compression != 0 || info->filter != 0 || info->interlace > 1)
+		return PNG_ERR_HEADER;
+
+	// filters work on whole bytes, sub-byte pixels count as one
+	uint64_t pixel_bits = channels * info->bit_depth;
+	uint64_t row_size = ((uint64_t)info->width * pixel_bits + 7) / 8;
+
+	// leave room for the filter type byte in front of every row
+	if (row_size > SIZE_MAX - 1)
+		return PNG_ERR_UNSUPPORTED;
+
+	info->pixel_size = pixel_bits < 8 ? 1 : pixel_bits / 8;
+	info->row_size = row_size;
+
+	return png_data_size(info, pixel_bits, &info->data_size);
+}
+
+// walk the chunk headers once, up to and including IEND. an IHDR that
+// passed png_read_header is always the first entry
+static int png_index_chunks(const struct png_state *file, struct png_chunk_index *out) {
+	struct png_state chunks = {file->ptr, file->size, 8};
+	struct png_chunk c;
+	size_t capacity = 0;
+
+	memset(out, 0, sizeof(*out));
+
+	while (!png_fetch_next_chunk(&chunks, &c)) {
+		if (out->count == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+
+			struct png_chunk_entry *entries = realloc(out->entries, capacity * sizeof(*entries));
+			if (!entries)
+				return PNG_ERR_NOMEM;
+
+			out->entries = entries;
+		}
+
+		out->entries[out->count++] = (struct png_chunk_entry){c, PNG_CRC_UNCHECKED};
+
+		if (!strncmp("IDAT", c.type, 4))
+			out->idat_count++;
+
+		if (!strncmp("IEND", c.type, 4)) {
+			out->complete = 1;
+			break;
+		}
+	}
+
+	// png_read_header has checked it already
+	out->entries[0].crc = PNG_CRC_OK;
+	return PNG_OK;
+}
+
+// find PLTE and tRNS, both have to come before the image data
+static int png_read_palette(struct png_decoder *decoder, struct png_palette *out) {
+	memset(out, 0, sizeof(*out));
+
+	for (size_t i = 0; i < decoder->index.count; i++) {
+		struct png_chunk_entry *entry = &decoder->index.entries[i];
+		const struct png_chunk *c = &entry->chunk;
+
+		if (png_entry_is(entry, "IDAT"))
+			break;
+
+		int palette = png_entry_is(entry, "PLTE") || png_entry_is(entry, "tRNS");
+
+		if (palette && !png_entry_crc_ok(entry))
+			return PNG_ERR_CRC;
+
+		if (png_entry_is(entry, "PLTE")) {
+			out->plte = c->data;
+			out->plte_size = c->size;
+		} else if (png_entry_is(entry, "tRNS")) {
+			out->trns = c->data;
+			out->trns_size = c->size;
+		}
+	}
+
+	return png_palette_check(&decoder->info, out);
+}
+
+// signature plus the length, type, payload and crc of IHDR
+#define PNG_HEADER_SIZE (8 + 4 + 4 + 13 + 4)
+
+int png_read_info(const char *filename, struct png_info *out) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return PNG_ERR_IO;
+
+	uint8_t buf[PNG_HEADER_SIZE];
+	ssize_t size = pread(fd, buf, sizeof(buf), 0);
+
+	int err = errno;
+	close(fd);
+
+	if (size < 0) {
+		errno = err;
+		return PNG_ERR_IO;
+	}
+
+	struct png_state state = {buf, size, 0};
+	return png_read_header(&state, out);
+}
+
+// set up a decoder for the file, which it owns from then on
+static int png_decoder_create(struct png_decoder **out, struct mapped_file *file) {
+	struct png_decoder *decoder = calloc(1, sizeof(*decoder));
+	if (!decoder) {
+		unmap_file(file);
+		return PNG_ERR_NOMEM;
+	}
+
+	decoder->file = *file;
+
+	struct png_state state = {decoder->file.ptr, decoder->file.size, 0};
+	decoder->threads = 1;
+	decoder->check_crc = 1;
+	decoder->check_adler = 1;
+
+	int ret = png_read_header(&state, &decoder->info);
+	if (!ret)
+		ret = png_index_chunks(&state, &decoder->index);
+	if (!ret)
+		ret = png_read_palette(decoder, &decoder->palette);
+
+	if (ret) {
+		png_decoder_close(decoder);
+		return ret;
+	}
+
+	*out = decoder;
+	return PNG_OK;
+}
+
+int png_decoder_open(struct png_decoder **out, const char *filename) {
+	return png_decoder_open_with(out, filename, PNG_MAP_AUTO);
+}
+
+int png_decoder_open_with(struct png_decoder **out, const char *filename, enum png_map_mode mode) {
+	if (mode < PNG_MAP_AUTO || mode > PNG_MAP_READ)
+		return PNG_ERR_ARGUMENT;
+
+	struct mapped_file file;
+
+	int ret = map_file(filename, mode, &file);
+	if (ret)
+		return ret;
+
+	return png_decoder_create(out, &file);
+}
+
+int png_decoder_open_fd(struct png_decoder **out, int fd) {
+	struct mapped_file file;
+
+	int ret = map_fd(fd, PNG_MAP_AUTO, &file);
+	if (ret)
+		return ret;
+
+	return png_decoder_create(out, &file);
+}
+
+int png_decoder_open_memory(struct png_decoder **out, const void *data, size_t size) {
+	if (!data && size)
+		return PNG_ERR_ARGUMENT;
+
+	struct mapped_file file = {size, (uint8_t *)data, PNG_FILE_BORROWED};
+	return png_decoder_create(out, &file);
+}
+
+void png_decoder_close(struct png_decoder *decoder) {
+	if (!decoder)
+		return;
+
+	unmap_file(&decoder->file);
+	png_metadata_free(&decoder->metadata);
+	free(decoder->index.entries);
+	free(decoder);
+}
+
+void png_decoder_get_info(const struct png_decoder *decoder, struct png_info *out) {
+	*out = decoder->info;
+}
+
+void png_decoder_set_workspace(struct png_decoder *decoder, struct png_workspace *ws) {
+	decoder->workspace = ws;
+}
+
+void png_decoder_set_threads(struct png_decoder *decoder, unsigned int threads) {
+	decoder->threads = threads ? threads : 1;
+}
+
+int png_decoder_set_format(struct png_decoder *decoder, enum png_format format) {
+	switch (format) {
+		case PNG_FORMAT_NATIVE:
+			break;
+		case PNG_FORMAT_RGB8:
+		case PNG_FORMAT_RGBA8:
+		case PNG_FORMAT_BGRA8:
+		case PNG_FORMAT_RGBA8_PREMULTIPLIED:
+		case PNG_FORMAT_BGRA8_PREMULTIPLIED:
+			// rows have to stay addressable in the output format too
+			if ((uint64_t)decoder->info.width * 4 > SIZE_MAX)
+				return PNG_ERR_UNSUPPORTED;
+			break;
+		case PNG_FORMAT_NATIVE8:
+			break;
+		default:
+			return PNG_ERR_ARGUMENT;
+	}
+
+	decoder->format = format;
+	return PNG_OK;
+}
+
+void png_decoder_set_rounding(struct png_decoder *decoder, int round) {
+	decoder->round16 = round;
+}
+
+// bytes per row of width pixels in format
+size_t png_format_row_size(const struct png_info *info, enum png_format format, uint32_t width) {
+	struct png_pass pass = {.width = width};
+	size_t pixel_bits = png_pixel_bits(info);
+
+	switch (format) {
+		case PNG_FORMAT_RGB8: return (size_t)width * 3;
+		case PNG_FORMAT_RGBA8:
+		case PNG_FORMAT_BGRA8:
+		case PNG_FORMAT_RGBA8_PREMULTIPLIED:
+		case PNG_FORMAT_BGRA8_PREMULTIPLIED: return (size_t)width * 4;
+		case PNG_FORMAT_NATIVE8: return png_pass_row_size(&pass, info->bit_depth == 16 ? pixel_bits / 2 : pixel_bits);
+		default: return png_pass_row_size(&pass, pixel_bits);
+	}
+}
+
+size_t png_decoder_row_size(const struct png_decoder *decoder) {
+	return png_format_row_size(&decoder->info, decoder->format, decoder->info.width);
+}
+
+size_t png_decoder_region_row_size(const struct png_decoder *decoder, const struct png_region *region) {
+	return png_format_row_size(&decoder->info, decoder->format, region->width);
+}
+
+int png_decoder_has_alpha(const struct png_decoder *decoder) {
+	return png_palette_has_alpha(&decoder->info, &decoder->palette);
+}
+
+size_t png_decoder_chunk_count(const struct png_decoder *decoder) {
+	return decoder->index.count;
+}
+
+int png_decoder_chunk_info(const struct png_decoder *decoder, size_t index, struct png_chunk_info *out) {
+	if (index >= decoder->index.count)
+		return PNG_ERR_ARGUMENT;
+
+	const struct png_chunk_entry *entry = &decoder->index.entries[index];
+
+	memcpy(out->type, entry->chunk.type, 4);
+	out->size = entry->chunk.size;
+	out->offset = (const uint8_t *)entry->chunk.data - decoder->file.ptr;
+	out->crc = entry->crc;
+	return PNG_OK;
+}
+
+const void *png_decoder_chunk_data(const struct png_decoder *decoder, size_t index) {
+	if (index >= decoder->index.count)
+		return NULL;
+
+	return decoder->index.entries[index].chunk.data;
+}
+
+size_t png_decoder_find_chunk(const struct png_decoder *decoder, const char type[4], size_t start) {
+	for (size_t i = start; i < decoder->index.count; i++)
+		if (png_entry_is(&decoder->index.entries[i], type))
+			return i;
+
+	return decoder->index.count;
+}
+
+int png_decoder_check_chunk(struct png_decoder *decoder, size_t index) {
+	if (index >= decoder->index.count)
+		return PNG_ERR_ARGUMENT;
+
+	return png_entry_crc_ok(&decoder->index.entries[index]) ? PNG_OK : PNG_ERR_CRC;
+}
+
+int png_decoder_decode_cached(struct png_decoder *decoder, struct png_cache *cache, const struct png_image **out) {
+	if (!cache || !out)
+		return PNG_ERR_ARGUMENT;
+
+	uint64_t key = png_cache_key(&decoder->index, decoder->format, decoder->round16);
+
+	*out = png_cache_find(cache, key);
+	if (*out)
+		return PNG_OK;
+
+	size_t row_size = png_decoder_row_size(decoder);
+	struct png_image *image = png_cache_image_create(&decoder->info, decoder->format, row_size);
+	if (!image)
+		return PNG_ERR_NOMEM;
+
+	int ret = png_decoder_decode_into(decoder, (uint8_t *)image->data, row_size);
+	if (ret) {
+		png_image_release(image);
+		return ret;
+	}
+
+	*out = png_cache_insert(cache, key, image);
+	return PNG_OK;
+}
+
+int png_decoder_build_checkpoints(struct png_decoder *decoder, uint32_t rows, struct png_checkpoints **out) {
+	return png_checkpoints_build(&decoder->index, &decoder->info, decoder->check_crc, rows, out);
+}
+
+int png_decoder_set_checkpoints(struct png_decoder *decoder, const struct png_checkpoints *cp) {
+	if (cp && !png_checkpoints_match(cp, &decoder->index, &decoder->info))
+		return PNG_ERR_ARGUMENT;
+
+	decoder->checkpoints = cp;
+	return PNG_OK;
+}
+
+size_t png_decoder_text_count(const struct png_decoder *decoder) {
+	return png_metadata_text_count(&decoder->index);
+}
+
+int png_decoder_get_text(struct png_decoder *decoder, size_t n, struct png_text *out) {
+	return png_metadata_text(&decoder->metadata, &decoder->index, decoder->check_crc, n, out);
+}
+
+int png_decoder_get_icc(struct png_decoder *decoder, struct png_icc *out) {
+	return png_metadata_icc(&decoder->metadata, &decoder->index, decoder->check_crc, out);
+}
+
+int png_decoder_get_exif(struct png_decoder *decoder, const void **data, size_t *size) {
+	return png_metadata_exif(&decoder->index, decoder->check_crc, data, size);
+}
+
+void png_decoder_set_crc_check(struct png_decoder *decoder, int enabled) {
+	decoder->check_crc = enabled;
+}
+
+void png_decoder_set_adler_check(struct png_decoder *decoder, int enabled) {
+	decoder->check_adler = enabled;
+}
+
+void png_decoder_collect_stats(struct png_decoder *decoder, struct png_decode_stats *stats) {
+	decoder->stats = stats;
+}
+
+// the time in ns when collecting stats, 0 otherwise
+static inline __attribute__((always_inline)) uint64_t png_stats_clock(const struct png_decode_stats *stats) {
+	if (!PNG_STATS || !stats)
+		return 0;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// add the time since lap to a stage and start the next one
+#define PNG_STATS_LAP(stats, stage, lap) \
+	do { \
+		if (PNG_STATS && (stats)) { \
+			uint64_t png_now = png_stats_clock(stats); \
+			(stats)->stage += png_now - (lap); \
+			(lap) = png_now; \
+		} \
+	} while (0)
+
+// what the counters and clocks read when a decode starts
+struct png_stats_start {
+	uint64_t ns;
+	long minor_faults;
+	long major_faults;
+	size_t allocations;
+};
+
+static void png_stats_begin(const struct png_decoder *decoder, const struct png_workspace *ws, struct png_stats_start *start) {
+	struct png_decode_stats *stats = decoder->stats;
+	memset(start, 0, sizeof(*start));
+
+	if (!stats)
+		return;
+
+	memset(stats, 0, sizeof(*stats));
+
+	if (!PNG_STATS)
+		return;
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	stats->bytes_mapped = decoder->file.size;
+	start->minor_faults = usage.ru_minflt;
+	start->major_faults = usage.ru_majflt;
+	start->allocations = ws->arena.allocations;
+	start->ns = png_stats_clock(stats);
+}
+
+static void png_stats_end(const struct png_decoder *decoder, const struct png_workspace *ws, const struct png_stats_start *start) {
+	struct png_decode_stats *stats = decoder->stats;
+	if (!PNG_STATS || !stats)
+		return;
+
+	stats->total_ns = png_stats_clock(stats) - start->ns;
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	stats->minor_faults = usage.ru_minflt - start->minor_faults;
+	stats->major_faults = usage.ru_majflt - start->major_faults;
+	stats->allocations += ws->arena.allocations - start->allocations;
+}
+
+// the image data a decode went through
+static void png_stats_idat(struct png_decode_stats *stats, const struct png_idat_stream *idat, const struct png_chunk_index *index) {
+	if (!PNG_STATS || !stats)
+		return;
+
+	stats->decompressed_bytes = idat->decompressed;
+
+	if (!idat->inflated) {
+		stats->idat_chunks = idat->chunks;
+		stats->compressed_bytes = idat->compressed;
+		return;
+	}
+
+	// inflating up front went through all of it, into buffers of its own
+	stats->idat_chunks = index->idat_count;
+
+	for (size_t i = 0; i < index->count; i++)
+		if (png_entry_is(&index->entries[i], "IDAT"))
+			stats->compressed_bytes += index->entries[i].chunk.size;
+
+	if (!idat->inflated->arena)
+		stats->allocations += idat->inflated->count + 1;
+}
+
+// where decoded pixels go: either rows stride bytes apart in dst, or one
+// row at a time to a row callback; passes are reported when one is given.
+// rows are converted on the way out unless the format is native
+struct png_output {
+	uint8_t *dst; // row y of the window goes to dst + (y - window.y) * stride
+	size_t stride;
+	png_row_callback rows;
+	png_pass_callback passes;
+	void *ctx;
+
+	const struct png_converter *conv;
+	size_t row_size;       // bytes per output row of the window
+	size_t image_row_size; // bytes per output row of the whole image
+
+	// the part of the image that is output, rows above it are unfiltered but
+	// nothing else, rows below it aren't even inflated
+	struct png_region window;
+	int cropped; // the window is narrower than the image
+
+	// where the window starts in an unfiltered row, rounded down to whole
+	// bytes and skip pixels before x for sub-byte pixels, which only
+	// converted rows can start at; and in an output row of the whole image
+	size_t in_offset;
+	uint32_t skip;
+	size_t out_offset;
+	size_t line_size; // a converted row with the skipped pixels in front
+
+	// a downscaled decode, which takes the rows in place of dst or the row
+	// callback; Adam7 images are decoded straight onto its reduced grid
+	struct png_scaler *scaler;
+};
+
+// rows can be unfiltered right where they end up, against the row above
+static inline __attribute__((always_inline)) int png_output_in_place(const struct png_output *out) {
+	return out->dst && !out->conv && !out->cropped;
+}
+
+// where row y is unfiltered: in dst when that's possible and the row is in
+// the window, otherwise in one of the two scratch lines
+static inline __attribute__((always_inline)) uint8_t *png_output_line(const struct png_output *out, size_t y, uint8_t *lines, size_t row_size) {
+	if (png_output_in_place(out) && y >= out->window.y)
+		return out->dst + (y - out->window.y) * out->stride;
+
+	return lines + (y & 1) * row_size;
+}
+
+// hand on an unfiltered row, converted into dst or into out_line first and
+// cut down to the window
+static inline __attribute__((always_inline)) int png_emit_row(const struct png_output *out, size_t y, uint8_t *line, uint8_t *out_line) {
+	if (y < out->window.y)
+		return PNG_OK;
+
+	uint8_t *dst = out->dst ? out->dst + (y - out->window.y) * out->stride : NULL;
+	uint8_t *row = line + out->in_offset;
+
+	if (out->conv) {
+		// skipped pixels are converted as well, then left out
+		uint8_t *conv_row = dst && !out->skip ? dst : out_line;
+		out->conv->fn(out->conv, conv_row, row, out->window.width + out->skip);
+		row = conv_row + out->skip * out->conv->pixel_size;
+	}
+
+	if (dst && row != dst)
+		row = memcpy(dst, row, out->row_size);
+
+	if (out->rows && out->rows(out->ctx, y, row))
+		return PNG_ERR_CALLBACK;
+
+	return PNG_OK;
+}
+
+// inflate and unfilter one scanline at a time. rows either go straight into
+// dst, where they are unfiltered against the row above them, or through two
+// scratch lines and then converted or passed to the callback as they are;
+// nothing else is ever buffered
+// with from set, the stream has been resumed there and rows start at its
+// row, with the row above and the first bytes of the row taken from it
+static int png_unfilter_image(struct png_decoder *decoder, struct png_idat_stream *idat, uint8_t *lines, const struct png_output *out, const struct png_checkpoint *from) {
+	const struct png_info *info = &decoder->info;
+	struct png_decode_stats *stats = decoder->stats;
+	int ret;
+
+	struct png_unfilter_kernels kernels;
+	png_unfilter_select(&kernels, info->pixel_size);
+
+	uint8_t *prev_line = NULL;
+	size_t y = 0;
+	uint64_t lap = png_stats_clock(stats);
+
+	// the window starts at or below the checkpoint, so these are scratch lines
+	if (from) {
+		y = from->row;
+		prev_line = memcpy(lines + ((y - 1) & 1) * info->row_size, png_checkpoint_prev(from), info->row_size);
+	}
+
+	for (; y < out->window.y + out->window.height; y++) {
+		uint8_t *line = png_output_line(out, y, lines, info->row_size);
+		uint8_t filter_method;
+		size_t done = 0;
+
+		if (from && y == from->row && from->partial) {
+			const uint8_t *partial = png_checkpoint_line(from, info->row_size);
+
+			filter_method = partial[0];
+			done = from->partial - 1;
+			memcpy(line, partial + 1, done);
+		} else if ((ret = png_decompress_idat(idat, &filter_method, 1))) {
+			return ret;
+		}
+
+		if ((ret = png_decompress_idat(idat, line + done, info->row_size - done)))
+			return ret;
+
+		PNG_STATS_LAP(stats, inflate_ns, lap);
+
+		if (png_unfilter_row(&kernels, filter_method, line, prev_line, info->row_size))
+			return PNG_ERR_CORRUPT;
+
+		if (PNG_STATS && stats)
+			stats->filter_rows[filter_method]++;
+
+		PNG_STATS_LAP(stats, unfilter_ns, lap);
+
+		if ((ret = png_emit_row(out, y, line, lines + info->row_size * 2)))
+			return ret;
+
+		PNG_STATS_LAP(stats, output_ns, lap);
+		prev_line = line;
+	}
+
+	// stopping short of the end leaves the rest of the data unchecked
+	if (out->window.y + out->window.height < info->height)
+		return PNG_OK;
+
+	ret = png_idat_finish(idat);
+	PNG_STATS_LAP(stats, inflate_ns, lap);
+	return ret;
+}
+
+void png_scatter_row(uint8_t *row, const uint8_t *line, const struct png_pass *pass, size_t pixel_bits) {
+	if (pixel_bits < 8) {
+		unsigned int mask = (1u << pixel_bits) - 1;
+
+		// sub-byte pixels are packed from the most significant bit on
+		for (size_t x = 0; x < pass->width; x++) {
+			size_t src = x * pixel_bits;
+			size_t dst = (pass->x + x * pass->dx) * pixel_bits;
+			unsigned int value = (line[src / 8] >> (8 - pixel_bits - src % 8)) & mask;
+			unsigned int shift = 8 - pixel_bits - dst % 8;
+
+			row[dst / 8] = (row[dst / 8] & ~(mask << shift)) | (value << shift);
+		}
+
+		return;
+	}
+
+	size_t pixel_size = pixel_bits / 8;
+	size_t step = pass->dx * pixel_size;
+	uint8_t *out = row + pass->x * pixel_size;
+
+	// constant sizes let the copies turn into plain loads and stores
+	#define PNG_SCATTER_CASE(n) \
+		case n: \
+			for (size_t x = 0; x < pass->width; x++, out += step, line += n) \
+				memcpy(out, line, n); \
+			break;
+
+	switch (pixel_size) {
+		PNG_SCATTER_CASE(1)
+		PNG_SCATTER_CASE(2)
+		PNG_SCATTER_CASE(3)
+		PNG_SCATTER_CASE(4)
+		PNG_SCATTER_CASE(6)
+		PNG_SCATTER_CASE(8)
+	}
+
+	#undef PNG_SCATTER_CASE
+}
+
+// unfilter the seven Adam7 passes through the two scratch lines, each one
+// with the same row kernels as a plain image of the pass's size, and spread
+// their pixels over image, converted through a third line if needed. image
+// holds the rows of the window at their full width, pass rows outside it
+// are unfiltered and dropped
+static int png_unfilter_interlaced(struct png_decoder *decoder, struct png_idat_stream *idat, uint8_t *lines, uint8_t *image, size_t stride, const struct png_output *out) {
+	const struct png_info *info = &decoder->info;
+	struct png_decode_stats *stats = decoder->stats;
+	size_t pixel_bits = png_pixel_bits(info);
+	size_t out_bits = out->conv ? out->conv->pixel_size * 8 : pixel_bits;
+	uint8_t *out_line = lines + info->row_size * 2;
+	int ret;
+
+	struct png_unfilter_kernels kernels;
+	png_unfilter_select(&kernels, info->pixel_size);
+
+	uint64_t lap = png_stats_clock(stats);
+
+	// every pass past the first adds a row or a column in between, at 1/2
+	// the last two passes aren't needed, at 1/8 only the first one is
+	unsigned int shift = out->scaler ? out->scaler->shift : 0;
+	unsigned int passes = PNG_ADAM7_PASSES - shift * 2;
+
+	for (unsigned int i = 0; i < passes; i++) {
+		struct png_pass pass;
+		png_get_pass(info, i, &pass);
+
+		// empty passes aren't stored at all, not even their filter bytes
+		if (!pass.width || !pass.height)
+			continue;
+
+		size_t row_size = png_pass_row_size(&pass, pixel_bits);
+		uint8_t *prev_line = NULL;
+
+		for (size_t y = 0; y < pass.height; y++) {
+			uint8_t *line = lines + (y & 1) * info->row_size;
+			uint8_t filter_method;
+
+			if ((ret = png_decompress_idat(idat, &filter_method, 1)))
+				return ret;
+
+			if ((ret = png_decompress_idat(idat, line, row_size)))
+				return ret;
+
+			PNG_STATS_LAP(stats, inflate_ns, lap);
+
+			if (png_unfilter_row(&kernels, filter_method, line, prev_line, row_size))
+				return PNG_ERR_CORRUPT;
+
+			if (PNG_STATS && stats)
+				stats->filter_rows[filter_method]++;
+
+			PNG_STATS_LAP(stats, unfilter_ns, lap);
+			prev_line = line;
+
+			size_t row = pass.y + y * pass.dy;
+			if (row < out->window.y || row - out->window.y >= out->window.height)
+				continue;
+
+			if (out->conv) {
+				out->conv->fn(out->conv, out_line, line, pass.width);
+				line = out_line;
+			}
+
+			// the passes used land on whole positions of the reduced grid
+			struct png_pass grid = pass;
+			grid.x >>= shift;
+			grid.dx >>= shift;
+
+			png_scatter_row(image + ((row - out->window.y) >> shift) * stride, line, &grid, out_bits);
+			PNG_STATS_LAP(stats, output_ns, lap);
+		}
+
+		if (out->passes && out->passes(out->ctx, &pass))
+			return PNG_ERR_CALLBACK;
+
+		PNG_STATS_LAP(stats, output_ns, lap);
+	}
+
+	// the passes left out are never inflated, the rest of the stream isn't
+	// checked either, like below a window
+	if (passes < PNG_ADAM7_PASSES)
+		return PNG_OK;
+
+	ret = png_idat_finish(idat);
+	PNG_STATS_LAP(stats, inflate_ns, lap);
+	return ret;
+}
+
+#if PNG_INFLATE_STREAMING
+
+// blocks of whole filtered rows, filter bytes included, handed from the
+// inflate thread to the unfilter thread through a single producer single
+// consumer ring; head and tail only ever grow, a block lives in slot n % count
+#define PNG_PIPELINE_BLOCKS 4
+#define PNG_PIPELINE_BLOCK_SIZE (128 * 1024)
+
+struct png_pipeline {
+	struct png_idat_stream *idat;
+	uint8_t *blocks;
+	size_t block_size;
+	size_t block_rows;
+	size_t block_count;
+	size_t rows;
+	size_t line_size; // row_size plus the filter byte
+	int finish;       // all rows are wanted, check the end of the data too
+
+	size_t head; // blocks inflated, written by the producer only
+	size_t tail; // blocks unfiltered, written by the consumer only
+	int done;    // set by the producer once status is final
+	int stop;    // set by the consumer when it gives up early
+	int status;
+};
+
+static inline __attribute__((always_inline)) void png_pipeline_wait(unsigned int *spins) {
+	// spin a little before giving the core away, the other side is usually close
+	if (++*spins < 64)
+		return;
+
+	sched_yield();
+}
+
+static void *png_pipeline_producer(void *arg) {
+	struct png_pipeline *pipe = arg;
+	int ret = PNG_OK;
+
+	for (size_t n = 0; n < pipe->block_count; n++) {
+		unsigned int spins = 0;
+
+		while (n - __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE) >= PNG_PIPELINE_BLOCKS) {
+			if (__atomic_load_n(&pipe->stop, __ATOMIC_RELAXED))
+				goto end;
+
+			png_pipeline_wait(&spins);
+		}
+
+		size_t rows = pipe->rows - n * pipe->block_rows;
+		if (rows > pipe->block_rows)
+			rows = pipe->block_rows;
+
+		uint8_t *block = pipe->blocks + (n % PNG_PIPELINE_BLOCKS) * pipe->block_size;
+
+		if ((ret = png_decompress_idat(pipe->idat, block, rows * pipe->line_size)))
+			goto end;
+
+		__atomic_store_n(&pipe->head, n + 1, __ATOMIC_RELEASE);
+	}
+
+	// a window that ends early leaves the rest of the data alone
+	if (pipe->finish)
+		ret = png_idat_finish(pipe->idat);
+
+end:
+	pipe->status = ret;
+	__atomic_store_n(&pipe->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// unfilter the blocks as the producer publishes them. rows are unfiltered in
+// place in the ring, or copied into dst first; the last row of every block is
+// kept in last_line since its slot gets reused while the next block is worked on
+static int png_pipeline_consume(struct png_decoder *decoder, struct png_pipeline *pipe, uint8_t *last_line, const struct png_output *out) {
+	const struct png_info *info = &decoder->info;
+	struct png_decode_stats *stats = decoder->stats;
+	int in_place = png_output_in_place(out);
+	int ret;
+
+	struct png_unfilter_kernels kernels;
+	png_unfilter_select(&kernels, info->pixel_size);
+
+	const uint8_t *prev_line = NULL;
+	size_t y = 0;
+	uint64_t lap = png_stats_clock(stats);
+
+	for (size_t n = 0; n < pipe->block_count; n++) {
+		unsigned int spins = 0;
+
+		while (__atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) == n) {
+			if (__atomic_load_n(&pipe->done, __ATOMIC_ACQUIRE) && __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) == n)
+				return pipe->status;
+
+			png_pipeline_wait(&spins);
+		}
+
+		PNG_STATS_LAP(stats, inflate_ns, lap);
+
+		uint8_t *block = pipe->blocks + (n % PNG_PIPELINE_BLOCKS) * pipe->block_size;
+		size_t end = y + pipe->block_rows < pipe->rows ? y + pipe->block_rows : pipe->rows;
+
+		for (; y < end; y++, block += pipe->line_size) {
+			uint8_t filter_method = block[0];
+			uint8_t *line = block + 1;
+
+			if (in_place && y >= out->window.y)
+				line = memcpy(out->dst + (y - out->window.y) * out->stride, line, info->row_size);
+
+			if (png_unfilter_row(&kernels, filter_method, line, prev_line, info->row_size))
+				return PNG_ERR_CORRUPT;
+
+			if (PNG_STATS && stats)
+				stats->filter_rows[filter_method]++;
+
+			PNG_STATS_LAP(stats, unfilter_ns, lap);
+
+			if ((ret = png_emit_row(out, y, line, last_line + info->row_size)))
+				return ret;
+
+			PNG_STATS_LAP(stats, output_ns, lap);
+			prev_line = line;
+		}
+
+		if (!in_place || y - 1 < out->window.y)
+			prev_line = memcpy(last_line, prev_line, info->row_size);
+
+		__atomic_store_n(&pipe->tail, n + 1, __ATOMIC_RELEASE);
+	}
+
+	unsigned int spins = 0;
+
+	while (!__atomic_load_n(&pipe->done, __ATOMIC_ACQUIRE))
+		png_pipeline_wait(&spins);
+
+	PNG_STATS_LAP(stats, inflate_ns, lap);
+	return pipe->status;
+}
+
+// inflate on a second thread while this one unfilters, returns
+// PNG_ERR_UNSUPPORTED without touching the stream if that isn't possible
+static int png_unfilter_pipelined(struct png_decoder *decoder, struct png_workspace *ws, struct png_idat_stream *idat, const struct png_output *out) {
+	const struct png_info *info = &decoder->info;
+
+	// blocks are runs of equally sized rows, passes don't fit that
+	if (info->interlace)
+		return PNG_ERR_UNSUPPORTED;
+
+	struct png_pipeline pipe = {
+		.idat = idat,
+		.rows = out->window.y + out->window.height,
+		.line_size = info->row_size + 1,
+	};
+
+	pipe.finish = pipe.rows == info->height;
+
+	pipe.block_rows = PNG_PIPELINE_BLOCK_SIZE / pipe.line_size;
+	if (!pipe.block_rows)
+		pipe.block_rows = 1;
+
+	// not worth a thread unless the ring actually gets cycled through
+	pipe.block_count = (pipe.rows + pipe.block_rows - 1) / pipe.block_rows;
+	if (pipe.block_count <= PNG_PIPELINE_BLOCKS || pipe.line_size > (SIZE_MAX - info->row_size - out->line_size) / PNG_PIPELINE_BLOCKS)
+		return PNG_ERR_UNSUPPORTED;
+
+	pipe.block_size = pipe.block_rows * pipe.line_size;
+
+	// the ring, the saved last row and a line for converted rows
+	size_t ring_size = pipe.block_size * PNG_PIPELINE_BLOCKS;
+	uint8_t *lines = png_workspace_lines(ws, ring_size + info->row_size + out->line_size);
+	if (!lines)
+		return PNG_ERR_NOMEM;
+
+	pipe.blocks = lines;
+
+	pthread_t producer;
+	if (pthread_create(&producer, NULL, png_pipeline_producer, &pipe))
+		return PNG_ERR_UNSUPPORTED;
+
+	int ret = png_pipeline_consume(decoder, &pipe, lines + ring_size, out);
+
+	__atomic_store_n(&pipe.stop, 1, __ATOMIC_RELAXED);
+	pthread_join(producer, NULL);
+
+	return ret;
+}
+
+#endif
+
+// deinterlace into dst, or into a buffer for the rows of the window that is
+// handed to the row callback or cropped into dst once the last pass is in
+static int png_decode_interlaced(struct png_decoder *decoder, struct png_workspace *ws, struct png_idat_stream *idat, const struct png_output *out) {
+	const struct png_info *info = &decoder->info;
+	size_t lines_size = info->row_size * 2 + (out->conv ? out->image_row_size : 0);
+	size_t rows = out->scaler ? out->scaler->height : out->window.height;
+	size_t image_row_size = out->scaler ? out->scaler->row_size : out->image_row_size;
+	uint8_t *image = out->cropped ? NULL : out->dst;
+	size_t stride = out->stride;
+	int buffered = !image;
+
+	if (buffered) {
+		if (rows > (SIZE_MAX - lines_size) / image_row_size)
+			return PNG_ERR_NOMEM;
+
+		lines_size += image_row_size * rows;
+		stride = image_row_size;
+	}
+
+	uint8_t *lines = png_workspace_lines(ws, lines_size);
+	if (!lines)
+		return PNG_ERR_NOMEM;
+
+	if (buffered) {
+		image = lines + lines_size - image_row_size * rows;
+
+		// passes only fill in whole pixels, keep the padding bits of
+		// sub-byte rows defined
+		if (!out->conv && png_pixel_bits(info) < 8)
+			memset(image, 0, image_row_size * rows);
+	}
+
+	int ret = png_unfilter_interlaced(decoder, idat, lines, image, stride, out);
+	if (ret || !buffered)
+		return ret;
+
+	for (size_t y = 0; y < rows; y++) {
+		uint8_t *row = image + y * stride + out->out_offset;
+
+		if (out->dst)
+			memcpy(out->dst + y * out->stride, row, out->row_size);
+		else if (out->rows(out->ctx, out->window.y + y, row))
+			return PNG_ERR_CALLBACK;
+	}
+
+	return PNG_OK;
+}
+
+#if PNG_INFLATE_STREAMING
+
+// decode a window from the checkpoint above it, one row at a time
+static int png_decode_resumed(struct png_decoder *decoder, struct png_workspace *ws, const struct png_output *out, const struct png_checkpoint *cp) {
+	const struct png_info *info = &decoder->info;
+
+	struct png_idat_stream idat;
+	int ret = png_idat_resume(&idat, &decoder->index, ws, decoder->check_crc, cp);
+	if (ret)
+		return ret;
+
+	uint8_t *lines = png_workspace_lines(ws, info->row_size * 2 + out->line_size);
+	if (!lines)
+		return PNG_ERR_NOMEM;
+
+	ret = png_unfilter_image(decoder, &idat, lines, out, cp);
+	png_stats_idat(decoder->stats, &idat, &decoder->index);
+	return ret;
+}
+
+#endif
+
+static int png_decode_image(struct png_decoder *decoder, struct png_workspace *ws, const struct png_output *out) {
+	const struct png_info *info = &decoder->info;
+
+	struct png_inflated inflated = {NULL, 0, 0};
+	int parallel = 0;
+	int ret;
+
+	uint64_t lap = png_stats_clock(decoder->stats);
+
+#if PNG_INFLATE_STREAMING
+	// a window further down skips everything above the checkpoint before it
+	if (decoder->checkpoints && !info->interlace) {
+		const struct png_checkpoint *cp = png_checkpoints_find(decoder->checkpoints, out->window.y);
+		if (cp)
+			return png_decode_resumed(decoder, ws, out, cp);
+	}
+
+	// with more threads, try inflating the whole image data up front in
+	// independent pieces, unless a window ends early and inflating can stop
+	// there, or a downscaled Adam7 image can stop after the early passes;
+	// anything that doesn't split goes the serial way
+	if (decoder->threads > 1 && out->window.y + out->window.height == info->height && !(info->interlace && out->scaler))
+		parallel = png_inflate_parallel(&decoder->index, info->data_size, decoder->threads, decoder->check_crc, &inflated) == PNG_OK;
+#else
+	// libdeflate has no streaming api, the whole image data goes in one call
+	if ((ret = png_inflate_whole(&ws->inflater, &ws->arena, &decoder->index, info->data_size, decoder->check_crc, decoder->check_adler, &inflated)))
+		return ret;
+
+	parallel = 1;
+#endif
+
+	PNG_STATS_LAP(decoder->stats, inflate_ns, lap);
+
+	struct png_idat_stream idat;
+	ret = png_idat_open(&idat, &decoder->index, ws, decoder->check_crc, decoder->check_adler, parallel ? &inflated : NULL);
+
+	if (ret)
+		goto end;
+
+	if (info->interlace) {
+		ret = png_decode_interlaced(decoder, ws, &idat, out);
+		goto end;
+	}
+
+	ret = PNG_ERR_UNSUPPORTED;
+
+#if PNG_INFLATE_STREAMING
+	// otherwise overlap the two stages, inflating on a thread of its own
+	if (decoder->threads > 1 && !parallel)
+		ret = png_unfilter_pipelined(decoder, ws, &idat, out);
+#endif
+
+	if (ret == PNG_ERR_UNSUPPORTED) {
+		uint8_t *lines = NULL;
+
+		// two scratch lines, and a third one for converted rows
+		if (!png_output_in_place(out) || out->window.y) {
+			lines = png_workspace_lines(ws, info->row_size * 2 + (out->dst && !out->skip ? 0 : out->line_size));
+			if (!lines) {
+				ret = PNG_ERR_NOMEM;
+				goto end;
+			}
+		}
+
+		ret = png_unfilter_image(decoder, &idat, lines, out, NULL);
+	}
+
+	// a plain image is its own single pass
+	if (!ret && out->passes) {
+		struct png_pass pass;
+		png_get_pass(info, 0, &pass);
+
+		if (out->passes(out->ctx, &pass))
+			ret = PNG_ERR_CALLBACK;
+	}
+
+end:
+	png_stats_idat(decoder->stats, &idat, &decoder->index);
+	png_inflated_free(&inflated);
+	return ret;
+}
+
+// set up the row conversion for the decoder's format and the window, the
+// whole image without a region, and run a decode with the decoder's
+// workspace, or a temporary one without it
+static int png_decode_with_workspace(struct png_decoder *decoder, const struct png_region *region, struct png_output *out) {
+	const struct png_info *info = &decoder->info;
+	struct png_converter conv;
+
+	out->conv = NULL;
+	out->window = region ? *region : (struct png_region){0, 0, info->width, info->height};
+	out->cropped = out->window.width != info->width;
+	out->row_size = png_format_row_size(info, decoder->format, out->window.width);
+	out->image_row_size = png_decoder_row_size(decoder);
+
+	if (png_converter_needed(info, decoder->format)) {
+		png_converter_init(&conv, info, &decoder->palette, decoder->format, decoder->round16);
+		out->conv = &conv;
+	}
+
+	size_t pixel_bits = png_pixel_bits(info);
+	size_t out_bits = out->conv ? out->conv->pixel_size * 8 : pixel_bits;
+	uint32_t x = out->window.x;
+
+	// converters start at whole bytes, sub-byte rows are converted from the
+	// byte that holds the first pixel
+	out->skip = pixel_bits < 8 ? x % (8 / pixel_bits) : 0;
+	out->in_offset = (uint64_t)(x - out->skip) * pixel_bits / 8;
+	out->out_offset = (uint64_t)x * out_bits / 8;
+	out->line_size = out->row_size + (out->conv ? out->skip * out->conv->pixel_size : 0);
+
+	struct png_workspace temporary;
+	struct png_workspace *ws = decoder->workspace;
+
+	if (!ws) {
+		png_workspace_init(&temporary);
+		ws = &temporary;
+	}
+
+	struct png_stats_start start;
+	png_stats_begin(decoder, ws, &start);
+
+	int ret = out->scaler ? png_scaler_alloc(out->scaler, &ws->arena) : PNG_OK;
+	if (!ret)
+		ret = png_decode_image(decoder, ws, out);
+
+	png_stats_end(decoder, ws, &start);
+	png_workspace_reset(ws);
+
+	if (ws == &temporary)
+		png_workspace_fini(&temporary);
+
+	return ret;
+}
+
+int png_decoder_decode_rows(struct png_decoder *decoder, png_row_callback callback, void *ctx) {
+	if (!callback)
+		return PNG_ERR_ARGUMENT;
+
+	struct png_output out = {.rows = callback, .ctx = ctx};
+	return png_decode_with_workspace(decoder, NULL, &out);
+}
+
+int png_decoder_decode_into(struct png_decoder *decoder, void *buf, size_t stride) {
+	if (!buf || stride < png_decoder_row_size(decoder))
+		return PNG_ERR_ARGUMENT;
+
+	struct png_output out = {.dst = buf, .stride = stride};
+	return png_decode_with_workspace(decoder, NULL, &out);
+}
+
+int png_decoder_decode_progressive(struct png_decoder *decoder, void *buf, size_t stride, png_pass_callback callback, void *ctx) {
+	if (!buf || !callback || stride < png_decoder_row_size(decoder))
+		return PNG_ERR_ARGUMENT;
+
+	struct png_output out = {.dst = buf, .stride = stride, .passes = callback, .ctx = ctx};
+	return png_decode_with_workspace(decoder, NULL, &out);
+}
+
+// a region has to be inside the image, and native sub-byte rows can only be
+// cut at whole bytes
+static int png_region_check(const struct png_decoder *decoder, const struct png_region *region) {
+	const struct png_info *info = &decoder->info;
+
+	if (!region || !region->width || !region->height)
+		return PNG_ERR_ARGUMENT;
+
+	if ((uint64_t)region->x + region->width > info->width || (uint64_t)region->y + region->height > info->height)
+		return PNG_ERR_ARGUMENT;
+
+	size_t pixel_bits = png_pixel_bits(info);
+	if (!png_converter_needed(info, decoder->format) && (uint64_t)region->x * pixel_bits % 8)
+		return PNG_ERR_ARGUMENT;
+
+	return PNG_OK;
+}
+
+int png_decoder_decode_region(struct png_decoder *decoder, const struct png_region *region, void *buf, size_t stride) {
+	int ret = png_region_check(decoder, region);
+	if (ret)
+		return ret;
+
+	if (!buf || stride < png_decoder_region_row_size(decoder, region))
+		return PNG_ERR_ARGUMENT;
+
+	struct png_output out = {.dst = buf, .stride = stride};
+	return png_decode_with_workspace(decoder, region, &out);
+}
+
+int png_decoder_decode_region_rows(struct png_decoder *decoder, const struct png_region *region, png_row_callback callback, void *ctx) {
+	int ret = png_region_check(decoder, region);
+	if (ret)
+		return ret;
+
+	if (!callback)
+		return PNG_ERR_ARGUMENT;
+
+	struct png_output out = {.rows = callback, .ctx = ctx};
+	return png_decode_with_workspace(decoder, region, &out);
+}
+
+// log2 of scale, -1 for any other than 1, 2, 4 or 8
+static int png_scale_shift(unsigned int scale) {
+	for (int shift = 0; shift <= PNG_SCALE_MAX_SHIFT; shift++)
+		if (scale == 1u << shift)
+			return shift;
+
+	return -1;
+}
+
+// bytes per pixel of a format that can be averaged a sample at a time, 0
+// for sub-byte, 16-bit and palette index samples
+static size_t png_scale_pixel_size(const struct png_decoder *decoder) {
+	const struct png_info *info = &decoder->info;
+
+	switch (decoder->format) {
+		case PNG_FORMAT_NATIVE:
+			if (info->bit_depth != 8)
+				return 0;
+			break;
+		case PNG_FORMAT_NATIVE8:
+			if (info->bit_depth < 8)
+				return 0;
+			break;
+		default:
+			break;
+	}
+
+	if ((decoder->format == PNG_FORMAT_NATIVE || decoder->format == PNG_FORMAT_NATIVE8) && info->color_type == PNG_COLOR_PALETTE)
+		return 0;
+
+	return png_format_row_size(info, decoder->format, 1);
+}
+
+int png_decoder_scaled_size(const struct png_decoder *decoder, unsigned int scale, uint32_t *width, uint32_t *height) {
+	int shift = png_scale_shift(scale);
+	if (shift < 0)
+		return PNG_ERR_ARGUMENT;
+
+	*width = (uint32_t)(((uint64_t)decoder->info.width + scale - 1) >> shift);
+	*height = (uint32_t)(((uint64_t)decoder->info.height + scale - 1) >> shift);
+	return PNG_OK;
+}
+
+size_t png_decoder_scaled_row_size(const struct png_decoder *decoder, unsigned int scale) {
+	uint32_t width, height;
+
+	if (png_decoder_scaled_size(decoder, scale, &width, &height))
+		return 0;
+
+	return (size_t)width * png_scale_pixel_size(decoder);
+}
+
+static int png_decode_scaled(struct png_decoder *decoder, unsigned int scale, uint8_t *dst, size_t stride, png_row_callback rows, void *ctx) {
+	const struct png_info *info = &decoder->info;
+	int shift = png_scale_shift(scale);
+	size_t pixel_size = png_scale_pixel_size(decoder);
+
+	if (shift < 0)
+		return PNG_ERR_ARGUMENT;
+
+	if (!pixel_size)
+		return PNG_ERR_UNSUPPORTED;
+
+	struct png_scaler scaler;
+	png_scaler_init(&scaler, info->width, info->height, pixel_size, shift);
+
+	if (dst && stride < scaler.row_size)
+		return PNG_ERR_ARGUMENT;
+
+	// a scale of 1 is a plain decode
+	if (!shift) {
+		struct png_output out = {.dst = dst, .stride = stride, .rows = rows, .ctx = ctx};
+		return png_decode_with_workspace(decoder, NULL, &out);
+	}
+
+	scaler.dst = dst;
+	scaler.stride = stride;
+	scaler.rows = rows;
+	scaler.ctx = ctx;
+
+	struct png_output out = {
+		.rows = info->interlace ? png_scaler_emit : png_scaler_row,
+		.ctx = &scaler,
+		.scaler = &scaler,
+	};
+
+	return png_decode_with_workspace(decoder, NULL, &out);
+}
+
+int png_decoder_decode_scaled(struct png_decoder *decoder, unsigned int scale, void *buf, size_t stride) {
+	if (!buf)
+		return PNG_ERR_ARGUMENT;
+
+	return png_decode_scaled(decoder, scale, buf, stride, NULL, NULL);
+}
+
+int png_decoder_decode_scaled_rows(struct png_decoder *decoder, unsigned int scale, png_row_callback callback, void *ctx) {
+	if (!callback)
+		return PNG_ERR_ARGUMENT;
+
+	return png_decode_scaled(decoder, scale, NULL, 0, callback, ctx);
+}
@@ -0,0 +1,404 @@
+#ifndef PNG_DECODER_H
+#define PNG_DECODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum png_status {
+	PNG_OK = 0,
+	PNG_ERR_IO,          // opening or mapping the file failed, errno is left as is
+	PNG_ERR_NOMEM,
+	PNG_ERR_SIGNATURE,   // not a png file
+	PNG_ERR_HEADER,      // missing or malformed IHDR
+	PNG_ERR_UNSUPPORTED, // valid png, but a format this decoder can't handle yet
+	PNG_ERR_TRUNCATED,   // the file ends before the image data does
+	PNG_ERR_CORRUPT,     // broken chunks, compressed data or filter types
+	PNG_ERR_CALLBACK,    // a row callback asked to stop
+	PNG_ERR_ARGUMENT,    // invalid arguments, e.g. a stride smaller than a row
+	PNG_ERR_CRC,         // a chunk doesn't match its crc
+};
+
+const char *png_status_string(int status);
+
+enum png_color_type {
+	PNG_COLOR_GRAY = 0,
+	PNG_COLOR_RGB = 2,
+	PNG_COLOR_PALETTE = 3,
+	PNG_COLOR_GRAY_ALPHA = 4,
+	PNG_COLOR_RGBA = 6,
+};
+
+struct png_info {
+	uint32_t width;
+	uint32_t height;
+	uint8_t bit_depth;
+	uint8_t color_type;
+	uint8_t compression;
+	uint8_t filter;
+	uint8_t interlace;
+
+	size_t pixel_size; // bytes per pixel as stored in the file, at least 1
+	size_t row_size;   // bytes per unfiltered row as stored in the file
+	size_t data_size;  // bytes of inflated image data, filter type bytes included
+};
+
+// one reduced image of an Adam7 interlaced file, it holds the pixels at
+// (x + i * dx, y + j * dy); non-interlaced images come as a single pass
+struct png_pass {
+	unsigned int index;
+	uint32_t x, y;
+	uint32_t dx, dy;
+	uint32_t width, height;
+};
+
+#define PNG_ADAM7_PASSES 7
+
+// a rectangle of pixels, for decoding only part of an image
+struct png_region {
+	uint32_t x, y;
+	uint32_t width, height;
+};
+
+// what decoded rows look like; native keeps the samples exactly as stored
+// in the file, native8 does too but cuts 16-bit samples down to 8 bits, the
+// others expand palettes, gray levels and tRNS into 8-bit rgb(a). bgra8
+// swaps red and blue, the premultiplied formats scale colour by alpha,
+// rounded to nearest
+enum png_format {
+	PNG_FORMAT_NATIVE,
+	PNG_FORMAT_RGB8,
+	PNG_FORMAT_RGBA8,
+	PNG_FORMAT_NATIVE8,
+	PNG_FORMAT_BGRA8,
+	PNG_FORMAT_RGBA8_PREMULTIPLIED,
+	PNG_FORMAT_BGRA8_PREMULTIPLIED,
+};
+
+// whether a chunk's crc has been verified yet; it is when the chunk is
+// read while opening or decoding, or asked for with png_decoder_check_chunk
+enum png_crc_state {
+	PNG_CRC_UNCHECKED,
+	PNG_CRC_OK,
+	PNG_CRC_BAD,
+};
+
+struct png_chunk_info {
+	char type[4];
+	uint32_t size; // payload bytes
+	size_t offset; // of the payload from the start of the file
+	enum png_crc_state crc;
+};
+
+// a tEXt, zTXt or iTXt chunk; the strings point into the mapping, or into a
+// buffer the decoder keeps when the text was compressed, and stay valid until
+// the decoder is closed
+struct png_text {
+	const char *keyword;    // nul terminated latin-1
+	const char *language;   // nul terminated, iTXt only and empty otherwise
+	const char *translated; // the keyword in that language in utf-8, iTXt only
+	const char *text;       // latin-1, or utf-8 for iTXt; not nul terminated
+	size_t text_size;
+	int compressed;
+};
+
+// the iCCP profile, all NULL when there is none
+struct png_icc {
+	const char *name;
+	const void *profile;
+	size_t size;
+};
+
+struct png_decode_stats {
+	size_t filter_rows[5]; // rows per filter type, none/sub/up/average/paeth
+
+	size_t bytes_mapped;       // the whole file
+	size_t idat_chunks;        // IDAT chunks fed to inflate
+	size_t compressed_bytes;   // of their payloads inflate consumed
+	size_t decompressed_bytes; // filter type bytes included
+	size_t allocations;        // heap allocations by the decoder and zlib
+	long minor_faults;         // page faults of the whole process meanwhile
+	long major_faults;
+
+	// wall clock time of the decode, and of its stages on the decoding
+	// thread; with threads, inflate is the time spent waiting for it
+	uint64_t total_ns;
+	uint64_t inflate_ns;
+	uint64_t unfilter_ns;
+	uint64_t output_ns; // converting rows and handing them out
+};
+
+struct png_decoder;
+struct png_workspace;
+
+// read only the signature and IHDR with a single pread, without mapping the
+// file; works for every valid png, including ones the decoder can't decode
+int png_read_info(const char *filename, struct png_info *out);
+
+// called once for every decoded row, a non-zero return stops decoding
+typedef int (*png_row_callback)(void *ctx, size_t y, const uint8_t *row);
+
+// maps the file and parses IHDR, PLTE and tRNS, the decoder keeps the mapping
+// until closed
+int png_decoder_open(struct png_decoder **out, const char *filename);
+
+// how a file gets into memory
+enum png_map_mode {
+	PNG_MAP_AUTO,     // read small files, map the rest like PNG_MAP_ADVISE
+	PNG_MAP_PLAIN,    // map, pages fault in as the decoder gets to them
+	PNG_MAP_ADVISE,   // map and ask for sequential readahead of all of it
+	PNG_MAP_POPULATE, // map and fault every page in before returning, where
+	                  // the system can, like PNG_MAP_ADVISE elsewhere
+	PNG_MAP_READ,     // read the whole file into a buffer
+};
+
+// png_decoder_open with a choice of how, it uses PNG_MAP_AUTO
+int png_decoder_open_with(struct png_decoder **out, const char *filename, enum png_map_mode mode);
+
+// the same for an open file: regular files are mapped from their start, pipes
+// and sockets are read up to their end from where they are. the decoder
+// doesn't close fd and doesn't need it once this returns
+int png_decoder_open_fd(struct png_decoder **out, int fd);
+
+// decode straight from memory, which has to stay valid and unchanged until the
+// decoder is closed
+int png_decoder_open_memory(struct png_decoder **out, const void *data, size_t size);
+void png_decoder_close(struct png_decoder *decoder);
+
+void png_decoder_get_info(const struct png_decoder *decoder, struct png_info *out);
+
+// a workspace holds the inflate state and scanline buffers and can be reused
+// across any number of decodes, but only by one decoder at a time. all of a
+// decode's memory, zlib's included, comes from an arena in it that is reset
+// when the decode returns, so once it has seen an image decoding another one
+// of about the same size makes no heap allocations; inflating on several
+// threads still needs buffers of its own
+int png_workspace_create(struct png_workspace **out);
+void png_workspace_destroy(struct png_workspace *ws);
+
+// give the memory kept for the next decode back, e.g. after an unusually
+// large image
+void png_workspace_release(struct png_workspace *ws);
+
+// decode using ws instead of setting up and tearing down fresh buffers and
+// inflate state every time, pass NULL to go back to that
+void png_decoder_set_workspace(struct png_decoder *decoder, struct png_workspace *ws);
+
+// inflate on up to threads cores when the image data was compressed in
+// independent pieces (full flushes at IDAT boundaries), this needs memory
+// for the whole inflated image; other large images are inflated on a second
+// thread while the calling one unfilters
+void png_decoder_set_threads(struct png_decoder *decoder, unsigned int threads);
+
+// check the crc of every IDAT chunk while it is fed to inflate, on by
+// default; header, PLTE and tRNS crcs are always checked when opening
+void png_decoder_set_crc_check(struct png_decoder *decoder, int enabled);
+
+// check the adler-32 at the end of the image data, on by default; the chunk
+// crcs already catch damaged files, turning this off saves hashing every
+// inflated byte
+void png_decoder_set_adler_check(struct png_decoder *decoder, int enabled);
+
+// pick the layout of decoded rows, PNG_FORMAT_NATIVE by default
+int png_decoder_set_format(struct png_decoder *decoder, enum png_format format);
+
+// 16-bit samples become 8-bit ones by keeping the high byte, or with round
+// set by dividing by 257 rounded to nearest; off by default
+void png_decoder_set_rounding(struct png_decoder *decoder, int round);
+
+// bytes per decoded row in the chosen format, and the smallest valid stride
+size_t png_decoder_row_size(const struct png_decoder *decoder);
+
+// non-zero when the image has an alpha channel or transparency from tRNS
+int png_decoder_has_alpha(const struct png_decoder *decoder);
+
+// the chunks of the file from IHDR up to IEND, indexed in one pass when the
+// decoder is opened; a truncated file ends with the last complete chunk
+size_t png_decoder_chunk_count(const struct png_decoder *decoder);
+
+// fails with PNG_ERR_ARGUMENT when index is past the last chunk
+int png_decoder_chunk_info(const struct png_decoder *decoder, size_t index, struct png_chunk_info *out);
+
+// the payload of a chunk inside the mapping, NULL when index is out of range
+const void *png_decoder_chunk_data(const struct png_decoder *decoder, size_t index);
+
+// the index of the first chunk of type at or after start, or the number of
+// chunks when there is none
+size_t png_decoder_find_chunk(const struct png_decoder *decoder, const char type[4], size_t start);
+
+// verify the crc of a chunk if that hasn't happened yet, PNG_ERR_CRC when it
+// doesn't match
+int png_decoder_check_chunk(struct png_decoder *decoder, size_t index);
+
+// metadata is read from the chunk index alone and never touches the image
+// data; compressed text and the ICC profile are inflated on first access.
+// with crc checks on, a damaged chunk fails with PNG_ERR_CRC
+size_t png_decoder_text_count(const struct png_decoder *decoder);
+
+// the n-th text chunk in file order, PNG_ERR_ARGUMENT when there are fewer
+int png_decoder_get_text(struct png_decoder *decoder, size_t n, struct png_text *out);
+
+int png_decoder_get_icc(struct png_decoder *decoder, struct png_icc *out);
+
+// the eXIf payload as it is in the file, NULL when there is none
+int png_decoder_get_exif(struct png_decoder *decoder, const void **data, size_t *size);
+
+// collect statistics while decoding into stats, pass NULL to stop again;
+// every decode starts them over. a library built without stats leaves all
+// of them zero
+void png_decoder_collect_stats(struct png_decoder *decoder, struct png_decode_stats *stats);
+
+// called when all pixels of a pass are in place, passes left empty in small
+// images are skipped; a non-zero return stops decoding
+typedef int (*png_pass_callback)(void *ctx, const struct png_pass *pass);
+
+// decode row by row, each row is only valid for the duration of the callback;
+// interlaced images are deinterlaced into a buffer in the workspace first
+int png_decoder_decode_rows(struct png_decoder *decoder, png_row_callback callback, void *ctx);
+
+// decode the whole image into a caller provided buffer, rows are stride
+// bytes apart and each one holds png_decoder_row_size() bytes
+int png_decoder_decode_into(struct png_decoder *decoder, void *buf, size_t stride);
+
+// decode only the pixels in region: rows above it are inflated and
+// unfiltered but never converted or written, and decoding stops after its
+// last row without inflating the rest. row 0 of buf is row region->y of the
+// image, each row holds png_decoder_region_row_size() bytes. interlaced
+// images are still inflated completely; native sub-byte rows can only be
+// cut where a byte starts
+int png_decoder_decode_region(struct png_decoder *decoder, const struct png_region *region, void *buf, size_t stride);
+
+// the same row by row, y is counted from the top of the image
+int png_decoder_decode_region_rows(struct png_decoder *decoder, const struct png_region *region, png_row_callback callback, void *ctx);
+
+// bytes per decoded row of region in the chosen format
+size_t png_decoder_region_row_size(const struct png_decoder *decoder, const struct png_region *region);
+
+// a thumbnail decode: every scale x scale box of pixels is averaged into one
+// as the rows come, boxes cut off by the right and bottom edges over the
+// pixels they have, so only a row's worth of sums is kept. scale is 1, 2, 4
+// or 8, and the format needs a byte per sample: RGB8, RGBA8, BGRA8, their
+// premultiplied forms (which average without dark fringes on edges), and
+// NATIVE8 or 8-bit NATIVE for anything but palette images; anything else is
+// PNG_ERR_UNSUPPORTED. interlaced images are point sampled instead, from
+// the passes that land on the reduced grid, and the rest of the image data
+// is never inflated: 5 passes at 1/2, 3 at 1/4, 1 at 1/8
+int png_decoder_decode_scaled(struct png_decoder *decoder, unsigned int scale, void *buf, size_t stride);
+
+// the same row by row, y is counted in reduced rows
+int png_decoder_decode_scaled_rows(struct png_decoder *decoder, unsigned int scale, png_row_callback callback, void *ctx);
+
+// the size of the reduced image, rounded up
+int png_decoder_scaled_size(const struct png_decoder *decoder, unsigned int scale, uint32_t *width, uint32_t *height);
+
+// bytes per reduced row in the chosen format, 0 if it can't be scaled
+size_t png_decoder_scaled_row_size(const struct png_decoder *decoder, unsigned int scale);
+
+// a sidecar index for decoding regions far down large images: every so many
+// rows it records where inflate can start over, with its window and the row
+// above, the way zlib's zran example does. with it, a region decode starts
+// at the nearest checkpoint above the region instead of the first IDAT.
+// only for non-interlaced images and the zlib backends
+struct png_checkpoints;
+
+// inflate and unfilter the whole image once, leaving a checkpoint at the
+// first deflate block boundary after every rows rows; each one takes up to
+// 32 KiB and about two rows
+int png_decoder_build_checkpoints(struct png_decoder *decoder, uint32_t rows, struct png_checkpoints **out);
+
+// use cp for region decodes until it's replaced or NULL is passed, the
+// decoder doesn't copy it; PNG_ERR_ARGUMENT when it was built for another file
+int png_decoder_set_checkpoints(struct png_decoder *decoder, const struct png_checkpoints *cp);
+
+int png_checkpoints_save(const struct png_checkpoints *cp, const char *filename);
+int png_checkpoints_load(struct png_checkpoints **out, const char *filename);
+void png_checkpoints_free(struct png_checkpoints *cp);
+
+// like png_decoder_decode_into, but call back after every pass so the
+// pixels decoded so far can be shown as a preview; pixels of later passes
+// are left untouched in buf until their pass is decoded
+int png_decoder_decode_progressive(struct png_decoder *decoder, void *buf, size_t stride, png_pass_callback callback, void *ctx);
+
+// a decoder for data that arrives a piece at a time, e.g. from a socket,
+// with no file to map; it keeps no more than a couple of rows of input
+// around, except for interlaced images which are put together in memory and
+// handed out row by row once the last pass is in
+struct png_push_decoder;
+
+// called once the header is in, before any memory is taken for the image;
+// a non-zero return stops decoding, e.g. for images too large to accept
+typedef int (*png_info_callback)(void *ctx, const struct png_info *info);
+
+// rows are handed to rows in format as soon as they are inflated; info may
+// be NULL. PLTE and tRNS are only looked at before the first IDAT and
+// metadata chunks aren't kept at all
+int png_push_decoder_create(struct png_push_decoder **out, enum png_format format, png_info_callback info, png_row_callback rows, void *ctx);
+void png_push_decoder_destroy(struct png_push_decoder *push);
+
+// verify the crc of every chunk, on unless disabled
+void png_push_decoder_set_crc_check(struct png_push_decoder *push, int enabled);
+
+// the next size bytes of the file, split anywhere. the callbacks run from
+// inside this call, and the first error is returned by every later one
+int png_push_decoder_feed(struct png_push_decoder *push, const void *data, size_t size);
+
+// the end of input, PNG_ERR_TRUNCATED unless every row was handed out;
+// anything fed after IEND is ignored
+int png_push_decoder_finish(struct png_push_decoder *push);
+
+// PNG_ERR_TRUNCATED until the header is in
+int png_push_decoder_get_info(const struct png_push_decoder *push, struct png_info *out);
+
+// bytes per row handed out, 0 until the header is in
+size_t png_push_decoder_row_size(const struct png_push_decoder *push);
+
+// an in-process cache of decoded images for services that see the same
+// files over and over. images are looked up by a hash of IHDR, PLTE, tRNS,
+// the stored crcs of the IDAT chunks and the output format, all from the
+// chunk index, so a hit neither inflates nor unfilters anything. the key
+// trusts the crcs: files from untrusted sources can be made to collide
+// with one another. several threads can decode through one cache
+struct png_cache;
+
+// a decoded image, shared and read-only; rows are packed, row_size bytes
+// apart, and the data is 64-byte aligned
+struct png_image {
+	struct png_info info;
+	enum png_format format;
+	size_t row_size;
+	const uint8_t *data;
+};
+
+struct png_cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t images; // in the cache right now
+	size_t size;   // bytes they take up
+};
+
+// keep up to budget bytes of images, the least recently used are dropped
+// to make room; those still held by callers are freed once released
+int png_cache_create(struct png_cache **out, size_t budget);
+
+// drop every image; images still held stay valid until they're released
+void png_cache_destroy(struct png_cache *cache);
+void png_cache_clear(struct png_cache *cache);
+
+void png_cache_get_stats(struct png_cache *cache, struct png_cache_stats *out);
+
+// the image in the decoder's format, from the cache or decoded and added to
+// it; every image handed out has to be released once. images bigger than
+// the whole budget are decoded without being kept
+int png_decoder_decode_cached(struct png_decoder *decoder, struct png_cache *cache, const struct png_image **out);
+
+void png_image_release(const struct png_image *image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
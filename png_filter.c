@@ -0,0 +1,583 @@
+#include <string.h>
+
+#include "png_filter.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define PNG_FILTER_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PNG_FILTER_NEON 1
+#include <arm_neon.h>
+#endif
+
+static inline __attribute__((always_inline)) uint8_t png_sub_filter(uint8_t *line, size_t pixel_size, size_t x, size_t i) {
+	if (x == 0)
+		return line[pixel_size * x + i];
+
+	return line[pixel_size * x + i] + line[pixel_size * (x - 1) + i];
+}
+
+static inline __attribute__((always_inline)) uint8_t png_up_filter(uint8_t *line, const uint8_t *prev_line, size_t pixel_size, size_t x, size_t i) {
+	if (!prev_line)
+		return line[pixel_size * x + i];
+
+	return line[pixel_size * x + i] + prev_line[pixel_size * x + i];
+}
+
+
+static inline __attribute__((always_inline)) uint8_t png_avg_filter(uint8_t *line, const uint8_t *prev_line, size_t pixel_size, size_t x, size_t i) {
+	uint8_t left = 0;
+	uint8_t top = 0;
+
+	if (x)
+		left = line[pixel_size * (x - 1) + i];
+
+	if (prev_line)
+		top = prev_line[pixel_size * x + i];
+
+	return ((left + top) / 2) + line[pixel_size * x + i];
+}
+
+static inline __attribute__((always_inline)) int png_abs(int x) {
+	if (x < 0)
+		return -x;
+
+	return x;
+}
+
+static inline __attribute__((always_inline)) uint8_t png_paeth_filter(uint8_t *line, const uint8_t *prev_line, size_t pixel_size, size_t x, size_t i) {
+	// using int as calculations "must be performed exactly, without overflow"
+	int a = 0, b = 0, c = 0, d, p;
+	int pa, pb, pc;
+
+	d = line[pixel_size * x + i];
+
+	if (x)
+		a = line[pixel_size * (x - 1) + i];
+
+	if (prev_line)
+		b = prev_line[pixel_size * x + i];
+
+	if (prev_line && x)
+		c = prev_line[pixel_size * (x - 1) + i];
+
+	p = a + b - c;
+
+	pa = png_abs(p - a);
+	pb = png_abs(p - b);
+	pc = png_abs(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return d + a;
+	if (pb <= pc)
+		return d + b;
+
+	return d + c;
+}
+
+// reference kernels, these work for any pixel size and for the first row
+
+#define PNG_REF_KERNEL(name, expr) \
+	static void png_unfilter_##name##_ref(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size) { \
+		(void)prev_line; \
+		for (size_t x = 0; x < size / pixel_size; x++) \
+			for (size_t i = 0; i < pixel_size; i++) \
+				line[x * pixel_size + i] = (expr); \
+	}
+
+PNG_REF_KERNEL(sub, png_sub_filter(line, pixel_size, x, i))
+PNG_REF_KERNEL(up, png_up_filter(line, prev_line, pixel_size, x, i))
+PNG_REF_KERNEL(avg, png_avg_filter(line, prev_line, pixel_size, x, i))
+PNG_REF_KERNEL(paeth, png_paeth_filter(line, prev_line, pixel_size, x, i))
+
+// specialized kernels, one per filter type and pixel size, with the first
+// pixel peeled off and the first row handled by separate functions so the
+// loops are free of edge checks
+
+static void png_unfilter_none(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size) {
+	(void)line;
+	(void)prev_line;
+	(void)size;
+	(void)pixel_size;
+}
+
+static void png_unfilter_up(uint8_t *restrict line, const uint8_t *restrict prev_line, size_t size, size_t pixel_size) {
+	(void)pixel_size;
+
+	for (size_t x = 0; x < size; x++)
+		line[x] += prev_line[x];
+}
+
+static inline __attribute__((always_inline)) uint8_t png_paeth_predict(int a, int b, int c) {
+	int pa = png_abs(b - c);
+	int pb = png_abs(a - c);
+	int pc = png_abs(a + b - 2 * c);
+
+	// ties go to a, then b, then c, written so it compiles to cmovs
+	int nearest = pb < pa ? b : a;
+	int smallest = pb < pa ? pb : pa;
+
+	return pc < smallest ? c : nearest;
+}
+
+#define PNG_SCALAR_KERNELS(n) \
+	static void png_unfilter_sub##n(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size) { \
+		(void)prev_line; \
+		(void)pixel_size; \
+		for (size_t x = n; x < size; x++) \
+			line[x] += line[x - n]; \
+	} \
+	\
+	static void png_unfilter_avg##n(uint8_t *restrict line, const uint8_t *restrict prev_line, size_t size, size_t pixel_size) { \
+		(void)pixel_size; \
+		for (size_t x = 0; x < n; x++) \
+			line[x] += prev_line[x] >> 1; \
+		for (size_t x = n; x < size; x++) \
+			line[x] += (line[x - n] + prev_line[x]) >> 1; \
+	} \
+	\
+	static void png_unfilter_avg##n##_first(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size) { \
+		(void)prev_line; \
+		(void)pixel_size; \
+		for (size_t x = n; x < size; x++) \
+			line[x] += line[x - n] >> 1; \
+	} \
+	\
+	static void png_unfilter_paeth##n(uint8_t *restrict line, const uint8_t *restrict prev_line, size_t size, size_t pixel_size) { \
+		(void)pixel_size; \
+		/* with no left neighbour the predictor is always the pixel above */ \
+		for (size_t x = 0; x < n; x++) \
+			line[x] += prev_line[x]; \
+		for (size_t x = n; x < size; x++) \
+			line[x] += png_paeth_predict(line[x - n], prev_line[x], prev_line[x - n]); \
+	}
+
+PNG_SCALAR_KERNELS(1)
+PNG_SCALAR_KERNELS(2)
+PNG_SCALAR_KERNELS(3)
+PNG_SCALAR_KERNELS(4)
+PNG_SCALAR_KERNELS(6)
+PNG_SCALAR_KERNELS(8)
+
+// on the first row up is a no-op and paeth degenerates into sub
+#define PNG_SCALAR_SELECT(n) \
+	case n: \
+		out->fn[PNG_FILTER_SUB] = png_unfilter_sub##n; \
+		out->fn[PNG_FILTER_AVERAGE] = png_unfilter_avg##n; \
+		out->fn[PNG_FILTER_PAETH] = png_unfilter_paeth##n; \
+		out->first[PNG_FILTER_SUB] = png_unfilter_sub##n; \
+		out->first[PNG_FILTER_AVERAGE] = png_unfilter_avg##n##_first; \
+		out->first[PNG_FILTER_PAETH] = png_unfilter_sub##n; \
+		break;
+
+#ifdef PNG_FILTER_X86
+
+// a pixel of n bytes lives in the low bytes of an xmm register, loads and
+// stores never touch bytes past the pixel, and odd sizes are split into
+// power of two pieces so they don't go through the stack
+static inline __attribute__((always_inline)) __m128i png_load_px(const uint8_t *ptr, size_t n) {
+	uint32_t lo;
+	uint16_t hi;
+
+	switch (n) {
+		case 3:
+			memcpy(&hi, ptr, 2);
+			return _mm_cvtsi32_si128(hi | (ptr[2] << 16));
+		case 4:
+			memcpy(&lo, ptr, 4);
+			return _mm_cvtsi32_si128(lo);
+		case 6:
+			memcpy(&lo, ptr, 4);
+			memcpy(&hi, ptr + 4, 2);
+			return _mm_insert_epi16(_mm_cvtsi32_si128(lo), hi, 2);
+		default:
+			return _mm_loadl_epi64((const __m128i *)ptr);
+	}
+}
+
+static inline __attribute__((always_inline)) void png_store_px(uint8_t *ptr, __m128i px, size_t n) {
+	uint32_t lo = _mm_cvtsi128_si32(px);
+	uint16_t hi;
+
+	switch (n) {
+		case 3:
+			hi = lo;
+			memcpy(ptr, &hi, 2);
+			ptr[2] = lo >> 16;
+			break;
+		case 4:
+			memcpy(ptr, &lo, 4);
+			break;
+		case 6:
+			hi = _mm_extract_epi16(px, 2);
+			memcpy(ptr, &lo, 4);
+			memcpy(ptr + 4, &hi, 2);
+			break;
+		default:
+			_mm_storel_epi64((__m128i *)ptr, px);
+	}
+}
+
+static inline __attribute__((always_inline)) void png_sub_sse2(uint8_t *line, size_t size, size_t n) {
+	__m128i a = _mm_setzero_si128();
+
+	for (size_t x = 0; x < size; x += n) {
+		a = _mm_add_epi8(a, png_load_px(line + x, n));
+		png_store_px(line + x, a, n);
+	}
+}
+
+static void png_unfilter_up_sse2(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size) {
+	(void)pixel_size;
+	size_t x = 0;
+
+	for (; x + 16 <= size; x += 16) {
+		__m128i d = _mm_loadu_si128((const __m128i *)(line + x));
+		__m128i b = _mm_loadu_si128((const __m128i *)(prev_line + x));
+		_mm_storeu_si128((__m128i *)(line + x), _mm_add_epi8(d, b));
+	}
+
+	for (; x < size; x++)
+		line[x] += prev_line[x];
+}
+
+__attribute__((target("avx2")))
+static void png_unfilter_up_avx2(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size) {
+	(void)pixel_size;
+	size_t x = 0;
+
+	for (; x + 32 <= size; x += 32) {
+		__m256i d = _mm256_loadu_si256((const __m256i *)(line + x));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(prev_line + x));
+		_mm256_storeu_si256((__m256i *)(line + x), _mm256_add_epi8(d, b));
+	}
+
+	for (; x < size; x++)
+		line[x] += prev_line[x];
+}
+
+static inline __attribute__((always_inline)) void png_avg_sse2(uint8_t *line, const uint8_t *prev_line, size_t size, size_t n) {
+	__m128i a = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+
+	for (size_t x = 0; x < size; x += n) {
+		__m128i b = png_load_px(prev_line + x, n);
+
+		// pavgb rounds up, (a + b) / 2 has to round down
+		__m128i avg = _mm_avg_epu8(a, b);
+		avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+
+		a = _mm_add_epi8(png_load_px(line + x, n), avg);
+		png_store_px(line + x, a, n);
+	}
+}
+
+static inline __attribute__((always_inline)) __m128i png_abs16_sse2(__m128i x) {
+	return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+__attribute__((target("ssse3")))
+static inline __attribute__((always_inline)) __m128i png_abs16_ssse3(__m128i x) {
+	return _mm_abs_epi16(x);
+}
+
+static inline __attribute__((always_inline)) __m128i png_select_sse2(__m128i mask, __m128i t, __m128i e) {
+	return _mm_or_si128(_mm_and_si128(mask, t), _mm_andnot_si128(mask, e));
+}
+
+// a, b and c are widened to 16 bits, so p - a etc. can be computed exactly
+#define PNG_PAETH_X86(abs16) \
+	__m128i zero = _mm_setzero_si128(); \
+	__m128i a = zero, c = zero; \
+	\
+	for (size_t x = 0; x < size; x += n) { \
+		__m128i b = _mm_unpacklo_epi8(png_load_px(prev_line + x, n), zero); \
+		__m128i d = png_load_px(line + x, n); \
+		\
+		/* p - a = b - c, p - b = a - c, p - c = (b - c) + (a - c) */ \
+		__m128i pa = _mm_sub_epi16(b, c); \
+		__m128i pb = _mm_sub_epi16(a, c); \
+		__m128i pc = _mm_add_epi16(pa, pb); \
+		\
+		pa = abs16(pa); \
+		pb = abs16(pb); \
+		pc = abs16(pc); \
+		\
+		__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb)); \
+		\
+		/* ties go to a, then b, then c */ \
+		__m128i nearest = png_select_sse2(_mm_cmpeq_epi16(smallest, pa), a, \
+				png_select_sse2(_mm_cmpeq_epi16(smallest, pb), b, c)); \
+		\
+		d = _mm_add_epi8(d, _mm_packus_epi16(nearest, nearest)); \
+		png_store_px(line + x, d, n); \
+		\
+		c = b; \
+		a = _mm_unpacklo_epi8(d, zero); \
+	}
+
+static inline __attribute__((always_inline)) void png_paeth_sse2(uint8_t *line, const uint8_t *prev_line, size_t size, size_t n) {
+	PNG_PAETH_X86(png_abs16_sse2)
+}
+
+__attribute__((target("ssse3")))
+static inline __attribute__((always_inline)) void png_paeth_ssse3(uint8_t *line, const uint8_t *prev_line, size_t size, size_t n) {
+	PNG_PAETH_X86(png_abs16_ssse3)
+}
+
+#define PNG_X86_KERNELS(n) \
+	static void png_unfilter_sub##n##_sse2(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size) { \
+		(void)prev_line; \
+		(void)pixel_size; \
+		png_sub_sse2(line, size, n); \
+	} \
+	\
+	static void png_unfilter_avg##n##_sse2(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size) { \
+		(void)pixel_size; \
+		png_avg_sse2(line, prev_line, size, n); \
+	} \
+	\
+	static void png_unfilter_paeth##n##_sse2(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size) { \
+		(void)pixel_size; \
+		png_paeth_sse2(line, prev_line, size, n); \
+	} \
+	\
+	__attribute__((target("ssse3"))) \
+	static void png_unfilter_paeth##n##_ssse3(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size) { \
+		(void)pixel_size; \
+		png_paeth_ssse3(line, prev_line, size, n); \
+	}
+
+PNG_X86_KERNELS(3)
+PNG_X86_KERNELS(4)
+PNG_X86_KERNELS(6)
+PNG_X86_KERNELS(8)
+
+#define PNG_X86_SELECT(n) \
+	case n: \
+		out->fn[PNG_FILTER_SUB] = png_unfilter_sub##n##_sse2; \
+		out->first[PNG_FILTER_SUB] = png_unfilter_sub##n##_sse2; \
+		out->first[PNG_FILTER_PAETH] = png_unfilter_sub##n##_sse2; \
+		out->fn[PNG_FILTER_AVERAGE] = png_unfilter_avg##n##_sse2; \
+		out->fn[PNG_FILTER_PAETH] = has_ssse3 ? png_unfilter_paeth##n##_ssse3 : png_unfilter_paeth##n##_sse2; \
+		break;
+
+static void png_unfilter_select_x86(struct png_unfilter_kernels *out, size_t pixel_size) {
+	__builtin_cpu_init();
+
+	int has_ssse3 = __builtin_cpu_supports("ssse3");
+	int has_avx2 = __builtin_cpu_supports("avx2");
+
+	out->fn[PNG_FILTER_UP] = has_avx2 ? png_unfilter_up_avx2 : png_unfilter_up_sse2;
+
+	switch (pixel_size) {
+		PNG_X86_SELECT(3)
+		PNG_X86_SELECT(4)
+		PNG_X86_SELECT(6)
+		PNG_X86_SELECT(8)
+	}
+}
+
+#endif
+
+#ifdef PNG_FILTER_NEON
+
+// same as on x86, odd pixel sizes are assembled from power of two pieces
+static inline __attribute__((always_inline)) uint8x8_t png_load_px(const uint8_t *ptr, size_t n) {
+	uint64_t val;
+	uint32_t lo;
+	uint16_t hi;
+
+	switch (n) {
+		case 3:
+			memcpy(&hi, ptr, 2);
+			val = hi | ((uint32_t)ptr[2] << 16);
+			break;
+		case 4:
+			memcpy(&lo, ptr, 4);
+			val = lo;
+			break;
+		case 6:
+			memcpy(&lo, ptr, 4);
+			memcpy(&hi, ptr + 4, 2);
+			val = lo | ((uint64_t)hi << 32);
+			break;
+		default:
+			memcpy(&val, ptr, 8);
+	}
+
+	return vreinterpret_u8_u64(vcreate_u64(val));
+}
+
+static inline __attribute__((always_inline)) void png_store_px(uint8_t *ptr, uint8x8_t px, size_t n) {
+	uint64_t val = vget_lane_u64(vreinterpret_u64_u8(px), 0);
+	uint32_t lo = val;
+	uint16_t hi = val;
+
+	switch (n) {
+		case 3:
+			memcpy(ptr, &hi, 2);
+			ptr[2] = val >> 16;
+			break;
+		case 4:
+			memcpy(ptr, &lo, 4);
+			break;
+		case 6:
+			hi = val >> 32;
+			memcpy(ptr, &lo, 4);
+			memcpy(ptr + 4, &hi, 2);
+			break;
+		default:
+			memcpy(ptr, &val, 8);
+	}
+}
+
+static void png_unfilter_up_neon(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size) {
+	(void)pixel_size;
+	size_t x = 0;
+
+	for (; x + 16 <= size; x += 16)
+		vst1q_u8(line + x, vaddq_u8(vld1q_u8(line + x), vld1q_u8(prev_line + x)));
+
+	for (; x < size; x++)
+		line[x] += prev_line[x];
+}
+
+static inline __attribute__((always_inline)) void png_sub_neon(uint8_t *line, size_t size, size_t n) {
+	uint8x8_t a = vdup_n_u8(0);
+
+	for (size_t x = 0; x < size; x += n) {
+		a = vadd_u8(a, png_load_px(line + x, n));
+		png_store_px(line + x, a, n);
+	}
+}
+
+static inline __attribute__((always_inline)) void png_avg_neon(uint8_t *line, const uint8_t *prev_line, size_t size, size_t n) {
+	uint8x8_t a = vdup_n_u8(0);
+
+	for (size_t x = 0; x < size; x += n) {
+		// vhadd rounds down, just like the filter wants
+		uint8x8_t avg = vhadd_u8(a, png_load_px(prev_line + x, n));
+		a = vadd_u8(png_load_px(line + x, n), avg);
+		png_store_px(line + x, a, n);
+	}
+}
+
+static inline __attribute__((always_inline)) void png_paeth_neon(uint8_t *line, const uint8_t *prev_line, size_t size, size_t n) {
+	uint8x8_t a = vdup_n_u8(0), c = vdup_n_u8(0);
+
+	for (size_t x = 0; x < size; x += n) {
+		uint8x8_t b = png_load_px(prev_line + x, n);
+
+		// pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|, all exact in 16 bits
+		uint16x8_t pa = vabdl_u8(b, c);
+		uint16x8_t pb = vabdl_u8(a, c);
+		uint16x8_t pc = vabdq_u16(vaddl_u8(a, b), vaddl_u8(c, c));
+
+		// ties go to a, then b, then c
+		uint8x8_t use_a = vmovn_u16(vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc)));
+		uint8x8_t use_b = vmovn_u16(vcleq_u16(pb, pc));
+		uint8x8_t nearest = vbsl_u8(use_a, a, vbsl_u8(use_b, b, c));
+
+		a = vadd_u8(png_load_px(line + x, n), nearest);
+		png_store_px(line + x, a, n);
+
+		c = b;
+	}
+}
+
+#define PNG_NEON_KERNELS(n) \
+	static void png_unfilter_sub##n##_neon(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size) { \
+		(void)prev_line; \
+		(void)pixel_size; \
+		png_sub_neon(line, size, n); \
+	} \
+	\
+	static void png_unfilter_avg##n##_neon(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size) { \
+		(void)pixel_size; \
+		png_avg_neon(line, prev_line, size, n); \
+	} \
+	\
+	static void png_unfilter_paeth##n##_neon(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size) { \
+		(void)pixel_size; \
+		png_paeth_neon(line, prev_line, size, n); \
+	}
+
+PNG_NEON_KERNELS(3)
+PNG_NEON_KERNELS(4)
+PNG_NEON_KERNELS(6)
+PNG_NEON_KERNELS(8)
+
+#define PNG_NEON_SELECT(n) \
+	case n: \
+		out->fn[PNG_FILTER_SUB] = png_unfilter_sub##n##_neon; \
+		out->first[PNG_FILTER_SUB] = png_unfilter_sub##n##_neon; \
+		out->first[PNG_FILTER_PAETH] = png_unfilter_sub##n##_neon; \
+		out->fn[PNG_FILTER_AVERAGE] = png_unfilter_avg##n##_neon; \
+		out->fn[PNG_FILTER_PAETH] = png_unfilter_paeth##n##_neon; \
+		break;
+
+// neon is always there when the compiler lets us use it, no runtime check needed
+static void png_unfilter_select_neon(struct png_unfilter_kernels *out, size_t pixel_size) {
+	out->fn[PNG_FILTER_UP] = png_unfilter_up_neon;
+
+	switch (pixel_size) {
+		PNG_NEON_SELECT(3)
+		PNG_NEON_SELECT(4)
+		PNG_NEON_SELECT(6)
+		PNG_NEON_SELECT(8)
+	}
+}
+
+#endif
+
+void png_unfilter_select_reference(struct png_unfilter_kernels *out, size_t pixel_size) {
+	out->pixel_size = pixel_size;
+
+	out->fn[PNG_FILTER_NONE] = png_unfilter_none;
+	out->fn[PNG_FILTER_SUB] = png_unfilter_sub_ref;
+	out->fn[PNG_FILTER_UP] = png_unfilter_up_ref;
+	out->fn[PNG_FILTER_AVERAGE] = png_unfilter_avg_ref;
+	out->fn[PNG_FILTER_PAETH] = png_unfilter_paeth_ref;
+
+	// the reference kernels deal with a missing previous line themselves
+	memcpy(out->first, out->fn, sizeof(out->first));
+}
+
+void png_unfilter_select_scalar(struct png_unfilter_kernels *out, size_t pixel_size) {
+	png_unfilter_select_reference(out, pixel_size);
+
+	out->fn[PNG_FILTER_UP] = png_unfilter_up;
+	out->first[PNG_FILTER_UP] = png_unfilter_none;
+
+	switch (pixel_size) {
+		PNG_SCALAR_SELECT(1)
+		PNG_SCALAR_SELECT(2)
+		PNG_SCALAR_SELECT(3)
+		PNG_SCALAR_SELECT(4)
+		PNG_SCALAR_SELECT(6)
+		PNG_SCALAR_SELECT(8)
+	}
+}
+
+void png_unfilter_select(struct png_unfilter_kernels *out, size_t pixel_size) {
+	png_unfilter_select_scalar(out, pixel_size);
+
+#if defined(PNG_FILTER_X86)
+	png_unfilter_select_x86(out, pixel_size);
+#elif defined(PNG_FILTER_NEON)
+	png_unfilter_select_neon(out, pixel_size);
+#endif
+}
+
+int png_unfilter_row(const struct png_unfilter_kernels *kernels, uint8_t filter_method, uint8_t *line, const uint8_t *prev_line, size_t size) {
+	if (filter_method >= PNG_FILTER_COUNT)
+		return 1;
+
+	if (!prev_line)
+		kernels->first[filter_method](line, NULL, size, kernels->pixel_size);
+	else
+		kernels->fn[filter_method](line, prev_line, size, kernels->pixel_size);
+
+	return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef PNG_FILTER_H
+#define PNG_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum png_filter_type {
+	PNG_FILTER_NONE,
+	PNG_FILTER_SUB,
+	PNG_FILTER_UP,
+	PNG_FILTER_AVERAGE,
+	PNG_FILTER_PAETH,
+
+	PNG_FILTER_COUNT
+};
+
+// unfilters size bytes of line in place, prev_line is NULL for the first row
+// for the reference kernels and the first[] table only
+typedef void (*png_unfilter_fn)(uint8_t *line, const uint8_t *prev_line, size_t size, size_t pixel_size);
+
+struct png_unfilter_kernels {
+	size_t pixel_size;
+	png_unfilter_fn fn[PNG_FILTER_COUNT];
+	png_unfilter_fn first[PNG_FILTER_COUNT]; // for rows without a previous line
+};
+
+// pick the fastest row kernels the cpu supports for the given pixel size
+void png_unfilter_select(struct png_unfilter_kernels *out, size_t pixel_size);
+
+// pick the plain C kernels specialized for the given pixel size
+void png_unfilter_select_scalar(struct png_unfilter_kernels *out, size_t pixel_size);
+
+// pick the byte at a time reference kernels
+void png_unfilter_select_reference(struct png_unfilter_kernels *out, size_t pixel_size);
+
+int png_unfilter_row(const struct png_unfilter_kernels *kernels, uint8_t filter_method, uint8_t *line, const uint8_t *prev_line, size_t size);
+
+#endif
@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "png_decoder.h"
+
+// libFuzzer entry point: every way the decoder reads a file, with the
+// settings drawn from the last byte of the input so the fuzzer can steer
+// them. crcs and the adler-32 aren't checked, or hardly any mutation would
+// get past them
+
+// bigger images are only opened, decoding them is too slow to be useful
+#define FUZZ_MAX_PIXELS (1u << 20)
+
+#define FUZZ_FORMATS (PNG_FORMAT_BGRA8_PREMULTIPLIED + 1)
+
+struct fuzz_rows {
+	size_t row_size;
+	uint32_t sum; // touch every byte so reads of undefined rows show up
+};
+
+static int fuzz_row(void *ctx, size_t y, const uint8_t *row) {
+	struct fuzz_rows *rows = ctx;
+	(void)y;
+
+	for (size_t i = 0; i < rows->row_size; i++)
+		rows->sum += row[i];
+
+	return 0;
+}
+
+static int fuzz_info(void *ctx, const struct png_info *info) {
+	(void)ctx;
+	return (uint64_t)info->width * info->height > FUZZ_MAX_PIXELS;
+}
+
+static void fuzz_metadata(struct png_decoder *decoder) {
+	size_t count = png_decoder_text_count(decoder);
+	struct png_text text;
+	struct png_icc icc;
+	const void *exif;
+	size_t exif_size;
+
+	for (size_t i = 0; i < count; i++)
+		png_decoder_get_text(decoder, i, &text);
+
+	png_decoder_get_icc(decoder, &icc);
+	png_decoder_get_exif(decoder, &exif, &exif_size);
+
+	for (size_t i = 0; i < png_decoder_chunk_count(decoder); i++)
+		png_decoder_check_chunk(decoder, i);
+}
+
+static void fuzz_decode(const uint8_t *data, size_t size, uint8_t flags) {
+	struct png_decoder *decoder;
+	if (png_decoder_open_memory(&decoder, data, size))
+		return;
+
+	struct png_info info;
+	png_decoder_get_info(decoder, &info);
+
+	png_decoder_set_crc_check(decoder, 0);
+	png_decoder_set_adler_check(decoder, 0);
+	png_decoder_set_format(decoder, (enum png_format)(flags % FUZZ_FORMATS));
+	png_decoder_set_rounding(decoder, flags & 0x80);
+	png_decoder_set_threads(decoder, flags & 0x40 ? 4 : 1);
+
+	fuzz_metadata(decoder);
+
+	if ((uint64_t)info.width * info.height > FUZZ_MAX_PIXELS)
+		goto end;
+
+	size_t row_size = png_decoder_row_size(decoder);
+	uint8_t *buf = malloc(row_size * info.height);
+	struct fuzz_rows rows = {row_size, 0};
+
+	if (buf)
+		png_decoder_decode_into(decoder, buf, row_size);
+
+	png_decoder_decode_rows(decoder, fuzz_row, &rows);
+
+	// the bottom right quarter, which starts in the middle of a row
+	struct png_region region = {info.width / 2, info.height / 2, info.width - info.width / 2, info.height - info.height / 2};
+	rows.row_size = png_decoder_region_row_size(decoder, &region);
+	png_decoder_decode_region_rows(decoder, &region, fuzz_row, &rows);
+
+	unsigned int scale = 2u << (flags >> 3 & 3) % 3;
+	rows.row_size = png_decoder_scaled_row_size(decoder, scale);
+	png_decoder_decode_scaled_rows(decoder, scale, fuzz_row, &rows);
+
+	free(buf);
+end:
+	png_decoder_close(decoder);
+}
+
+// the same bytes pushed in pieces of a size taken from the flags
+static void fuzz_push(const uint8_t *data, size_t size, uint8_t flags) {
+	struct fuzz_rows rows = {0, 0};
+	struct png_push_decoder *push;
+
+	if (png_push_decoder_create(&push, (enum png_format)(flags % FUZZ_FORMATS), fuzz_info, fuzz_row, &rows))
+		return;
+
+	png_push_decoder_set_crc_check(push, 0);
+
+	size_t piece = 1 + (flags >> 3) * 61;
+
+	for (size_t at = 0; at < size; at += piece) {
+		size_t n = size - at < piece ? size - at : piece;
+
+		if (png_push_decoder_feed(push, data + at, n))
+			break;
+
+		if (!rows.row_size)
+			rows.row_size = png_push_decoder_row_size(push);
+	}
+
+	png_push_decoder_finish(push);
+	png_push_decoder_destroy(push);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	uint8_t flags = size ? data[size - 1] : 0;
+
+	fuzz_decode(data, size, flags);
+	fuzz_push(data, size, flags);
+	return 0;
+}
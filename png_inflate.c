@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "png_decoder.h"
+#include "png_internal.h"
+#include "png_arena.h"
+
+void png_inflated_free(struct png_inflated *inflated) {
+	if (inflated->arena) {
+		inflated->segments = NULL;
+		inflated->count = 0;
+		return;
+	}
+
+	for (size_t i = 0; i < inflated->count; i++)
+		free(inflated->segments[i].data);
+
+	free(inflated->segments);
+	inflated->segments = NULL;
+	inflated->count = 0;
+}
+
+// the first guess at how much a small zlib stream inflates to
+#define PNG_INFLATE_BUFFER_MIN 1024
+
+static int png_buffer_grow(uint8_t **data, size_t *capacity, size_t limit) {
+	if (*capacity >= limit)
+		return PNG_ERR_UNSUPPORTED;
+
+	size_t grown = *capacity ? *capacity * 2 : PNG_INFLATE_BUFFER_MIN;
+	if (grown > limit || grown < *capacity)
+		grown = limit;
+
+	uint8_t *ptr = realloc(*data, grown);
+	if (!ptr)
+		return PNG_ERR_NOMEM;
+
+	*data = ptr;
+	*capacity = grown;
+	return PNG_OK;
+}
+
+int png_inflate_buffer(const uint8_t *in, size_t in_size, size_t limit, uint8_t **out, size_t *out_size) {
+	uint8_t *data = NULL;
+	size_t capacity = 0;
+	int ret;
+
+#if PNG_INFLATE_STREAMING
+	png_z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+
+	if (PNG_Z(inflateInit)(&stream) != Z_OK)
+		return PNG_ERR_NOMEM;
+
+	// chunks are at most 2^31 - 1 bytes, that always fits
+	stream.next_in = (uint8_t *)in;
+	stream.avail_in = png_clamp_uint(in_size);
+
+	size_t size = 0;
+
+	for (;;) {
+		if (size == capacity && (ret = png_buffer_grow(&data, &capacity, limit)))
+			goto fail;
+
+		stream.next_out = data + size;
+		stream.avail_out = png_clamp_uint(capacity - size);
+
+		int status = PNG_Z(inflate)(&stream, Z_NO_FLUSH);
+		size = stream.next_out - data;
+
+		if (status == Z_STREAM_END)
+			break;
+
+		if (status == Z_MEM_ERROR) {
+			ret = PNG_ERR_NOMEM;
+			goto fail;
+		}
+
+		// with room left over, all input has been used up without an end
+		if ((status != Z_OK && status != Z_BUF_ERROR) || stream.avail_out) {
+			ret = PNG_ERR_CORRUPT;
+			goto fail;
+		}
+	}
+
+	PNG_Z(inflateEnd)(&stream);
+
+	*out = data;
+	*out_size = size;
+	return PNG_OK;
+
+fail:
+	PNG_Z(inflateEnd)(&stream);
+	free(data);
+	return ret;
+#else
+	struct libdeflate_decompressor *decompressor = libdeflate_alloc_decompressor();
+	if (!decompressor)
+		return PNG_ERR_NOMEM;
+
+	// libdeflate needs room for all of it up front, retry with more
+	for (;;) {
+		if ((ret = png_buffer_grow(&data, &capacity, limit)))
+			goto fail;
+
+		size_t size;
+		enum libdeflate_result result = libdeflate_zlib_decompress(decompressor, in, in_size, data, capacity, &size);
+
+		if (result == LIBDEFLATE_INSUFFICIENT_SPACE)
+			continue;
+
+		if (result != LIBDEFLATE_SUCCESS) {
+			ret = PNG_ERR_CORRUPT;
+			goto fail;
+		}
+
+		libdeflate_free_decompressor(decompressor);
+
+		*out = data;
+		*out_size = size;
+		return PNG_OK;
+	}
+
+fail:
+	libdeflate_free_decompressor(decompressor);
+	free(data);
+	return ret;
+#endif
+}
+
+#if !PNG_INFLATE_STREAMING
+
+// the IDAT payloads as one buffer, borrowed straight from the mapping when
+// there is only one chunk and copied together into arena otherwise
+static int png_gather_idat(struct png_chunk_index *index, struct png_arena *arena, int check_crc, const uint8_t **out, size_t *out_size) {
+	size_t size = 0;
+	const uint8_t *first = NULL;
+
+	for (size_t i = 0; i < index->count; i++) {
+		struct png_chunk_entry *entry = &index->entries[i];
+		if (!png_entry_is(entry, "IDAT"))
+			continue;
+
+		if (check_crc && !png_entry_crc_ok(entry))
+			return PNG_ERR_CRC;
+
+		if (!first)
+			first = entry->chunk.data;
+
+		size += entry->chunk.size;
+	}
+
+	if (index->idat_count < 2) {
+		*out = first;
+		*out_size = size;
+		return index->idat_count ? PNG_OK : PNG_ERR_TRUNCATED;
+	}
+
+	uint8_t *data = png_arena_alloc(arena, size);
+	if (!data)
+		return PNG_ERR_NOMEM;
+
+	size = 0;
+
+	for (size_t i = 0; i < index->count; i++) {
+		const struct png_chunk *c = &index->entries[i].chunk;
+		if (strncmp("IDAT", c->type, 4))
+			continue;
+
+		memcpy(data + size, c->data, c->size);
+		size += c->size;
+	}
+
+	*out = data;
+	*out_size = size;
+	return PNG_OK;
+}
+
+int png_inflate_whole(struct png_inflater *inflater, struct png_arena *arena, struct png_chunk_index *index, size_t out_size, int check_crc, int check_adler, struct png_inflated *out) {
+	const uint8_t *in;
+	size_t in_size;
+
+	if (!inflater->decompressor) {
+		inflater->decompressor = libdeflate_alloc_decompressor();
+		if (!inflater->decompressor)
+			return PNG_ERR_NOMEM;
+	}
+
+	int ret = png_gather_idat(index, arena, check_crc, &in, &in_size);
+	if (ret)
+		return ret;
+
+	struct png_segment *segment = png_arena_alloc(arena, sizeof(*segment));
+	uint8_t *data = png_arena_alloc(arena, out_size);
+	if (!segment || !data)
+		return PNG_ERR_NOMEM;
+
+	enum libdeflate_result result;
+
+	if (check_adler) {
+		result = libdeflate_zlib_decompress(inflater->decompressor, in, in_size, data, out_size, NULL);
+	} else if (in_size < 2) {
+		result = LIBDEFLATE_BAD_DATA;
+	} else {
+		// skip the zlib header and never look at the trailer
+		result = libdeflate_deflate_decompress(inflater->decompressor, in + 2, in_size - 2, data, out_size, NULL);
+	}
+
+	switch (result) {
+		case LIBDEFLATE_SUCCESS:
+			break;
+		case LIBDEFLATE_BAD_DATA:
+		case LIBDEFLATE_SHORT_OUTPUT:
+			// a bad stream or a cut off file, told apart by IEND
+			return index->complete ? PNG_ERR_CORRUPT : PNG_ERR_TRUNCATED;
+		default:
+			return PNG_ERR_CORRUPT;
+	}
+
+	segment->data = data;
+	segment->size = out_size;
+	out->segments = segment;
+	out->count = 1;
+	out->arena = 1;
+	return PNG_OK;
+}
+
+#endif
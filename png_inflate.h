@@ -0,0 +1,82 @@
+#ifndef PNG_INFLATE_H
+#define PNG_INFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+
+// the inflate library is picked at build time: zlib by default,
+// PNG_INFLATE_ZLIB_NG for zlib-ng's native api, or PNG_INFLATE_LIBDEFLATE.
+// the zlib flavours stream IDAT through inflate() as it is read, libdeflate
+// only inflates whole buffers, which suits a png since IHDR tells exactly
+// how much comes out
+#if defined(PNG_INFLATE_LIBDEFLATE)
+
+#define PNG_INFLATE_STREAMING 0
+#include <libdeflate.h>
+
+#else
+
+#define PNG_INFLATE_STREAMING 1
+
+#if defined(PNG_INFLATE_ZLIB_NG)
+#include <zlib-ng.h>
+#define PNG_Z(name) zng_##name
+typedef zng_stream png_z_stream;
+#else
+#include <zlib.h>
+#define PNG_Z(name) name
+typedef z_stream png_z_stream;
+#endif
+
+#endif
+
+static inline __attribute__((always_inline)) unsigned int png_clamp_uint(size_t size) {
+	if (size > UINT_MAX)
+		return UINT_MAX;
+
+	return size;
+}
+
+static inline uint32_t png_crc32(uint32_t crc, const void *data, size_t size) {
+#if PNG_INFLATE_STREAMING
+	const uint8_t *ptr = data;
+
+	// the length is only an unsigned int
+	for (unsigned int n; size; ptr += n, size -= n) {
+		n = png_clamp_uint(size);
+		crc = PNG_Z(crc32)(crc, ptr, n);
+	}
+
+	return crc;
+#else
+	return libdeflate_crc32(crc, data, size);
+#endif
+}
+
+static inline uint32_t png_adler32(uint32_t adler, const void *data, size_t size) {
+#if PNG_INFLATE_STREAMING
+	const uint8_t *ptr = data;
+
+	for (unsigned int n; size; ptr += n, size -= n) {
+		n = png_clamp_uint(size);
+		adler = PNG_Z(adler32)(adler, ptr, n);
+	}
+
+	return adler;
+#else
+	return libdeflate_adler32(adler, data, size);
+#endif
+}
+
+// the reusable part of inflating, kept in a workspace
+struct png_inflater {
+#if PNG_INFLATE_STREAMING
+	png_z_stream stream;
+	int stream_ready;
+#else
+	struct libdeflate_decompressor *decompressor;
+#endif
+};
+
+#endif
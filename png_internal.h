@@ -0,0 +1,197 @@
+#ifndef PNG_INTERNAL_H
+#define PNG_INTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#include "png_decoder.h"
+#include "png_inflate.h"
+
+// decode statistics cost a few clock reads per row when asked for, building
+// with PNG_NO_STATS compiles all of it out
+#ifdef PNG_NO_STATS
+#define PNG_STATS 0
+#else
+#define PNG_STATS 1
+#endif
+
+// chunk lengths are limited to 2^31 - 1, anything longer is corrupt
+#define PNG_CHUNK_MAX_SIZE 0x7fffffffu
+
+struct png_chunk {
+	uint32_t size;
+	char type[4];
+	void *data;
+};
+
+struct png_state {
+	void *ptr;
+	size_t size;
+	size_t index;
+};
+
+static inline __attribute__((always_inline)) void *offset_of(void *ptr, size_t off) {
+	return (void *)((uintptr_t)ptr + off);
+}
+
+static inline __attribute__((always_inline)) uint32_t be_host32(uint32_t val) {
+	uint8_t *buf = (uint8_t *)&val;
+	uint32_t out = 0;
+
+	out |= (uint32_t)buf[3];
+	out |= (uint32_t)buf[2] << 8;
+	out |= (uint32_t)buf[1] << 16;
+	out |= (uint32_t)buf[0] << 24;
+
+	return out;
+}
+
+// a big endian value at any alignment
+static inline __attribute__((always_inline)) uint32_t png_load_be32(const void *ptr) {
+	uint32_t val;
+	memcpy(&val, ptr, 4);
+	return be_host32(val);
+}
+
+static inline __attribute__((always_inline)) uint64_t png_load_be64(const void *ptr) {
+	const uint8_t *p = ptr;
+	return (uint64_t)png_load_be32(p) << 32 | png_load_be32(p + 4);
+}
+
+static inline __attribute__((always_inline)) void png_store_be32(void *ptr, uint32_t val) {
+	uint8_t *p = ptr;
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+static inline __attribute__((always_inline)) void png_store_be64(void *ptr, uint64_t val) {
+	uint8_t *p = ptr;
+	png_store_be32(p, val >> 32);
+	png_store_be32(p + 4, val);
+}
+
+// index never goes past size, so what's left can't wrap around
+static inline int png_fetchN(struct png_state *state, void *out, size_t count) {
+	if (count > state->size - state->index)
+		return 1;
+
+	memcpy(out, offset_of(state->ptr, state->index), count);
+	state->index += count;
+	return 0;
+}
+
+static inline int png_fetch32(struct png_state *state, uint32_t *out) {
+	return png_fetchN(state, out, 4);
+}
+
+static inline int png_fetch_next_chunk(struct png_state *state, struct png_chunk *out) {
+	if (png_fetch32(state, &out->size))
+		return 1;
+
+	out->size = be_host32(out->size);
+
+	if (png_fetchN(state, out->type, 4))
+		return 1;
+
+	// the payload and its crc, the limit keeps the sum from overflowing
+	if (out->size > PNG_CHUNK_MAX_SIZE || state->size - state->index < (size_t)out->size + 4)
+		return 1;
+
+	out->data = offset_of(state->ptr, state->index);
+	state->index += out->size + 4;
+
+	return 0;
+}
+
+// the crc of a chunk covers its type and payload and follows the payload
+static inline __attribute__((always_inline)) const uint8_t *png_chunk_type(const struct png_chunk *c) {
+	return (const uint8_t *)c->data - 4;
+}
+
+static inline __attribute__((always_inline)) uint32_t png_chunk_stored_crc(const struct png_chunk *c) {
+	return png_load_be32((const uint8_t *)c->data + c->size);
+}
+
+static inline int png_chunk_crc_ok(const struct png_chunk *c) {
+	return png_crc32(png_crc32(0, png_chunk_type(c), 4), c->data, c->size) == png_chunk_stored_crc(c);
+}
+
+// every chunk of the file, found in a single pass when it's opened so that
+// later stages never walk the chunks again
+struct png_chunk_entry {
+	struct png_chunk chunk;
+	enum png_crc_state crc;
+};
+
+struct png_chunk_index {
+	struct png_chunk_entry *entries;
+	size_t count;
+	size_t idat_count;
+	int complete; // the last chunk is IEND
+};
+
+// check a chunk's crc once and remember the outcome
+static inline int png_entry_crc_ok(struct png_chunk_entry *entry) {
+	if (entry->crc == PNG_CRC_UNCHECKED)
+		entry->crc = png_chunk_crc_ok(&entry->chunk) ? PNG_CRC_OK : PNG_CRC_BAD;
+
+	return entry->crc == PNG_CRC_OK;
+}
+
+static inline __attribute__((always_inline)) int png_entry_is(const struct png_chunk_entry *entry, const char type[4]) {
+	return !strncmp(type, entry->chunk.type, 4);
+}
+
+// parse and validate IHDR, this only needs the first 33 bytes of the file
+int png_read_header(struct png_state *state, struct png_info *info);
+
+// the geometry of pass index, or of the whole image when it isn't interlaced
+void png_get_pass(const struct png_info *info, unsigned int index, struct png_pass *out);
+
+size_t png_pixel_bits(const struct png_info *info);
+size_t png_pass_row_size(const struct png_pass *pass, size_t pixel_bits);
+
+// bytes per decoded row of width pixels in format
+size_t png_format_row_size(const struct png_info *info, enum png_format format, uint32_t width);
+
+// write the pixels of one unfiltered pass row to their place in row
+void png_scatter_row(uint8_t *row, const uint8_t *line, const struct png_pass *pass, size_t pixel_bits);
+
+// IDAT inflated ahead of time into a list of buffers, in stream order
+struct png_segment {
+	uint8_t *data;
+	size_t size;
+};
+
+struct png_inflated {
+	struct png_segment *segments;
+	size_t count;
+	int arena; // taken from a workspace arena, nothing to free
+};
+
+// inflate the image data on up to threads cores, split at the flush points
+// encoders leave at IDAT boundaries; fails with PNG_ERR_UNSUPPORTED when the
+// stream can't be split safely, in which case it has to be inflated serially;
+// with check_crc a bad IDAT crc fails it as well, the serial pass reports it
+int png_inflate_parallel(struct png_chunk_index *index, size_t out_size, unsigned int threads, int check_crc, struct png_inflated *out);
+void png_inflated_free(struct png_inflated *inflated);
+
+// inflate a complete zlib stream of unknown size, like the ones in zTXt,
+// iTXt and iCCP, into a malloc'd buffer; PNG_ERR_UNSUPPORTED when it would
+// take more than limit bytes
+int png_inflate_buffer(const uint8_t *in, size_t in_size, size_t limit, uint8_t **out, size_t *out_size);
+
+#if !PNG_INFLATE_STREAMING
+struct png_arena;
+
+// gather the IDAT payloads and inflate them in one go with libdeflate into
+// memory from arena, checking their crcs while gathering and the adler-32
+// if asked to
+int png_inflate_whole(struct png_inflater *inflater, struct png_arena *arena, struct png_chunk_index *index, size_t out_size, int check_crc, int check_adler, struct png_inflated *out);
+#endif
+
+#endif
@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "png_metadata.h"
+
+// none of the metadata chunks has any business inflating to more than this
+#define PNG_METADATA_MAX_SIZE (64u << 20)
+
+void png_metadata_free(struct png_metadata *meta) {
+	for (size_t i = 0; i < meta->count; i++)
+		free(meta->buffers[i].data);
+
+	free(meta->buffers);
+	meta->buffers = NULL;
+	meta->count = 0;
+}
+
+static inline __attribute__((always_inline)) int png_is_text(const struct png_chunk_entry *entry) {
+	return png_entry_is(entry, "tEXt") || png_entry_is(entry, "zTXt") || png_entry_is(entry, "iTXt");
+}
+
+// a nul terminated field at *ptr, the pointer is moved past the nul
+static const char *png_metadata_field(const uint8_t **ptr, const uint8_t *end) {
+	const uint8_t *nul = memchr(*ptr, 0, end - *ptr);
+	if (!nul)
+		return NULL;
+
+	const char *field = (const char *)*ptr;
+	*ptr = nul + 1;
+	return field;
+}
+
+// keywords are 1 to 79 latin-1 characters, only the length is checked
+static const char *png_metadata_keyword(const uint8_t **ptr, const uint8_t *end) {
+	const uint8_t *start = *ptr;
+	const char *keyword = png_metadata_field(ptr, end);
+
+	if (!keyword || *ptr - start < 2 || *ptr - start > 80)
+		return NULL;
+
+	return keyword;
+}
+
+// the inflated payload of a chunk, from the buffers inflated before or fresh
+static int png_metadata_inflate(struct png_metadata *meta, size_t chunk, const uint8_t *in, const uint8_t *end, const uint8_t **out, size_t *out_size) {
+	for (size_t i = 0; i < meta->count; i++) {
+		if (meta->buffers[i].chunk == chunk) {
+			*out = meta->buffers[i].data;
+			*out_size = meta->buffers[i].size;
+			return PNG_OK;
+		}
+	}
+
+	struct png_metadata_buffer *buffers = realloc(meta->buffers, (meta->count + 1) * sizeof(*buffers));
+	if (!buffers)
+		return PNG_ERR_NOMEM;
+
+	meta->buffers = buffers;
+
+	struct png_metadata_buffer *buffer = &buffers[meta->count];
+	int ret = png_inflate_buffer(in, end - in, PNG_METADATA_MAX_SIZE, &buffer->data, &buffer->size);
+	if (ret)
+		return ret;
+
+	buffer->chunk = chunk;
+	meta->count++;
+
+	*out = buffer->data;
+	*out_size = buffer->size;
+	return PNG_OK;
+}
+
+static int png_metadata_check(struct png_chunk_entry *entry, int check_crc) {
+	if (check_crc && !png_entry_crc_ok(entry))
+		return PNG_ERR_CRC;
+
+	return PNG_OK;
+}
+
+size_t png_metadata_text_count(const struct png_chunk_index *index) {
+	size_t count = 0;
+
+	for (size_t i = 0; i < index->count; i++)
+		count += png_is_text(&index->entries[i]);
+
+	return count;
+}
+
+int png_metadata_text(struct png_metadata *meta, struct png_chunk_index *index, int check_crc, size_t n, struct png_text *out) {
+	size_t chunk = 0;
+
+	for (; chunk < index->count; chunk++)
+		if (png_is_text(&index->entries[chunk]) && !n--)
+			break;
+
+	if (chunk == index->count)
+		return PNG_ERR_ARGUMENT;
+
+	struct png_chunk_entry *entry = &index->entries[chunk];
+	int ret = png_metadata_check(entry, check_crc);
+	if (ret)
+		return ret;
+
+	const uint8_t *ptr = entry->chunk.data;
+	const uint8_t *end = ptr + entry->chunk.size;
+
+	out->keyword = png_metadata_keyword(&ptr, end);
+	if (!out->keyword)
+		return PNG_ERR_CORRUPT;
+
+	out->language = "";
+	out->translated = "";
+	out->compressed = 0;
+
+	if (png_entry_is(entry, "tEXt")) {
+		out->text = (const char *)ptr;
+		out->text_size = end - ptr;
+		return PNG_OK;
+	}
+
+	if (png_entry_is(entry, "zTXt")) {
+		// deflate is the only compression method
+		if (ptr == end || *ptr++ != 0)
+			return PNG_ERR_CORRUPT;
+
+		out->compressed = 1;
+	} else {
+		if (end - ptr < 2 || ptr[0] > 1 || (ptr[0] && ptr[1] != 0))
+			return PNG_ERR_CORRUPT;
+
+		out->compressed = ptr[0];
+		ptr += 2;
+
+		out->language = png_metadata_field(&ptr, end);
+		out->translated = png_metadata_field(&ptr, end);
+		if (!out->language || !out->translated)
+			return PNG_ERR_CORRUPT;
+	}
+
+	if (!out->compressed) {
+		out->text = (const char *)ptr;
+		out->text_size = end - ptr;
+		return PNG_OK;
+	}
+
+	const uint8_t *text;
+	if ((ret = png_metadata_inflate(meta, chunk, ptr, end, &text, &out->text_size)))
+		return ret;
+
+	out->text = (const char *)text;
+	return PNG_OK;
+}
+
+int png_metadata_icc(struct png_metadata *meta, struct png_chunk_index *index, int check_crc, struct png_icc *out) {
+	memset(out, 0, sizeof(*out));
+
+	size_t chunk = 0;
+
+	for (; chunk < index->count; chunk++)
+		if (png_entry_is(&index->entries[chunk], "iCCP"))
+			break;
+
+	if (chunk == index->count)
+		return PNG_OK;
+
+	struct png_chunk_entry *entry = &index->entries[chunk];
+	int ret = png_metadata_check(entry, check_crc);
+	if (ret)
+		return ret;
+
+	const uint8_t *ptr = entry->chunk.data;
+	const uint8_t *end = ptr + entry->chunk.size;
+
+	const char *name = png_metadata_keyword(&ptr, end);
+	if (!name || ptr == end || *ptr++ != 0)
+		return PNG_ERR_CORRUPT;
+
+	const uint8_t *profile;
+	if ((ret = png_metadata_inflate(meta, chunk, ptr, end, &profile, &out->size)))
+		return ret;
+
+	out->name = name;
+	out->profile = profile;
+	return PNG_OK;
+}
+
+int png_metadata_exif(struct png_chunk_index *index, int check_crc, const void **data, size_t *size) {
+	*data = NULL;
+	*size = 0;
+
+	for (size_t i = 0; i < index->count; i++) {
+		struct png_chunk_entry *entry = &index->entries[i];
+		if (!png_entry_is(entry, "eXIf"))
+			continue;
+
+		int ret = png_metadata_check(entry, check_crc);
+		if (ret)
+			return ret;
+
+		*data = entry->chunk.data;
+		*size = entry->chunk.size;
+		break;
+	}
+
+	return PNG_OK;
+}
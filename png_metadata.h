@@ -0,0 +1,39 @@
+#ifndef PNG_METADATA_H
+#define PNG_METADATA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "png_decoder.h"
+#include "png_internal.h"
+
+// a payload inflated for a metadata query, kept until the decoder is closed
+struct png_metadata_buffer {
+	size_t chunk;
+	uint8_t *data;
+	size_t size;
+};
+
+// everything metadata queries keep around, only ever touches the chunks it's
+// asked about and never the image data
+struct png_metadata {
+	struct png_metadata_buffer *buffers;
+	size_t count;
+};
+
+void png_metadata_free(struct png_metadata *meta);
+
+// the number of tEXt, zTXt and iTXt chunks
+size_t png_metadata_text_count(const struct png_chunk_index *index);
+
+// the n-th text chunk in file order, inflated on first access if compressed;
+// with check_crc the chunk's crc is verified first
+int png_metadata_text(struct png_metadata *meta, struct png_chunk_index *index, int check_crc, size_t n, struct png_text *out);
+
+// the embedded ICC profile, inflated on first access, or a NULL profile
+int png_metadata_icc(struct png_metadata *meta, struct png_chunk_index *index, int check_crc, struct png_icc *out);
+
+// the raw EXIF data, or NULL
+int png_metadata_exif(struct png_chunk_index *index, int check_crc, const void **data, size_t *size);
+
+#endif
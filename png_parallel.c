@@ -0,0 +1,328 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <pthread.h>
+
+#include "png_decoder.h"
+#include "png_internal.h"
+
+// an IDAT payload, data and size skip the zlib header in the first one
+struct png_span {
+	const uint8_t *data;
+	size_t size;
+	struct png_chunk_entry *entry;
+};
+
+// a run of IDAT payloads that can be inflated without the data before it
+struct png_parallel_job {
+	const struct png_span *spans;
+	size_t span_count;
+	int last;
+
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+
+	uint32_t adler;
+	uint8_t trailer[4];
+	int failed;
+};
+
+struct png_parallel {
+	struct png_parallel_job *jobs;
+	size_t job_count;
+	size_t next_job;
+	size_t out_size;
+	int check_crc;
+};
+
+// empty stored block, what both Z_SYNC_FLUSH and Z_FULL_FLUSH emit
+static const uint8_t png_flush_marker[4] = {0x00, 0x00, 0xff, 0xff};
+
+// segments smaller than this aren't worth a thread of their own
+#define PNG_PARALLEL_MIN_SEGMENT (64 * 1024)
+
+static int png_collect_spans(struct png_chunk_index *index, struct png_span **out, size_t *count) {
+	struct png_span *spans = malloc(index->idat_count * sizeof(*spans));
+	if (!spans)
+		return PNG_ERR_NOMEM;
+
+	size_t n = 0;
+
+	for (size_t i = 0; i < index->count; i++) {
+		struct png_chunk_entry *entry = &index->entries[i];
+		if (!png_entry_is(entry, "IDAT"))
+			continue;
+
+		spans[n].data = entry->chunk.data;
+		spans[n].size = entry->chunk.size;
+		spans[n].entry = entry;
+		n++;
+	}
+
+	*out = spans;
+	*count = n;
+	return PNG_OK;
+}
+
+// make room for more output, never beyond what the whole image needs
+static int png_job_grow(struct png_parallel_job *job, size_t limit) {
+	if (job->capacity >= limit)
+		return 1;
+
+	size_t capacity = job->capacity ? job->capacity * 2 : PNG_PARALLEL_MIN_SEGMENT * 4;
+	if (capacity > limit || capacity < job->capacity)
+		capacity = limit;
+
+	uint8_t *data = realloc(job->data, capacity);
+	if (!data)
+		return 1;
+
+	job->data = data;
+	job->capacity = capacity;
+	return 0;
+}
+
+// raw inflate one segment with an empty window, any reference to data in an
+// earlier segment makes inflate fail with "invalid distance too far back"
+static int png_inflate_job(struct png_parallel_job *job, size_t limit, int check_crc) {
+	png_z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+
+	if (PNG_Z(inflateInit2)(&stream, -MAX_WBITS) != Z_OK)
+		return 1;
+
+	int status = Z_OK;
+	size_t span = 0;
+	size_t trailer_size = 0;
+
+	for (; span < job->span_count && status != Z_STREAM_END; span++) {
+		stream.next_in = (uint8_t *)job->spans[span].data;
+		stream.avail_in = job->spans[span].size;
+
+		while (stream.avail_in) {
+			if (job->size == job->capacity && png_job_grow(job, limit))
+				goto fail;
+
+			stream.next_out = job->data + job->size;
+			stream.avail_out = png_clamp_uint(job->capacity - job->size);
+
+			status = PNG_Z(inflate)(&stream, Z_NO_FLUSH);
+			job->size = stream.next_out - job->data;
+
+			if (status == Z_STREAM_END)
+				break;
+
+			if (status != Z_OK && status != Z_BUF_ERROR)
+				goto fail;
+		}
+
+		// the chunk has only just been read, check it while it's in cache
+		if (check_crc && !png_entry_crc_ok(job->spans[span].entry))
+			goto fail;
+	}
+
+	if (status == Z_STREAM_END) {
+		if (!job->last)
+			goto fail;
+
+		// the adler-32 trailer follows, possibly spread over more chunks
+		size_t tail = span;
+
+		for (;;) {
+			while (stream.avail_in && trailer_size < 4) {
+				job->trailer[trailer_size++] = *stream.next_in++;
+				stream.avail_in--;
+			}
+
+			if (trailer_size == 4 || span >= job->span_count)
+				break;
+
+			stream.next_in = (uint8_t *)job->spans[span].data;
+			stream.avail_in = job->spans[span].size;
+			span++;
+		}
+
+		if (trailer_size != 4)
+			goto fail;
+
+		// the trailer's chunks and whatever comes after them
+		for (size_t i = tail; check_crc && i < job->span_count; i++)
+			if (!png_entry_crc_ok(job->spans[i].entry))
+				goto fail;
+	} else {
+		// the segment has to end right after a complete, byte aligned block
+		// that isn't the final one, otherwise the split point was bogus
+		if (job->last || (stream.data_type & 0xc7) != 0x80)
+			goto fail;
+	}
+
+	PNG_Z(inflateEnd)(&stream);
+
+	job->adler = png_adler32(1, job->data, job->size);
+	return 0;
+
+fail:
+	PNG_Z(inflateEnd)(&stream);
+	return 1;
+}
+
+static void *png_parallel_worker(void *arg) {
+	struct png_parallel *parallel = arg;
+
+	for (;;) {
+		size_t i = __atomic_fetch_add(&parallel->next_job, 1, __ATOMIC_RELAXED);
+		if (i >= parallel->job_count)
+			break;
+
+		struct png_parallel_job *job = &parallel->jobs[i];
+		job->failed = png_inflate_job(job, parallel->out_size, parallel->check_crc);
+	}
+
+	return NULL;
+}
+
+static int png_check_zlib_header(const struct png_span *span) {
+	if (span->size < 2)
+		return 1;
+
+	uint8_t cmf = span->data[0];
+	uint8_t flg = span->data[1];
+
+	// deflate, a window of at most 32K and no preset dictionary
+	return (cmf & 0x0f) != 8 || (cmf >> 4) > 7 || (flg & 0x20) || ((cmf << 8) | flg) % 31;
+}
+
+static int png_span_has_marker(const struct png_span *span) {
+	return span->size >= 4 && !memcmp(span->data + span->size - 4, png_flush_marker, 4);
+}
+
+// split the spans at flush points so that each job gets roughly an equal
+// share of the compressed data, and at least PNG_PARALLEL_MIN_SEGMENT
+static size_t png_plan_jobs(struct png_span *spans, size_t span_count, unsigned int threads, struct png_parallel_job *jobs) {
+	size_t total = 0;
+	for (size_t i = 0; i < span_count; i++)
+		total += spans[i].size;
+
+	size_t target = total / (threads * 2);
+	if (target < PNG_PARALLEL_MIN_SEGMENT)
+		target = PNG_PARALLEL_MIN_SEGMENT;
+
+	size_t job_count = 0;
+	size_t start = 0;
+	size_t size = 0;
+
+	for (size_t i = 0; i < span_count; i++) {
+		size += spans[i].size;
+
+		if (i + 1 < span_count && size >= target && png_span_has_marker(&spans[i])) {
+			jobs[job_count++] = (struct png_parallel_job){.spans = spans + start, .span_count = i + 1 - start};
+			start = i + 1;
+			size = 0;
+		}
+	}
+
+	jobs[job_count++] = (struct png_parallel_job){.spans = spans + start, .span_count = span_count - start, .last = 1};
+	return job_count;
+}
+
+int png_inflate_parallel(struct png_chunk_index *index, size_t out_size, unsigned int threads, int check_crc, struct png_inflated *out) {
+	struct png_span *spans;
+	size_t span_count;
+
+	if (threads < 2 || index->idat_count < 2)
+		return PNG_ERR_UNSUPPORTED;
+
+	int ret = png_collect_spans(index, &spans, &span_count);
+	if (ret)
+		return ret;
+
+	if (png_check_zlib_header(&spans[0])) {
+		free(spans);
+		return PNG_ERR_UNSUPPORTED;
+	}
+
+	struct png_parallel_job *jobs = malloc(span_count * sizeof(*jobs));
+	if (!jobs) {
+		free(spans);
+		return PNG_ERR_NOMEM;
+	}
+
+	// the zlib header isn't part of the deflate stream
+	spans[0].data += 2;
+	spans[0].size -= 2;
+
+	struct png_parallel parallel = {
+		.jobs = jobs,
+		.job_count = png_plan_jobs(spans, span_count, threads, jobs),
+		.next_job = 0,
+		.out_size = out_size,
+		.check_crc = check_crc,
+	};
+
+	if (parallel.job_count < 2) {
+		ret = PNG_ERR_UNSUPPORTED;
+		goto end;
+	}
+
+	// the calling thread works on the jobs as well
+	unsigned int workers = parallel.job_count < threads ? parallel.job_count : threads;
+	pthread_t *tids = malloc((workers - 1) * sizeof(*tids));
+	unsigned int started = 0;
+
+	for (; tids && started < workers - 1; started++)
+		if (pthread_create(&tids[started], NULL, png_parallel_worker, &parallel))
+			break;
+
+	png_parallel_worker(&parallel);
+
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	free(tids);
+
+	// stitch the checksums together and compare against the trailer
+	size_t total = 0;
+	uint32_t adler = 1;
+
+	ret = PNG_ERR_UNSUPPORTED;
+
+	for (size_t i = 0; i < parallel.job_count; i++) {
+		if (jobs[i].failed)
+			goto end;
+
+		adler = PNG_Z(adler32_combine)(adler, jobs[i].adler, jobs[i].size);
+		total += jobs[i].size;
+	}
+
+	const uint8_t *trailer = jobs[parallel.job_count - 1].trailer;
+	uint32_t expected = png_load_be32(trailer);
+
+	if (total != out_size || adler != expected)
+		goto end;
+
+	out->segments = malloc(parallel.job_count * sizeof(*out->segments));
+	if (!out->segments) {
+		ret = PNG_ERR_NOMEM;
+		goto end;
+	}
+
+	for (size_t i = 0; i < parallel.job_count; i++) {
+		out->segments[i].data = jobs[i].data;
+		out->segments[i].size = jobs[i].size;
+		jobs[i].data = NULL;
+	}
+
+	out->count = parallel.job_count;
+	ret = PNG_OK;
+
+end:
+	for (size_t i = 0; i < parallel.job_count; i++)
+		free(jobs[i].data);
+
+	free(jobs);
+	free(spans);
+	return ret;
+}
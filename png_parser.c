@@ -1,389 +1,766 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stddef.h>
-#include <assert.h>
+#include <errno.h>
 
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 
-#include <zlib.h>
+#include "png_decoder.h"
+
+#define ARR_SIZE(arr) (sizeof(arr) / (sizeof(*(arr))))
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+// the netpbm flavour a decoded image is written as
+struct ppm_format {
+	const char *name;
+	const char *ext;
+	char magic;            // '3', '5', '6' or '7'
+	const char *tupltype;  // PAM only
+	unsigned int channels;
+};
+
+static const struct ppm_format ppm_formats[] = {
+	{"plain PPM", ".ppm", '3', NULL, 3},
+	{"PGM", ".pgm", '5', NULL, 1},
+	{"PPM", ".ppm", '6', NULL, 3},
+	{"PAM", ".pam", '7', "GRAYSCALE_ALPHA", 2},
+	{"PAM", ".pam", '7', "RGB_ALPHA", 4},
+};
 
-struct mapped_file {
-	size_t size;
-	uint8_t *ptr;
+struct ppm_writer {
+	FILE *out;
+	uint32_t width, height; // of the image or of the cropped part
+	const struct ppm_format *format;
+	size_t row_size;
+	unsigned int sample_size;
+	unsigned int max_value;
 };
 
-void map_file(const char *filename, struct mapped_file *out) {
-	int fd = open(filename, O_RDONLY);
-	if (fd < 0) {
-		perror("failed to open file");
-		exit(1);
+// 8 and 16-bit gray and truecolor images are written with their samples as
+// the png stores them (big endian for 16-bit), so whole rows can be written
+// out as they are, or as 8-bit ones with eight_bit set; palettes, sub-byte
+// and tRNS images go through rgb8/rgba8
+static enum png_format ppm_select(struct png_decoder *decoder, const struct png_info *info, int ascii, int eight_bit, struct ppm_writer *out) {
+	int alpha = png_decoder_has_alpha(decoder);
+	int expand = info->color_type == PNG_COLOR_PALETTE || info->bit_depth < 8 || (alpha && !(info->color_type & 4));
+	enum png_format format = PNG_FORMAT_NATIVE;
+
+	// the plain format only has rgb
+	if (ascii && !(info->color_type & 2))
+		expand = 1;
+
+	if (expand) {
+		format = alpha && !ascii ? PNG_FORMAT_RGBA8 : PNG_FORMAT_RGB8;
+		out->format = &ppm_formats[ascii ? 0 : alpha ? 4 : 2];
+		out->sample_size = 1;
+		out->max_value = 255;
+		return format;
 	}
 
-	struct stat st;
-	if (fstat(fd, &st)) {
-		perror("failed to stat file");
-		exit(1);
+	if (ascii)
+		out->format = &ppm_formats[0];
+	else if (info->color_type == PNG_COLOR_GRAY)
+		out->format = &ppm_formats[1];
+	else if (info->color_type == PNG_COLOR_GRAY_ALPHA)
+		out->format = &ppm_formats[3];
+	else
+		out->format = &ppm_formats[alpha ? 4 : 2];
+
+	if (eight_bit && info->bit_depth == 16) {
+		out->sample_size = 1;
+		out->max_value = 255;
+		return PNG_FORMAT_NATIVE8;
 	}
 
-	size_t size = st.st_size;
-	void *ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	out->sample_size = info->bit_depth / 8;
+	out->max_value = (1u << info->bit_depth) - 1;
+	return format;
+}
 
-	if (ptr == MAP_FAILED) {
-		perror("failed to mmap file");
-		exit(1);
-	}
+static int ppm_write_header(struct ppm_writer *writer) {
+	const struct ppm_format *format = writer->format;
+	int ret;
 
-	if (close(fd)) {
-		perror("failed to close file");
-		exit(1);
-	}
+	if (format->magic == '3')
+		ret = fprintf(writer->out, "P3 %u %u %u\n", writer->width, writer->height, writer->max_value);
+	else if (format->magic == '7')
+		ret = fprintf(writer->out, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %u\nMAXVAL %u\nTUPLTYPE %s\nENDHDR\n",
+				writer->width, writer->height, format->channels, writer->max_value, format->tupltype);
+	else
+		ret = fprintf(writer->out, "P%c\n%u %u\n%u\n", format->magic, writer->width, writer->height, writer->max_value);
 
-	if (out) {
-		out->size = size;
-		out->ptr = ptr;
+	return ret < 0;
+}
+
+static int ppm_write_row(void *ctx, size_t y, const uint8_t *row) {
+	struct ppm_writer *writer = ctx;
+	(void)y;
+
+	if (fwrite(row, writer->row_size, 1, writer->out) != 1) {
+		perror("failed to write output");
+		return 1;
 	}
+
+	return 0;
 }
 
-void unmap_file(struct mapped_file *file) {
-	if (munmap(file->ptr, file->size) < 0) {
-		perror("failed to unmap file");
-		exit(1);
+static int ppm_write_row_ascii(void *ctx, size_t y, const uint8_t *row) {
+	struct ppm_writer *writer = ctx;
+	size_t sample_size = writer->sample_size;
+	size_t pixel_size = writer->row_size / writer->width;
+	(void)y;
+
+	// the plain format has no alpha, drop it
+	for (size_t x = 0; x < writer->width; x++) {
+		for (size_t i = 0; i < 3; i++) {
+			const uint8_t *sample = row + x * pixel_size + i * sample_size;
+			unsigned int value = sample[0];
+
+			if (sample_size == 2)
+				value = (value << 8) | sample[1];
+
+			fprintf(writer->out, "%u ", value);
+		}
 	}
+
+	if (fprintf(writer->out, "\n") < 0) {
+		perror("failed to write output");
+		return 1;
+	}
+
+	return 0;
 }
 
-struct png_chunk {
-	uint32_t size;
-	char type[4];
-	void *data;
-};
+static void print_stats(const struct png_decode_stats *stats) {
+	const char *filter_methods[] = {
+		"none",
+		"sub",
+		"up",
+		"average",
+		"paeth"
+	};
 
-struct png_state {
-	void *ptr;
-	size_t size;
-	size_t index;
-};
+	printf("rows per filter method:\n");
 
-#define ARR_SIZE(arr) (sizeof(arr) / (sizeof(*(arr))))
+	for (size_t i = 0; i < ARR_SIZE(filter_methods); i++)
+		printf("  %-8s %zu\n", filter_methods[i], stats->filter_rows[i]);
+
+	printf("mapped %zu bytes, inflated %zu bytes from %zu bytes in %zu IDAT chunks\n",
+			stats->bytes_mapped, stats->decompressed_bytes, stats->compressed_bytes, stats->idat_chunks);
+	printf("%zu allocations, %ld minor and %ld major page faults\n",
+			stats->allocations, stats->minor_faults, stats->major_faults);
+	printf("decoding took %.3f ms: inflate %.3f ms, unfilter %.3f ms, output %.3f ms\n",
+			stats->total_ns / 1e6, stats->inflate_ns / 1e6, stats->unfilter_ns / 1e6, stats->output_ns / 1e6);
+}
 
-static inline __attribute__((always_inline)) void *offset_of(void *ptr, size_t off) {
-	return (void *)((uintptr_t)ptr + off);
+// sum up the stats of a batch
+static void add_stats(struct png_decode_stats *total, const struct png_decode_stats *stats) {
+	for (size_t i = 0; i < ARR_SIZE(total->filter_rows); i++)
+		total->filter_rows[i] += stats->filter_rows[i];
+
+	total->bytes_mapped += stats->bytes_mapped;
+	total->idat_chunks += stats->idat_chunks;
+	total->compressed_bytes += stats->compressed_bytes;
+	total->decompressed_bytes += stats->decompressed_bytes;
+	total->allocations += stats->allocations;
+	total->minor_faults += stats->minor_faults;
+	total->major_faults += stats->major_faults;
+	total->total_ns += stats->total_ns;
+	total->inflate_ns += stats->inflate_ns;
+	total->unfilter_ns += stats->unfilter_ns;
+	total->output_ns += stats->output_ns;
 }
 
-static inline __attribute__((always_inline)) uint32_t be_host32(uint32_t val) {
-	uint8_t *buf = (uint8_t *)&val;
-	uint32_t out = 0;
+static void usage(const char *name) {
+	printf("usage: %s [-j jobs] [-a|--ascii] [-8|--8bit] [-r|--round] [--no-crc] [--no-adler] [--crop x,y,w,h] [--scale n] [--checkpoints file] [--map mode] [-v|--stats] [-o output] filename\n", name);
+	printf("       %s -b|--batch [-j jobs] [-a|--ascii] [-8|--8bit] [-r|--round] [--no-crc] [--no-adler] [--crop x,y,w,h] [--scale n] [--map mode] [-v|--stats] [filename...]\n", name);
+	printf("       %s -i|--info filename...\n", name);
+	printf("       %s -c|--chunks filename...\n", name);
+	printf("       %s -m|--metadata filename...\n", name);
+	printf("a filename of - stands for stdin, except with --info\n");
+	printf("--map is one of auto, plain, advise, populate or read\n");
+	printf("--scale is 1, 2, 4 or 8, for a thumbnail that size down\n");
+}
 
-	out |= buf[3];
-	out |= buf[2] << 8;
-	out |= buf[1] << 16;
-	out |= buf[0] << 24;
+static const char *map_modes[] = {"auto", "plain", "advise", "populate", "read"};
 
-	return out;
+static int parse_map_mode(const char *str, enum png_map_mode *out) {
+	for (size_t i = 0; i < ARR_SIZE(map_modes); i++) {
+		if (!strcmp(str, map_modes[i])) {
+			*out = (enum png_map_mode)i;
+			return 0;
+		}
+	}
+
+	return 1;
 }
 
-static int png_fetchN(struct png_state *state, void *out, size_t count) {
-	if (state->index + count > state->size)
-		return 1;
+static void print_info(const struct png_info *info) {
+	printf("width: %u, height: %u, bpp: %hhu, color type: %hhu, compression: %hhu, filter: %hhu, interlace: %hhu\n",
+			info->width, info->height, info->bit_depth, info->color_type, info->compression, info->filter, info->interlace);
+}
 
-	memcpy(out, offset_of(state->ptr, state->index), count);
-	state->index += count;
-	return 0;
+// print the header of every file without decoding or even mapping them
+static int info_only(char **files, int count) {
+	int ret = 0;
+
+	for (int i = 0; i < count; i++) {
+		struct png_info info;
+		int status = png_read_info(files[i], &info);
+
+		if (status == PNG_ERR_IO) {
+			perror(files[i]);
+			ret = 1;
+			continue;
+		}
+
+		if (status) {
+			fprintf(stderr, "%s: %s\n", files[i], png_status_string(status));
+			ret = 1;
+			continue;
+		}
+
+		printf("%s: ", files[i]);
+		print_info(&info);
+	}
+
+	return ret;
 }
 
-static int png_fetch8(struct png_state *state, uint8_t *out) {
-	return png_fetchN(state, out, 1);
+// a filename of - reads the image from stdin
+static int open_input(const char *filename, enum png_map_mode map, struct png_decoder **out) {
+	if (!strcmp(filename, "-"))
+		return png_decoder_open_fd(out, STDIN_FILENO);
+
+	return png_decoder_open_with(out, filename, map);
 }
 
-static int png_fetch16(struct png_state *state, uint32_t *out) {
-	return png_fetchN(state, out, 2);
+static int open_decoder(const char *filename, struct png_decoder **out) {
+	int status = open_input(filename, PNG_MAP_AUTO, out);
+
+	if (status == PNG_ERR_IO)
+		perror(filename);
+	else if (status)
+		fprintf(stderr, "%s: %s\n", filename, png_status_string(status));
+
+	return status;
 }
 
-static int png_fetch32(struct png_state *state, uint32_t *out) {
-	return png_fetchN(state, out, 4);
+// list the chunks of every file from the decoder's index, checking each crc
+static int list_chunks(char **files, int count) {
+	int ret = 0;
+
+	for (int i = 0; i < count; i++) {
+		struct png_decoder *decoder;
+
+		if (open_decoder(files[i], &decoder)) {
+			ret = 1;
+			continue;
+		}
+
+		printf("%s:\n", files[i]);
+
+		for (size_t n = 0; n < png_decoder_chunk_count(decoder); n++) {
+			struct png_chunk_info chunk;
+			png_decoder_chunk_info(decoder, n, &chunk);
+
+			// a lowercase first letter marks ancillary chunks
+			int critical = !(chunk.type[0] & 0x20);
+			int crc_ok = png_decoder_check_chunk(decoder, n) == PNG_OK;
+
+			printf("  %.4s %-9s %10u bytes at %zu%s\n", chunk.type, critical ? "critical" : "ancillary", chunk.size, chunk.offset, crc_ok ? "" : ", crc mismatch");
+
+			if (!crc_ok)
+				ret = 1;
+		}
+
+		png_decoder_close(decoder);
+	}
+
+	return ret;
 }
 
-static int png_fetch_next_chunk(struct png_state *state, struct png_chunk *out) {
-	if (png_fetch32(state, &out->size))
-		return 1;
+// print the text, ICC profile and EXIF metadata of every file
+static int list_metadata(char **files, int count) {
+	int ret = 0;
 
-	out->size = be_host32(out->size);
+	for (int i = 0; i < count; i++) {
+		struct png_decoder *decoder;
 
-	if (png_fetchN(state, out->type, 4))
-		return 1;
+		if (open_decoder(files[i], &decoder)) {
+			ret = 1;
+			continue;
+		}
 
-	if (state->index + out->size + 4 > state->size)
-		return 1;
+		printf("%s:\n", files[i]);
 
-	out->data = offset_of(state->ptr, state->index);
-	state->index += out->size + 4;
+		for (size_t n = 0; n < png_decoder_text_count(decoder); n++) {
+			struct png_text text;
+			int status = png_decoder_get_text(decoder, n, &text);
 
-	return 0;
+			if (status) {
+				fprintf(stderr, "%s: text chunk %zu: %s\n", files[i], n, png_status_string(status));
+				ret = 1;
+				continue;
+			}
+
+			if (*text.language || *text.translated)
+				printf("  %s [%s] (%s): %.*s\n", text.keyword, text.language, text.translated, (int)text.text_size, text.text);
+			else
+				printf("  %s: %.*s\n", text.keyword, (int)text.text_size, text.text);
+		}
+
+		struct png_icc icc;
+		int status = png_decoder_get_icc(decoder, &icc);
+
+		if (status) {
+			fprintf(stderr, "%s: iCCP: %s\n", files[i], png_status_string(status));
+			ret = 1;
+		} else if (icc.profile) {
+			printf("  ICC profile \"%s\", %zu bytes\n", icc.name, icc.size);
+		}
+
+		const void *exif;
+		size_t exif_size;
+		status = png_decoder_get_exif(decoder, &exif, &exif_size);
+
+		if (status) {
+			fprintf(stderr, "%s: eXIf: %s\n", files[i], png_status_string(status));
+			ret = 1;
+		} else if (exif) {
+			printf("  EXIF data, %zu bytes\n", exif_size);
+		}
+
+		png_decoder_close(decoder);
+	}
+
+	return ret;
 }
 
-#define OUTPUT_SIZE_FACTOR 200
+struct options {
+	const char *output;
+	int ascii;
+	int eight_bit; // cut 16-bit samples down to 8 bits
+	int round;     // round to nearest while doing that
+	int no_crc;    // trust the input, don't check IDAT crcs
+	int no_adler;  // nor the adler-32 of the image data
+	int crop;      // decode only region
+	struct png_region region;
+	const char *checkpoints; // sidecar for --crop, built when missing
+	unsigned int scale;      // thumbnail decode, 1/scale of the size
+	enum png_map_mode map;
+	int verbose;
+	int batch;
+	unsigned int threads; // per decoder, batch mode runs one per worker
+};
 
-static inline __attribute__((always_inline)) int png_decompress_idat(struct png_state *state, void *out_data, size_t buf_size) {
-	// duplicate the state to iterate over the png chunks without affecting the input state
-	struct png_state state_copy = *state;
-	void *input = NULL;
-	size_t input_size = 0;
+// replace the extension of filename, or append one if it has none
+static char *derive_output(const char *filename, const char *ext) {
+	const char *base = strrchr(filename, '/');
+	const char *dot = strrchr(base ? base : filename, '.');
+	size_t len = dot ? (size_t)(dot - filename) : strlen(filename);
 
-	struct png_chunk c;
+	char *out = malloc(len + strlen(ext) + 1);
+	if (!out)
+		return NULL;
 
-	// gather scattered IDAT chunks into one buffer (I think this is correct)
-	while(!png_fetch_next_chunk(&state_copy, &c)) {
-		if (strncmp("IDAT", c.type, 4))
-			continue;
+	memcpy(out, filename, len);
+	strcpy(out + len, ext);
+	return out;
+}
+
+// rows between checkpoints when building a sidecar
+#define CHECKPOINT_ROWS 64
 
-		input = realloc(input, input_size + c.size);
-		memcpy(offset_of(input, input_size), c.data, c.size);
+// load the checkpoints for decoder from filename, or build and save them
+// there the first time
+static int use_checkpoints(struct png_decoder *decoder, const char *filename, struct png_checkpoints **out) {
+	int status = png_checkpoints_load(out, filename);
 
-		input_size += c.size;
+	if (status == PNG_ERR_IO && errno == ENOENT) {
+		status = png_decoder_build_checkpoints(decoder, CHECKPOINT_ROWS, out);
+		if (status)
+			return status;
+
+		if ((status = png_checkpoints_save(*out, filename))) {
+			fprintf(stderr, "failed to write %s: %s\n", filename, strerror(errno));
+			return status;
+		}
+	} else if (status) {
+		if (status == PNG_ERR_IO)
+			fprintf(stderr, "failed to open %s: %s\n", filename, strerror(errno));
+		return status;
 	}
 
-	// decompress
-	size_t out_size = buf_size;
-	int status = uncompress(out_data, &out_size, input, input_size);
+	return png_decoder_set_checkpoints(decoder, *out);
+}
+
+// decode one file to PPM/PAM, in batch mode quietly and next to the input
+static int convert_file(const char *filename, const struct options *opts, struct png_workspace *ws, struct png_decode_stats *stats) {
+	struct png_decoder *decoder;
+	int status = open_input(filename, opts->map, &decoder);
 
-	if (status == Z_MEM_ERROR) {
-		fprintf(stderr, "failed to decompress: not enough memory\n");
+	if (status == PNG_ERR_IO) {
+		fprintf(stderr, "failed to open %s: %s\n", filename, strerror(errno));
 		return 1;
 	}
 
-	if (status == Z_BUF_ERROR) {
-		fprintf(stderr, "failed to decompress: not enough output buffer space\n");
+	if (status) {
+		fprintf(stderr, "%s: %s\n", filename, png_status_string(status));
 		return 1;
 	}
 
-	if (status == Z_DATA_ERROR) {
-		fprintf(stderr, "failed to decompress: broken data\n");
-		return 1;
+	png_decoder_set_workspace(decoder, ws);
+	png_decoder_set_threads(decoder, opts->threads);
+
+	struct png_info info;
+	png_decoder_get_info(decoder, &info);
+
+	if (!opts->batch)
+		print_info(&info);
+
+	int ret = 1;
+
+	struct ppm_writer writer = {NULL, info.width, info.height, NULL, 0, 0, 0};
+	// thumbnails are averaged a byte per sample
+	png_decoder_set_format(decoder, ppm_select(decoder, &info, opts->ascii, opts->eight_bit || opts->scale > 1, &writer));
+	png_decoder_set_rounding(decoder, opts->round);
+	png_decoder_set_crc_check(decoder, !opts->no_crc);
+	png_decoder_set_adler_check(decoder, !opts->no_adler);
+	writer.row_size = png_decoder_row_size(decoder);
+
+	const char *output = opts->output;
+	char *derived = NULL;
+	char fallback[8];
+	struct png_checkpoints *checkpoints = NULL;
+
+	if (opts->checkpoints && (status = use_checkpoints(decoder, opts->checkpoints, &checkpoints))) {
+		if (status != PNG_ERR_IO)
+			fprintf(stderr, "%s: %s: %s\n", filename, opts->checkpoints, png_status_string(status));
+		goto end;
 	}
 
-	assert(status == Z_OK);
-	assert(out_size == buf_size);
+	if (opts->crop) {
+		const struct png_region *crop = &opts->region;
 
-	return 0;
-}
+		if ((uint64_t)crop->x + crop->width > info.width || (uint64_t)crop->y + crop->height > info.height) {
+			fprintf(stderr, "%s: crop doesn't fit the image\n", filename);
+			goto end;
+		}
 
-static int png_check(struct png_state *state) {
-	if (state->size < 8)
-		return 1;
+		writer.width = crop->width;
+		writer.height = crop->height;
+		writer.row_size = png_decoder_region_row_size(decoder, crop);
+	}
 
-	state->index += 8;
+	if (opts->scale > 1) {
+		png_decoder_scaled_size(decoder, opts->scale, &writer.width, &writer.height);
+		writer.row_size = png_decoder_scaled_row_size(decoder, opts->scale);
+	}
 
-	return strncmp(offset_of(state->ptr, state->index - 8), "\x89PNG\r\n\x1A\n", 8);
-}
+	if (opts->batch) {
+		output = derived = derive_output(filename, writer.format->ext);
+		if (!output) {
+			fprintf(stderr, "%s: %s\n", filename, png_status_string(PNG_ERR_NOMEM));
+			goto end;
+		}
+	} else if (!output) {
+		snprintf(fallback, sizeof(fallback), "foo%s", writer.format->ext);
+		output = fallback;
+	}
 
-static inline __attribute__((always_inline)) uint8_t png_sub_filter(uint8_t *line, size_t pixel_size, size_t x, size_t i) {
-	if (x == 0)
-		return line[pixel_size * x + i];
+	if (!opts->batch)
+		printf("writing %s output to %s\n", writer.format->name, output);
 
-	return line[pixel_size * x + i] + line[pixel_size * (x - 1) + i];
-}
+	writer.out = fopen(output, "wb");
+	if (!writer.out) {
+		fprintf(stderr, "failed to open %s: %s\n", output, strerror(errno));
+		goto end;
+	}
 
-static inline __attribute__((always_inline)) uint8_t png_up_filter(uint8_t *line, uint8_t *prev_line, size_t pixel_size, size_t x, size_t i) {
-	if (!prev_line)
-		return line[pixel_size * x + i];
+	setvbuf(writer.out, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
 
-	return line[pixel_size * x + i] + prev_line[pixel_size * x + i];
-}
+	if (stats)
+		png_decoder_collect_stats(decoder, stats);
+
+	if (ppm_write_header(&writer)) {
+		fprintf(stderr, "failed to write %s: %s\n", output, strerror(errno));
+		fclose(writer.out);
+		goto end;
+	}
 
+	png_row_callback write_row = opts->ascii ? ppm_write_row_ascii : ppm_write_row;
 
-static inline __attribute__((always_inline)) uint8_t png_avg_filter(uint8_t *line, uint8_t *prev_line, size_t pixel_size, size_t x, size_t i) {
-	uint8_t left = 0;
-	uint8_t top = 0;
+	if (opts->crop)
+		status = png_decoder_decode_region_rows(decoder, &opts->region, write_row, &writer);
+	else if (opts->scale > 1)
+		status = png_decoder_decode_scaled_rows(decoder, opts->scale, write_row, &writer);
+	else
+		status = png_decoder_decode_rows(decoder, write_row, &writer);
 
-	if (x)
-		left = line[pixel_size * (x - 1) + i];
+	if (status) {
+		// write errors have already been reported by the row writer
+		if (status != PNG_ERR_CALLBACK)
+			fprintf(stderr, "%s: %s\n", filename, png_status_string(status));
+		fclose(writer.out);
+		goto end;
+	}
 
-	if (prev_line)
-		top = prev_line[pixel_size * x + i];
+	if (!opts->batch)
+		printf("decompressed IDAT chunks, size %zu\n", info.data_size);
 
-	return ((left + top) / 2) + line[pixel_size * x + i];
-}
+	if (fclose(writer.out)) {
+		fprintf(stderr, "failed to write %s: %s\n", output, strerror(errno));
+		goto end;
+	}
 
-static inline __attribute__((always_inline)) int png_abs(int x) {
-	if (x < 0)
-		return -x;
+	ret = 0;
 
-	return x;
+end:
+	free(derived);
+	png_decoder_close(decoder);
+	png_checkpoints_free(checkpoints);
+	return ret;
 }
 
-static inline __attribute__((always_inline)) uint8_t png_paeth_filter(uint8_t *line, uint8_t *prev_line, size_t pixel_size, size_t x, size_t i) {
-	// using int as calculations "must be performed exactly, without overflow"
-	int a = 0, b = 0, c = 0, d, p;
-	int pa, pb, pc;
+struct batch {
+	pthread_mutex_t lock;
+	const struct options *opts;
 
-	d = line[pixel_size * x + i];
+	// files come from the command line, or one per line from stdin
+	char **files;
+	int file_count;
+	int next;
 
-	if (x)
-		a = line[pixel_size * (x - 1) + i];
+	int failed;
+	struct png_decode_stats stats;
+};
 
-	if (prev_line)
-		b = prev_line[pixel_size * x + i];
+static char *batch_next(struct batch *batch) {
+	char *file = NULL;
 
-	if (prev_line && x)
-		c = prev_line[pixel_size * (x - 1) + i];
+	pthread_mutex_lock(&batch->lock);
 
-	p = a + b - c;
+	if (batch->files) {
+		if (batch->next < batch->file_count)
+			file = strdup(batch->files[batch->next++]);
+	} else {
+		size_t size = 0;
+		ssize_t len;
 
-	pa = png_abs(p - a);
-	pb = png_abs(p - b);
-	pc = png_abs(p - c);
+		// skip empty lines
+		while ((len = getline(&file, &size, stdin)) > 0) {
+			if (file[len - 1] == '\n')
+				file[--len] = '\0';
 
-	if (pa <= pb && pa <= pc)
-		return d + a;
-	if (pb <= pc)
-		return d + b;
+			if (len)
+				break;
+		}
 
-	return d + c;
+		if (len <= 0) {
+			free(file);
+			file = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&batch->lock);
+	return file;
 }
 
-int main(int argc, char **argv) {
-	if(argc != 2) {
-		printf("usage: %s filename\n", argv[0]);
-		return 1;
+static void batch_done(struct batch *batch, int failed, const struct png_decode_stats *stats) {
+	pthread_mutex_lock(&batch->lock);
+
+	if (failed)
+		batch->failed++;
+
+	if (stats)
+		add_stats(&batch->stats, stats);
+
+	pthread_mutex_unlock(&batch->lock);
+}
+
+// every worker owns a workspace, so inflate state and scanline buffers are
+// set up once per thread instead of once per file
+static void *batch_worker(void *arg) {
+	struct batch *batch = arg;
+	struct png_workspace *ws;
+
+	if (png_workspace_create(&ws)) {
+		fprintf(stderr, "failed to create workspace: %s\n", png_status_string(PNG_ERR_NOMEM));
+		batch_done(batch, 1, NULL);
+		return NULL;
 	}
 
-	struct mapped_file file;
-	map_file(argv[1], &file);
+	char *file;
+	while ((file = batch_next(batch))) {
+		struct png_decode_stats stats;
+		memset(&stats, 0, sizeof(stats));
 
-	struct png_state state = {file.ptr, file.size, 0};
+		int failed = convert_file(file, batch->opts, ws, batch->opts->verbose ? &stats : NULL);
+		batch_done(batch, failed, &stats);
 
-	// check header
-	if (png_check(&state)) {
-		fprintf(stderr, "not a png file\n");
-		goto end;
+		free(file);
 	}
 
-	struct png_chunk c;
-	if (png_fetch_next_chunk(&state, &c))
-		goto end;
+	png_workspace_destroy(ws);
+	return NULL;
+}
 
-	assert(!strncmp("IHDR", c.type, 4));
-	assert(c.size == 13);
-	uint32_t width = be_host32(*(uint32_t *)offset_of(c.data, 0));
-	uint32_t height = be_host32(*(uint32_t *)offset_of(c.data, 4));
-	uint8_t bit_depth = *(uint8_t *)offset_of(c.data, 8);
-	uint8_t color_type = *(uint8_t *)offset_of(c.data, 9);
-	uint8_t compression = *(uint8_t *)offset_of(c.data, 10);
-	uint8_t filter = *(uint8_t *)offset_of(c.data, 11);
-	uint8_t interlace = *(uint8_t *)offset_of(c.data, 12);
+static int run_batch(char **files, int file_count, const struct options *opts, long jobs) {
+	struct batch batch = {
+		.opts = opts,
+		.files = file_count ? files : NULL,
+		.file_count = file_count,
+	};
 
-	printf("width: %u, height: %u, bpp: %hhu, color type: %hhu, compression: %hhu, filter: %hhu, interlace: %hhu\n",
-			width, height, bit_depth, color_type, compression, filter, interlace);
+	pthread_mutex_init(&batch.lock, NULL);
 
-	int is_truecolor = color_type & 0b010;
-	int has_palette = color_type & 0b001;
-	int has_alpha = color_type & 0b100;
-	int is_grayscale = !is_truecolor;
+	pthread_t *threads = calloc(jobs, sizeof(*threads));
+	if (!threads) {
+		fprintf(stderr, "failed to start workers: %s\n", png_status_string(PNG_ERR_NOMEM));
+		return 1;
+	}
 
-	assert(is_truecolor && !has_palette);
-	size_t pixel_size = (has_alpha ? 4 : 3) * (bit_depth / 8);
+	long started = 0;
+	for (; started < jobs; started++) {
+		int err = pthread_create(&threads[started], NULL, batch_worker, &batch);
+		if (err) {
+			fprintf(stderr, "failed to start worker: %s\n", strerror(err));
+			break;
+		}
+	}
 
-	assert(filter == 0);
-	assert(interlace == 0); // TODO: add deinterlacing support
+	// carry on with whatever workers we got, if none started do the work here
+	if (!started)
+		batch_worker(&batch);
 
-	size_t raw_size = (width * height * pixel_size) + height;
-	void *raw_data = malloc(raw_size);
+	for (long i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
 
-	if (png_decompress_idat(&state, raw_data, raw_size))
-		goto end;
+	free(threads);
+	pthread_mutex_destroy(&batch.lock);
 
-	printf("decompressed IDAT chunks, size %lu\n", raw_size);
+	if (opts->verbose)
+		print_stats(&batch.stats);
 
-	printf("writing PPM output\n");
+	if (batch.failed)
+		fprintf(stderr, "%d file(s) failed\n", batch.failed);
+
+	return batch.failed ? 1 : 0;
+}
 
-	FILE *out = fopen("foo.ppm", "w");
+int main(int argc, char **argv) {
+	struct options opts = {0};
+	int info = 0;
+	int chunks = 0;
+	int metadata = 0;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	// non-option arguments are gathered at the front of argv
+	char **files = argv + 1;
+	int file_count = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--ascii")) {
+			opts.ascii = 1;
+		} else if (!strcmp(argv[i], "-8") || !strcmp(argv[i], "--8bit")) {
+			opts.eight_bit = 1;
+		} else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--round")) {
+			opts.round = 1;
+		} else if (!strcmp(argv[i], "--no-crc")) {
+			opts.no_crc = 1;
+		} else if (!strcmp(argv[i], "--no-adler")) {
+			opts.no_adler = 1;
+		} else if (!strcmp(argv[i], "--crop") && i + 1 < argc) {
+			struct png_region *r = &opts.region;
+
+			if (sscanf(argv[++i], "%u,%u,%u,%u", &r->x, &r->y, &r->width, &r->height) != 4 || !r->width || !r->height) {
+				usage(argv[0]);
+				return 1;
+			}
 
-	fprintf(out, "P3 %u %u 255\n", width, height);
+			opts.crop = 1;
+		} else if (!strcmp(argv[i], "--scale") && i + 1 < argc) {
+			long scale = strtol(argv[++i], NULL, 10);
 
-	const char *filter_methods[] = {
-		"none",
-		"sub",
-		"up",
-		"average",
-		"paeth"
-	};
+			if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+				usage(argv[0]);
+				return 1;
+			}
 
-	uint8_t *buf = raw_data;
-	for (size_t y = 0; y < height; y++) {
-		uint8_t filter_method = buf[y * (width * pixel_size + 1)];
-		printf("filter method for line: %s\n", filter_methods[filter_method]);
-
-		uint8_t *prev_line = NULL;
-		uint8_t *line = buf + y * (width * pixel_size + 1) + 1;
-
-		if (y)
-			prev_line = buf + (y - 1) * (width * pixel_size + 1) + 1;
-
-		for (size_t x = 0; x < width; x++) {
-			for (size_t i = 0; i < pixel_size; i++) {
-				uint8_t actual_value;
-
-				switch (filter_method) {
-					case 0: // none
-						actual_value = line[x * pixel_size + i];
-						break;
-					case 1: // sub
-						actual_value = png_sub_filter(line, pixel_size, x, i);
-						break;
-					case 2: // up
-						actual_value = png_up_filter(line, prev_line, pixel_size, x, i);
-						break;
-					case 3: // average
-						actual_value = png_avg_filter(line, prev_line, pixel_size, x, i);
-						break;
-					case 4: // paeth
-						actual_value = png_paeth_filter(line, prev_line, pixel_size, x, i);
-						break;
-					default:
-						fprintf(stderr, "invalid filter %hhu\n", filter_method);
-						actual_value = 0xFF;
-				}
-
-				line[x * pixel_size + i] = actual_value; // make filters actually work properly
-
-				if (i < 3)
-					fprintf(out, "%u ", actual_value);
+			opts.scale = (unsigned int)scale;
+		} else if (!strcmp(argv[i], "--checkpoints") && i + 1 < argc) {
+			opts.checkpoints = argv[++i];
+		} else if (!strcmp(argv[i], "--map") && i + 1 < argc) {
+			if (parse_map_mode(argv[++i], &opts.map)) {
+				usage(argv[0]);
+				return 1;
 			}
+		} else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--stats")) {
+			opts.verbose = 1;
+		} else if (!strcmp(argv[i], "-i") || !strcmp(argv[i], "--info")) {
+			info = 1;
+		} else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--chunks")) {
+			chunks = 1;
+		} else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--metadata")) {
+			metadata = 1;
+		} else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--batch")) {
+			opts.batch = 1;
+		} else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			jobs = strtol(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			opts.output = argv[++i];
+		} else if (argv[i][0] != '-' || !strcmp(argv[i], "-")) {
+			files[file_count++] = argv[i];
+		} else {
+			usage(argv[0]);
+			return 1;
 		}
-		fprintf(out, "\n");
 	}
 
-	fclose(out);
+	if (info && file_count)
+		return info_only(files, file_count);
+
+	if (chunks && file_count)
+		return list_chunks(files, file_count);
 
-	/*
-	while(!png_fetch_next_chunk(&state, &c)) {
-		const char *critical_chunks[] = {
-			"IHDR",
-			"PLTE",
-			"IDAT",
-			"IEND",
-		};
+	if (metadata && file_count)
+		return list_metadata(files, file_count);
 
-		int is_critical = 0;
-		for (size_t i = 0; i < ARR_SIZE(critical_chunks) && !is_critical; i++)
-			is_critical = !strncmp(critical_chunks[i], c.type, 4);
+	// a thumbnail is of the whole image
+	if (opts.crop && opts.scale > 1) {
+		usage(argv[0]);
+		return 1;
+	}
 
-		printf("found %s chunk \"%.4s\" of size %u bytes\n", is_critical ? "critical" : "ancillary", c.type, c.size);
+	if (opts.batch) {
+		if (opts.output || opts.checkpoints || jobs < 1) {
+			usage(argv[0]);
+			return 1;
+		}
 
-		if (!is_critical)
-			continue;
+		return run_batch(files, file_count, &opts, jobs);
+	}
 
-		if (!strncmp("IEND", c.type, 4))
-			goto end;
-	}*/
+	if (file_count != 1 || jobs < 1) {
+		usage(argv[0]);
+		return 1;
+	}
 
-	// ...
+	// a single file gets all the jobs for inflating
+	opts.threads = jobs;
 
-end:
-	unmap_file(&file);
+	struct png_decode_stats stats;
+	int ret = convert_file(files[0], &opts, NULL, opts.verbose ? &stats : NULL);
+
+	if (!ret && opts.verbose)
+		print_stats(&stats);
+
+	return ret;
 }
@@ -0,0 +1,540 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "png_decoder.h"
+#include "png_filter.h"
+#include "png_convert.h"
+#include "png_internal.h"
+
+// the signature, then the size, type, payload and crc of IHDR
+#define PNG_PUSH_HEADER_SIZE (8 + 4 + 4 + 13 + 4)
+
+// the largest PLTE and tRNS payloads there can be
+#define PNG_PUSH_PLTE_SIZE (256 * 3)
+#define PNG_PUSH_TRNS_SIZE 256
+
+enum png_push_state {
+	PNG_PUSH_HEADER,      // signature and IHDR
+	PNG_PUSH_CHUNK_START, // size and type of the next chunk
+	PNG_PUSH_CHUNK_DATA,
+	PNG_PUSH_CHUNK_CRC,
+	PNG_PUSH_END,         // past IEND, anything after it is ignored
+};
+
+struct png_push_decoder {
+	enum png_push_state state;
+	int status; // the first error, returned again by every later call
+
+	enum png_format format;
+	int check_crc;
+	png_info_callback info_callback;
+	png_row_callback row_callback;
+	void *ctx;
+
+	// the header, chunk sizes and types and crcs, gathered across feeds
+	uint8_t gather[PNG_PUSH_HEADER_SIZE];
+	size_t gather_fill;
+
+	// the chunk being read
+	char type[4];
+	uint32_t left;
+	uint32_t crc;
+	uint8_t *keep; // where the rest of the payload goes, if it's kept at all
+
+	struct png_info info;
+	int has_info;
+
+	// PLTE and tRNS only count before the image data
+	uint8_t plte[PNG_PUSH_PLTE_SIZE];
+	uint8_t trns[PNG_PUSH_TRNS_SIZE];
+	struct png_palette palette;
+
+	struct png_converter conv;
+	int convert;
+	struct png_unfilter_kernels kernels;
+	size_t pixel_bits;
+	size_t out_bits;
+	size_t out_row_size;
+
+	int data_started; // seen the first IDAT
+	int data_done;    // every row is unfiltered
+
+	// the row being inflated with its filter type byte in front, the one
+	// above it and the converted row
+	uint8_t *lines;
+	uint8_t *line;
+	uint8_t *prev_line;
+	uint8_t *out_line;
+	size_t line_size;
+	size_t line_fill;
+	int has_prev;
+
+	struct png_pass pass;
+	uint32_t pass_y;
+
+	// interlaced images are put together here and handed out at the end
+	uint8_t *image;
+
+#if PNG_INFLATE_STREAMING
+	png_z_stream stream;
+	int stream_ready;
+	int stream_end;
+#else
+	// no streaming inflate, the image data is gathered and inflated at IEND
+	uint8_t *idat;
+	size_t idat_size;
+	size_t idat_capacity;
+#endif
+};
+
+int png_push_decoder_create(struct png_push_decoder **out, enum png_format format, png_info_callback info, png_row_callback rows, void *ctx) {
+	*out = NULL;
+
+	if (!rows || format < PNG_FORMAT_NATIVE || format > PNG_FORMAT_BGRA8_PREMULTIPLIED)
+		return PNG_ERR_ARGUMENT;
+
+	struct png_push_decoder *push = calloc(1, sizeof(*push));
+	if (!push)
+		return PNG_ERR_NOMEM;
+
+	push->format = format;
+	push->check_crc = 1;
+	push->info_callback = info;
+	push->row_callback = rows;
+	push->ctx = ctx;
+
+	*out = push;
+	return PNG_OK;
+}
+
+void png_push_decoder_destroy(struct png_push_decoder *push) {
+	if (!push)
+		return;
+
+#if PNG_INFLATE_STREAMING
+	if (push->stream_ready)
+		PNG_Z(inflateEnd)(&push->stream);
+#else
+	free(push->idat);
+#endif
+
+	free(push->lines);
+	free(push->image);
+	free(push);
+}
+
+void png_push_decoder_set_crc_check(struct png_push_decoder *push, int enabled) {
+	push->check_crc = enabled;
+}
+
+int png_push_decoder_get_info(const struct png_push_decoder *push, struct png_info *out) {
+	if (!push->has_info)
+		return PNG_ERR_TRUNCATED;
+
+	*out = push->info;
+	return PNG_OK;
+}
+
+size_t png_push_decoder_row_size(const struct png_push_decoder *push) {
+	return push->has_info ? push->out_row_size : 0;
+}
+
+// the next pass from index on that has any pixels, 0 once there are none left
+static int png_push_next_pass(struct png_push_decoder *push, unsigned int index) {
+	unsigned int passes = push->info.interlace ? PNG_ADAM7_PASSES : 1;
+
+	for (; index < passes; index++) {
+		png_get_pass(&push->info, index, &push->pass);
+
+		// empty passes aren't stored at all, not even their filter bytes
+		if (!push->pass.width || !push->pass.height)
+			continue;
+
+		push->pass_y = 0;
+		push->line_size = png_pass_row_size(&push->pass, push->pixel_bits) + 1;
+		push->line_fill = 0;
+		push->has_prev = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int png_push_header(struct png_push_decoder *push) {
+	struct png_info *info = &push->info;
+	struct png_state state = {push->gather, sizeof(push->gather), 0};
+
+	int ret = png_read_header(&state, info);
+	if (ret)
+		return ret;
+
+	// rows have to stay addressable in the output format too
+	if (push->format != PNG_FORMAT_NATIVE && (uint64_t)info->width * 4 > SIZE_MAX)
+		return PNG_ERR_UNSUPPORTED;
+
+	push->pixel_bits = png_pixel_bits(info);
+	push->out_row_size = png_format_row_size(info, push->format, info->width);
+
+	// the row size fits, the filter type byte in front of it might not
+	if (info->row_size > (SIZE_MAX - push->out_row_size) / 2 - 1)
+		return PNG_ERR_NOMEM;
+
+	// the caller can turn the image down before anything is allocated for it
+	push->has_info = 1;
+
+	if (push->info_callback && push->info_callback(push->ctx, info))
+		return PNG_ERR_CALLBACK;
+
+	push->lines = malloc((info->row_size + 1) * 2 + push->out_row_size);
+	if (!push->lines)
+		return PNG_ERR_NOMEM;
+
+	push->line = push->lines;
+	push->prev_line = push->lines + info->row_size + 1;
+	push->out_line = push->prev_line + info->row_size + 1;
+
+	if (info->interlace) {
+		if (push->out_row_size && info->height > SIZE_MAX / push->out_row_size)
+			return PNG_ERR_NOMEM;
+
+		// passes only fill in their own bits of partial bytes
+		push->image = calloc(info->height, push->out_row_size);
+		if (!push->image)
+			return PNG_ERR_NOMEM;
+	}
+
+	png_unfilter_select(&push->kernels, info->pixel_size);
+	png_push_next_pass(push, 0);
+	return PNG_OK;
+}
+
+// everything before the image data is known by now
+static int png_push_start_data(struct png_push_decoder *push) {
+	int ret = png_palette_check(&push->info, &push->palette);
+	if (ret)
+		return ret;
+
+	push->convert = png_converter_needed(&push->info, push->format);
+	if (push->convert)
+		png_converter_init(&push->conv, &push->info, &push->palette, push->format, 0);
+
+	push->out_bits = push->convert ? push->conv.pixel_size * 8 : push->pixel_bits;
+
+#if PNG_INFLATE_STREAMING
+	if (PNG_Z(inflateInit)(&push->stream) != Z_OK)
+		return PNG_ERR_NOMEM;
+
+	push->stream_ready = 1;
+#endif
+
+	push->data_started = 1;
+	return PNG_OK;
+}
+
+static int png_push_emit(struct png_push_decoder *push) {
+	for (uint32_t y = 0; y < push->info.height; y++)
+		if (push->row_callback(push->ctx, y, push->image + y * push->out_row_size))
+			return PNG_ERR_CALLBACK;
+
+	return PNG_OK;
+}
+
+// unfilter the row that is complete in line and hand it out
+static int png_push_row(struct png_push_decoder *push) {
+	struct png_pass *pass = &push->pass;
+	uint8_t *row = push->line + 1;
+	const uint8_t *prev_row = push->has_prev ? push->prev_line + 1 : NULL;
+
+	if (png_unfilter_row(&push->kernels, push->line[0], row, prev_row, push->line_size - 1))
+		return PNG_ERR_CORRUPT;
+
+	const uint8_t *out = row;
+	if (push->convert) {
+		push->conv.fn(&push->conv, push->out_line, row, pass->width);
+		out = push->out_line;
+	}
+
+	if (!push->info.interlace) {
+		if (push->row_callback(push->ctx, push->pass_y, out))
+			return PNG_ERR_CALLBACK;
+	} else {
+		size_t y = pass->y + (size_t)push->pass_y * pass->dy;
+		png_scatter_row(push->image + y * push->out_row_size, out, pass, push->out_bits);
+	}
+
+	uint8_t *line = push->line;
+	push->line = push->prev_line;
+	push->prev_line = line;
+	push->line_fill = 0;
+	push->has_prev = 1;
+
+	if (++push->pass_y < pass->height || png_push_next_pass(push, pass->index + 1))
+		return PNG_OK;
+
+	push->data_done = 1;
+	return push->info.interlace ? png_push_emit(push) : PNG_OK;
+}
+
+#if PNG_INFLATE_STREAMING
+
+static int png_push_inflate(struct png_push_decoder *push, const uint8_t *data, size_t size) {
+	png_z_stream *stream = &push->stream;
+
+	// chunk payloads are never more than 2^31 - 1 bytes
+	stream->next_in = (uint8_t *)data;
+	stream->avail_in = (unsigned int)size;
+
+	while (stream->avail_in && !push->stream_end) {
+		uint8_t extra;
+
+		// past the last row there shouldn't be anything left to inflate
+		if (push->data_done) {
+			stream->next_out = &extra;
+			stream->avail_out = 1;
+		} else {
+			stream->next_out = push->line + push->line_fill;
+			stream->avail_out = png_clamp_uint(push->line_size - push->line_fill);
+		}
+
+		int status = PNG_Z(inflate)(stream, Z_NO_FLUSH);
+
+		if (push->data_done) {
+			if (!stream->avail_out)
+				return PNG_ERR_CORRUPT;
+		} else {
+			push->line_fill = stream->next_out - push->line;
+
+			int ret;
+			if (push->line_fill == push->line_size && (ret = png_push_row(push)))
+				return ret;
+		}
+
+		if (status == Z_STREAM_END)
+			push->stream_end = 1;
+		else if (status == Z_MEM_ERROR)
+			return PNG_ERR_NOMEM;
+		else if (status != Z_OK && status != Z_BUF_ERROR)
+			return PNG_ERR_CORRUPT;
+	}
+
+	// the stream ended before the image did
+	if (push->stream_end && !push->data_done)
+		return PNG_ERR_CORRUPT;
+
+	return PNG_OK;
+}
+
+static int png_push_end_data(struct png_push_decoder *push) {
+	return push->data_done && push->stream_end ? PNG_OK : PNG_ERR_CORRUPT;
+}
+
+#else
+
+static int png_push_inflate(struct png_push_decoder *push, const uint8_t *data, size_t size) {
+	if (size > push->idat_capacity - push->idat_size) {
+		size_t capacity = push->idat_capacity ? push->idat_capacity : 65536;
+		while (capacity - push->idat_size < size) {
+			if (capacity > SIZE_MAX / 2)
+				return PNG_ERR_NOMEM;
+			capacity *= 2;
+		}
+
+		uint8_t *idat = realloc(push->idat, capacity);
+		if (!idat)
+			return PNG_ERR_NOMEM;
+
+		push->idat = idat;
+		push->idat_capacity = capacity;
+	}
+
+	memcpy(push->idat + push->idat_size, data, size);
+	push->idat_size += size;
+	return PNG_OK;
+}
+
+// inflate all the image data at once and cut it into rows
+static int png_push_end_data(struct png_push_decoder *push) {
+	if (!push->data_started)
+		return PNG_ERR_CORRUPT;
+
+	uint8_t *data;
+	size_t size;
+
+	int ret = png_inflate_buffer(push->idat, push->idat_size, push->info.data_size, &data, &size);
+	if (ret)
+		return ret == PNG_ERR_NOMEM ? ret : PNG_ERR_CORRUPT;
+
+	free(push->idat);
+	push->idat = NULL;
+	push->idat_size = push->idat_capacity = 0;
+
+	const uint8_t *ptr = data;
+	const uint8_t *end = data + size;
+
+	while (!ret && !push->data_done && ptr < end) {
+		size_t n = push->line_size - push->line_fill;
+		if (n > (size_t)(end - ptr))
+			n = end - ptr;
+
+		memcpy(push->line + push->line_fill, ptr, n);
+		push->line_fill += n;
+		ptr += n;
+
+		if (push->line_fill == push->line_size)
+			ret = png_push_row(push);
+	}
+
+	free(data);
+
+	if (ret)
+		return ret;
+
+	return push->data_done && ptr == end ? PNG_OK : PNG_ERR_CORRUPT;
+}
+
+#endif
+
+// copy up to want bytes in total into the gather buffer, returns how many it took
+static size_t png_push_gather(struct png_push_decoder *push, const uint8_t *data, size_t size, size_t want) {
+	size_t n = want - push->gather_fill;
+	if (n > size)
+		n = size;
+
+	memcpy(push->gather + push->gather_fill, data, n);
+	push->gather_fill += n;
+	return n;
+}
+
+static int png_push_chunk_start(struct png_push_decoder *push) {
+	uint32_t size = png_load_be32(push->gather);
+	memcpy(push->type, push->gather + 4, 4);
+
+	if (size > PNG_CHUNK_MAX_SIZE)
+		return PNG_ERR_CORRUPT;
+
+	push->left = size;
+	push->crc = png_crc32(0, push->type, 4);
+	push->keep = NULL;
+
+	if (!memcmp(push->type, "IDAT", 4)) {
+		int ret;
+		if (!push->data_started && (ret = png_push_start_data(push)))
+			return ret;
+	} else if (!push->data_started && !memcmp(push->type, "PLTE", 4)) {
+		if (size > sizeof(push->plte))
+			return PNG_ERR_CORRUPT;
+
+		push->keep = push->plte;
+		push->palette.plte = push->plte;
+		push->palette.plte_size = size;
+	} else if (!push->data_started && !memcmp(push->type, "tRNS", 4)) {
+		// too long for any color type, png_palette_check would drop it anyway
+		if (size <= sizeof(push->trns)) {
+			push->keep = push->trns;
+			push->palette.trns = push->trns;
+			push->palette.trns_size = size;
+		}
+	}
+
+	push->state = size ? PNG_PUSH_CHUNK_DATA : PNG_PUSH_CHUNK_CRC;
+	return PNG_OK;
+}
+
+static int png_push_chunk_data(struct png_push_decoder *push, const uint8_t *data, size_t size) {
+	if (push->check_crc)
+		push->crc = png_crc32(push->crc, data, size);
+
+	if (push->keep) {
+		memcpy(push->keep, data, size);
+		push->keep += size;
+	}
+
+	if (!memcmp(push->type, "IDAT", 4))
+		return png_push_inflate(push, data, size);
+
+	return PNG_OK;
+}
+
+static int png_push_chunk_end(struct png_push_decoder *push) {
+	if (push->check_crc && png_load_be32(push->gather) != push->crc)
+		return PNG_ERR_CRC;
+
+	if (memcmp(push->type, "IEND", 4)) {
+		push->state = PNG_PUSH_CHUNK_START;
+		return PNG_OK;
+	}
+
+	push->state = PNG_PUSH_END;
+	return png_push_end_data(push);
+}
+
+static int png_push_consume(struct png_push_decoder *push, const uint8_t *data, size_t size) {
+	while (size && push->state != PNG_PUSH_END) {
+		size_t n = 0;
+		int ret = PNG_OK;
+
+		switch (push->state) {
+			case PNG_PUSH_HEADER:
+				n = png_push_gather(push, data, size, PNG_PUSH_HEADER_SIZE);
+				if (push->gather_fill == PNG_PUSH_HEADER_SIZE) {
+					push->gather_fill = 0;
+					push->state = PNG_PUSH_CHUNK_START;
+					ret = png_push_header(push);
+				}
+				break;
+			case PNG_PUSH_CHUNK_START:
+				n = png_push_gather(push, data, size, 8);
+				if (push->gather_fill == 8) {
+					push->gather_fill = 0;
+					ret = png_push_chunk_start(push);
+				}
+				break;
+			case PNG_PUSH_CHUNK_DATA:
+				n = size < push->left ? size : push->left;
+				ret = png_push_chunk_data(push, data, n);
+				push->left -= n;
+				if (!push->left)
+					push->state = PNG_PUSH_CHUNK_CRC;
+				break;
+			case PNG_PUSH_CHUNK_CRC:
+				n = png_push_gather(push, data, size, 4);
+				if (push->gather_fill == 4) {
+					push->gather_fill = 0;
+					ret = png_push_chunk_end(push);
+				}
+				break;
+			case PNG_PUSH_END:
+				break;
+		}
+
+		if (ret)
+			return ret;
+
+		data += n;
+		size -= n;
+	}
+
+	return PNG_OK;
+}
+
+int png_push_decoder_feed(struct png_push_decoder *push, const void *data, size_t size) {
+	if (push->status)
+		return push->status;
+
+	return push->status = png_push_consume(push, data, size);
+}
+
+int png_push_decoder_finish(struct png_push_decoder *push) {
+	if (push->status || push->state == PNG_PUSH_END)
+		return push->status;
+
+	// a stream cut short right after complete image data still has every row
+	int ret = push->data_started ? png_push_end_data(push) : PNG_ERR_TRUNCATED;
+	if (ret == PNG_ERR_CORRUPT)
+		ret = PNG_ERR_TRUNCATED;
+
+	push->state = PNG_PUSH_END;
+	return push->status = ret;
+}
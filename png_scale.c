@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "png_scale.h"
+
+void png_scaler_init(struct png_scaler *scaler, uint32_t width, uint32_t height, size_t pixel_size, unsigned int shift) {
+	uint32_t scale = 1u << shift;
+
+	memset(scaler, 0, sizeof(*scaler));
+	scaler->shift = shift;
+	scaler->pixel_size = pixel_size;
+	scaler->src_width = width;
+	scaler->src_height = height;
+	scaler->width = width / scale + (width % scale != 0);
+	scaler->height = height / scale + (height % scale != 0);
+	scaler->row_size = (size_t)scaler->width * pixel_size;
+}
+
+int png_scaler_alloc(struct png_scaler *scaler, struct png_arena *arena) {
+	if (scaler->row_size > SIZE_MAX / sizeof(*scaler->sums))
+		return PNG_ERR_NOMEM;
+
+	scaler->sums = png_arena_alloc(arena, scaler->row_size * sizeof(*scaler->sums));
+	if (!scaler->sums)
+		return PNG_ERR_NOMEM;
+
+	memset(scaler->sums, 0, scaler->row_size * sizeof(*scaler->sums));
+
+	if (!scaler->dst && !(scaler->row = png_arena_alloc(arena, scaler->row_size)))
+		return PNG_ERR_NOMEM;
+
+	return PNG_OK;
+}
+
+// n is the pixel size; a box's worth of pixels is added up first so the
+// sums are only touched once per box and row
+static inline __attribute__((always_inline)) void png_scaler_add(struct png_scaler *scaler, const uint8_t *row, size_t n) {
+	uint32_t *sums = scaler->sums;
+	uint32_t scale = 1u << scaler->shift;
+	uint32_t x = 0;
+
+	for (uint32_t ox = 0; ox < scaler->width; ox++, sums += n) {
+		uint32_t end = scaler->src_width - x < scale ? scaler->src_width : x + scale;
+		uint32_t box[4] = {0, 0, 0, 0};
+
+		for (; x < end; x++, row += n)
+			for (size_t c = 0; c < n; c++)
+				box[c] += row[c];
+
+		for (size_t c = 0; c < n; c++)
+			sums[c] += box[c];
+	}
+}
+
+// the average of every box rounded to nearest, a shift for whole boxes and
+// a division for the ones cut off by the right or bottom edge
+static void png_scaler_average(struct png_scaler *scaler, uint8_t *out, uint32_t box_height) {
+	uint32_t scale = 1u << scaler->shift;
+	uint32_t *sums = scaler->sums;
+	size_t n = scaler->pixel_size;
+
+	for (uint32_t ox = 0; ox < scaler->width; ox++) {
+		uint32_t box_width = scaler->src_width - ox * scale < scale ? scaler->src_width - ox * scale : scale;
+		uint32_t count = box_width * box_height;
+
+		if (count == scale * scale) {
+			unsigned int shift = scaler->shift * 2;
+			for (size_t c = 0; c < n; c++, sums++, out++)
+				*out = (*sums + (count >> 1)) >> shift;
+		} else {
+			for (size_t c = 0; c < n; c++, sums++, out++)
+				*out = (*sums + count / 2) / count;
+		}
+	}
+}
+
+int png_scaler_emit(void *ctx, size_t y, const uint8_t *row) {
+	struct png_scaler *scaler = ctx;
+
+	if (scaler->dst) {
+		memcpy(scaler->dst + y * scaler->stride, row, scaler->row_size);
+		return 0;
+	}
+
+	return scaler->rows(scaler->ctx, y, row);
+}
+
+int png_scaler_row(void *ctx, size_t y, const uint8_t *row) {
+	struct png_scaler *scaler = ctx;
+	uint32_t mask = (1u << scaler->shift) - 1;
+
+	switch (scaler->pixel_size) {
+		case 1: png_scaler_add(scaler, row, 1); break;
+		case 2: png_scaler_add(scaler, row, 2); break;
+		case 3: png_scaler_add(scaler, row, 3); break;
+		case 4: png_scaler_add(scaler, row, 4); break;
+	}
+
+	// the box isn't complete before its last row, or the image's
+	if ((y & mask) != mask && y + 1 < scaler->src_height)
+		return 0;
+
+	size_t out_y = y >> scaler->shift;
+	uint8_t *out = scaler->dst ? scaler->dst + out_y * scaler->stride : scaler->row;
+
+	png_scaler_average(scaler, out, (y & mask) + 1);
+	memset(scaler->sums, 0, scaler->row_size * sizeof(*scaler->sums));
+
+	return scaler->dst ? 0 : scaler->rows(scaler->ctx, out_y, out);
+}
@@ -0,0 +1,46 @@
+#ifndef PNG_SCALE_H
+#define PNG_SCALE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "png_decoder.h"
+#include "png_arena.h"
+
+#define PNG_SCALE_MAX_SHIFT 3
+
+// box filters full rows into a reduced image as they come: each row is
+// summed up horizontally into one accumulator per output sample, and every
+// scale rows the sums become an output row, so nothing but the sums and one
+// output row is ever held
+struct png_scaler {
+	unsigned int shift;  // log2 of the scale
+	size_t pixel_size;   // bytes per pixel, one per sample
+	uint32_t src_width;
+	uint32_t src_height;
+	uint32_t width;      // of the reduced image
+	uint32_t height;
+	size_t row_size;
+
+	uint32_t *sums;
+	uint8_t *row; // the output row, unless it goes straight to dst
+
+	uint8_t *dst;
+	size_t stride;
+	png_row_callback rows;
+	void *ctx;
+};
+
+void png_scaler_init(struct png_scaler *scaler, uint32_t width, uint32_t height, size_t pixel_size, unsigned int shift);
+
+// the sums and the output row, from the arena of the decode
+int png_scaler_alloc(struct png_scaler *scaler, struct png_arena *arena);
+
+// a row of the full image, in order; a row callback
+int png_scaler_row(void *ctx, size_t y, const uint8_t *row);
+
+// a row of the reduced image, for images that are already reduced when
+// they are decoded; a row callback as well
+int png_scaler_emit(void *ctx, size_t y, const uint8_t *row);
+
+#endif